@@ -0,0 +1,259 @@
+
+#include "bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define WORD_BITS 64
+#define ALL_ONES  (~(uint64_t)0)
+
+struct bitmap * bitmap_create( int nbits )
+{
+	struct bitmap *b = malloc(sizeof(*b));
+	if(!b) return 0;
+
+	b->nbits = nbits;
+	b->nwords = (nbits+WORD_BITS-1)/WORD_BITS;
+	b->nfree = nbits;
+	b->cursor = 0;
+
+	// round the allocation up to 32 bytes so the SIMD scan never reads past the end
+	int padded = (b->nwords+3) & ~3;
+	b->words = calloc(padded ? padded : 1, sizeof(uint64_t));
+	if(!b->words) {
+		free(b);
+		return 0;
+	}
+
+	// bits past the end of the map (and the padding) look permanently allocated
+	int i;
+	for(i=nbits;i<b->nwords*WORD_BITS;i++) {
+		b->words[i/WORD_BITS] |= (uint64_t)1 << (i%WORD_BITS);
+	}
+	for(i=b->nwords;i<padded;i++) {
+		b->words[i] = ALL_ONES;
+	}
+
+	return b;
+}
+
+void bitmap_delete( struct bitmap *b )
+{
+	if(!b) return;
+	free(b->words);
+	free(b);
+}
+
+void bitmap_set( struct bitmap *b, int n )
+{
+	uint64_t mask = (uint64_t)1 << (n%WORD_BITS);
+	uint64_t *w = &b->words[n/WORD_BITS];
+	if(!(*w & mask)) {
+		*w |= mask;
+		b->nfree--;
+	}
+}
+
+void bitmap_clear( struct bitmap *b, int n )
+{
+	uint64_t mask = (uint64_t)1 << (n%WORD_BITS);
+	uint64_t *w = &b->words[n/WORD_BITS];
+	if(*w & mask) {
+		*w &= ~mask;
+		b->nfree++;
+	}
+}
+
+int bitmap_test( struct bitmap *b, int n )
+{
+	return (b->words[n/WORD_BITS] >> (n%WORD_BITS)) & 1;
+}
+
+// return the index of the first word in [w,end) that differs from skip
+//  skip is all ones when looking for a clear bit, and zero when looking for a set bit
+static int find_word( struct bitmap *b, int w, int end, uint64_t skip )
+{
+#if defined(__AVX2__)
+	__m256i pattern = _mm256_set1_epi64x((long long)skip);
+	while((w & 3) && w < end) {
+		if(b->words[w] != skip) return w;
+		w++;
+	}
+	while(w + 4 <= end) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&b->words[w]);
+		if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern)) != -1) break;
+		w += 4;
+	}
+#elif defined(__SSE2__)
+	__m128i pattern = _mm_set1_epi64x((long long)skip);
+	while(w + 2 <= end) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&b->words[w]);
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern)) != 0xffff) break;
+		w += 2;
+	}
+#endif
+	while(w < end) {
+		if(b->words[w] != skip) return w;
+		w++;
+	}
+	return -1;
+}
+
+// return the first bit in [start,end) whose value is (set ? 1 : 0), or -1 if there is none
+static int find_bit( struct bitmap *b, int start, int end, int set )
+{
+	if(end > b->nbits) end = b->nbits;
+	if(start < 0) start = 0;
+	if(start >= end) return -1;
+
+	// invert the words when searching for a clear bit, so that either search looks for a one
+	uint64_t flip = set ? 0 : ALL_ONES;
+	int w = start/WORD_BITS;
+	int lastword = (end+WORD_BITS-1)/WORD_BITS;
+
+	// mask off the bits below start in the first word
+	uint64_t first = (b->words[w] ^ flip) & (ALL_ONES << (start%WORD_BITS));
+	if(!first) {
+		w = find_word(b, w+1, lastword, flip);
+		if(w < 0) return -1;
+		first = b->words[w] ^ flip;
+	}
+
+	int n = w*WORD_BITS + __builtin_ctzll(first);
+	return n < end ? n : -1;
+}
+
+int bitmap_find_clear( struct bitmap *b, int start, int end )
+{
+	return find_bit(b, start, end, 0);
+}
+
+int bitmap_find_set( struct bitmap *b, int start, int end )
+{
+	return find_bit(b, start, end, 1);
+}
+
+// next-fit: find a clear bit at or after the cursor, wrapping once, then set it
+int bitmap_alloc( struct bitmap *b )
+{
+	if(b->nfree == 0) return -1;
+
+	int n = bitmap_find_clear(b, b->cursor, b->nbits);
+	if(n < 0) n = bitmap_find_clear(b, 0, b->cursor);
+	if(n < 0) return -1;
+
+	bitmap_set(b, n);
+	b->cursor = n+1 < b->nbits ? n+1 : 0;
+	return n;
+}
+
+int bitmap_nfree( struct bitmap *b )
+{
+	return b->nfree;
+}
+
+// return the number of set bits in [start,end)
+int bitmap_count( struct bitmap *b, int start, int end )
+{
+	if(end > b->nbits) end = b->nbits;
+	if(start < 0) start = 0;
+	if(start >= end) return 0;
+
+	int w = start/WORD_BITS;
+	int lastword = (end-1)/WORD_BITS;
+	uint64_t lo = ALL_ONES << (start%WORD_BITS);
+	uint64_t hi = ALL_ONES >> (WORD_BITS-1 - (end-1)%WORD_BITS);
+
+	if(w == lastword) return __builtin_popcountll(b->words[w] & lo & hi);
+
+	int n = __builtin_popcountll(b->words[w] & lo) + __builtin_popcountll(b->words[lastword] & hi);
+	for(w++;w<lastword;w++) {
+		n += __builtin_popcountll(b->words[w]);
+	}
+	return n;
+}
+
+// walk the clear runs in [from,to), return the start of the first one at least want bits long
+//  and otherwise remember the longest run seen in *beststart and *bestlen
+static int scan_runs( struct bitmap *b, int from, int to, int want, int *beststart, int *bestlen )
+{
+	int pos = from;
+	while(pos < to) {
+		int start = bitmap_find_clear(b, pos, to);
+		if(start < 0) break;
+
+		int end = bitmap_find_set(b, start, to);
+		if(end < 0) end = to;
+
+		if(end - start >= want) return start;
+		if(end - start > *bestlen) {
+			*beststart = start;
+			*bestlen = end - start;
+		}
+		pos = end;
+	}
+	return -1;
+}
+
+// allocate up to want contiguous bits, starting the search at goal and wrapping once
+//  the first run long enough wins; failing that, the longest run on the map is taken
+//  store the first bit in *start and return the number allocated, or zero if the map is full
+int bitmap_alloc_run( struct bitmap *b, int goal, int want, int *start )
+{
+	if(b->nfree == 0 || want <= 0) return 0;
+	if(goal < 0 || goal >= b->nbits) goal = b->cursor;
+
+	int beststart = -1;
+	int bestlen = 0;
+
+	int n = scan_runs(b, goal, b->nbits, want, &beststart, &bestlen);
+	if(n < 0) n = scan_runs(b, 0, goal, want, &beststart, &bestlen);
+
+	int len = want;
+	if(n < 0) {
+		n = beststart;
+		len = bestlen;
+	}
+	if(n < 0) return 0;
+
+	int i;
+	for(i = 0; i < len; i++) {
+		bitmap_set(b, n+i);
+	}
+	b->cursor = n+len < b->nbits ? n+len : 0;
+	*start = n;
+	return len;
+}
+
+// replace the whole map with a raw image saved by bitmap_store, and recount the free bits
+void bitmap_load( struct bitmap *b, const char *data )
+{
+	memcpy(b->words, data, b->nwords*sizeof(uint64_t));
+
+	int i;
+	for(i=b->nbits;i<b->nwords*WORD_BITS;i++) {
+		b->words[i/WORD_BITS] |= (uint64_t)1 << (i%WORD_BITS);
+	}
+
+	b->nfree = 0;
+	for(i=0;i<b->nwords;i++) {
+		b->nfree += WORD_BITS - __builtin_popcountll(b->words[i]);
+	}
+}
+
+// copy the raw map out to data, which must hold bitmap_bytes(b) bytes
+void bitmap_store( struct bitmap *b, char *data )
+{
+	memcpy(data, b->words, b->nwords*sizeof(uint64_t));
+}
+
+int bitmap_bytes( struct bitmap *b )
+{
+	return b->nwords*sizeof(uint64_t);
+}
@@ -0,0 +1,38 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+/*
+A packed bitmap with one bit per block, where a set bit means the block is in use.
+Searches test 64 bits per step (more with SIMD) and resume from a next-fit cursor,
+and a running count of clear bits is kept so the free space is known without a scan.
+*/
+
+struct bitmap {
+	uint64_t *words;
+	int nbits;
+	int nwords;
+	int nfree;
+	int cursor;
+};
+
+struct bitmap * bitmap_create( int nbits );
+void bitmap_delete( struct bitmap *b );
+
+void bitmap_set( struct bitmap *b, int n );
+void bitmap_clear( struct bitmap *b, int n );
+int  bitmap_test( struct bitmap *b, int n );
+
+int  bitmap_find_clear( struct bitmap *b, int start, int end );
+int  bitmap_find_set( struct bitmap *b, int start, int end );
+int  bitmap_alloc( struct bitmap *b );
+int  bitmap_alloc_run( struct bitmap *b, int goal, int want, int *start );
+int  bitmap_nfree( struct bitmap *b );
+int  bitmap_count( struct bitmap *b, int start, int end );
+
+void bitmap_load( struct bitmap *b, const char *data );
+void bitmap_store( struct bitmap *b, char *data );
+int  bitmap_bytes( struct bitmap *b );
+
+#endif
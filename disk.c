@@ -1,34 +1,654 @@
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "disk.h"
+#include "diskq.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 #define DISK_MAGIC 0xdeadbeef
 
+/* most blocks cache_writeback gathers into one request */
+#define WRITEBACK_MAX 256
+
+/* threads reading ahead for disk_prefetch on the file backend */
+#define PREFETCH_THREADS 4
+
 static FILE *diskfile;
+static char *diskmap=0;
+static struct diskq *diskqueue=0;
+static struct diskq *prefetchqueue=0;
+static int queuefd=-1;
+static int queue_depth=DISK_QUEUE_DEFAULT;
+static int direct=0;
+static int backend=DISK_BACKEND_FILE;
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
+static int nreadreqs=0;
+static int nwritereqs=0;
+
+/*
+The block cache sits between the filesystem and the image file.
+Entries live on an LRU list (head is most recently used) and in a
+chained hash table keyed by block number.  Writes are absorbed in
+the cache and marked dirty; dirty blocks reach the image when they
+are evicted, along with their dirty neighbours, or in ascending
+block order on disk_flush/disk_close.
+*/
+
+struct disk_prefetch;
+
+struct cache_entry {
+	int blocknum;
+	int dirty;
+	struct disk_prefetch *pending;
+	char *data;
+	struct cache_entry *prev;
+	struct cache_entry *next;
+	struct cache_entry *hnext;
+};
+
+static struct cache_entry *cache_entries=0;
+static struct cache_entry **cache_buckets=0;
+static struct cache_entry *lru_head=0;
+static struct cache_entry *lru_tail=0;
+static char *cache_data=0;
+static int cache_size=DISK_CACHE_DEFAULT;
+static int cache_nbuckets=0;
+static int cache_hits=0;
+static int cache_misses=0;
+static int cache_evictions=0;
+static int cache_writebacks=0;
+
+/*
+A prefetch reads blocks straight into cache entries, which stay
+pending until it completes.  On the file backend it goes through a
+small pool of threads of its own, so the reads overlap with the
+caller while demand reads keep going straight to pread.  It is
+finished the first time one of its entries is looked up or chosen
+for eviction, and when the cache is released, so nobody ever sees a
+block before it has arrived.
+*/
+
+struct disk_prefetch {
+	struct disk_request *request;
+	struct disk_io *io;
+	struct cache_entry **entries;
+	int n;
+	struct disk_prefetch *prev;
+	struct disk_prefetch *next;
+};
+
+static struct disk_prefetch *prefetches=0;
+static int prefetch_blocks=0;
+
+/*
+All transfers to the image go through the file descriptor with
+positioned I/O, so that single-block and vectored requests never
+see stale data in a stdio buffer.  With the mmap backend they are
+plain copies to and from the mapping instead, and with the async
+backend they are queued on a diskq, as are prefetches on the file
+backend.  A run moves one or more consecutive blocks;
+nreadreqs/nwritereqs count the runs and nreads/nwrites count the
+blocks moved.
+*/
+
+struct disk_run {
+	struct diskq_req req;
+	struct diskq *queue;
+	int blocknum;
+	struct iovec *iov;
+	int n;
+	int queued;
+	char *bounce;
+	struct iovec biov;
+};
+
+struct disk_request {
+	int write;
+	struct diskq *queue;
+	struct disk_io **list;
+	int n;
+	struct iovec *iov;
+	struct disk_run *runs;
+	int nruns;
+};
+
+static void map_transfer( int blocknum, struct iovec *iov, int n, int write )
+{
+	char *block = diskmap + (size_t)blocknum*DISK_BLOCK_SIZE;
+	int i;
+
+	for(i=0;i<n;i++) {
+		if(write) {
+			memcpy(block,iov[i].iov_base,DISK_BLOCK_SIZE);
+		} else {
+			memcpy(iov[i].iov_base,block,DISK_BLOCK_SIZE);
+		}
+		block += DISK_BLOCK_SIZE;
+	}
+}
+
+static void run_done( struct disk_run *r, ssize_t result, int write )
+{
+	if(result!=(ssize_t)r->n*DISK_BLOCK_SIZE) {
+		printf("ERROR: couldn't access simulated disk: %s\n",result<0 ? strerror(-result) : "short transfer");
+		abort();
+	}
+
+	if(write) {
+		nwrites += r->n;
+		nwritereqs++;
+	} else {
+		nreads += r->n;
+		nreadreqs++;
+	}
+}
+
+static int run_aligned( struct disk_run *r )
+{
+	int i;
+	for(i=0;i<r->n;i++) {
+		if((unsigned long)r->iov[i].iov_base % DISK_BLOCK_SIZE) return 0;
+	}
+	return 1;
+}
+
+/*
+Begin a run on the given queue.  Without one, the file and mmap
+backends finish it on the spot; with one it is queued, staged through
+an aligned bounce buffer if the image was opened with O_DIRECT and
+the caller's buffers are not block aligned.
+*/
+
+static void run_start( struct disk_run *r, int write, struct diskq *queue )
+{
+	off_t offset = (off_t)r->blocknum*DISK_BLOCK_SIZE;
+	ssize_t result;
+	int i;
+
+	r->queue = queue;
+	r->queued = 0;
+	r->bounce = 0;
+
+	if(diskmap) {
+		map_transfer(r->blocknum,r->iov,r->n,write);
+		run_done(r,(ssize_t)r->n*DISK_BLOCK_SIZE,write);
+		return;
+	}
+
+	if(!queue) {
+		if(write) {
+			result = pwritev(fileno(diskfile),r->iov,r->n,offset);
+		} else {
+			result = preadv(fileno(diskfile),r->iov,r->n,offset);
+		}
+		run_done(r,result<0 ? -errno : result,write);
+		return;
+	}
+
+	r->req.write = write;
+	r->req.offset = offset;
+	r->req.iov = r->iov;
+	r->req.iovcnt = r->n;
+
+	if(direct && !run_aligned(r)) {
+		r->bounce = disk_alloc(r->n);
+		if(write) {
+			for(i=0;i<r->n;i++) {
+				memcpy(r->bounce+(size_t)i*DISK_BLOCK_SIZE,r->iov[i].iov_base,DISK_BLOCK_SIZE);
+			}
+		}
+		r->biov.iov_base = r->bounce;
+		r->biov.iov_len = (size_t)r->n*DISK_BLOCK_SIZE;
+		r->req.iov = &r->biov;
+		r->req.iovcnt = 1;
+	}
+
+	diskq_submit(queue,&r->req);
+	r->queued = 1;
+}
+
+static void run_finish( struct disk_run *r )
+{
+	int i;
+
+	if(!r->queued) return;
+
+	diskq_wait(r->queue,&r->req);
+	run_done(r,r->req.result,r->req.write);
+
+	if(r->bounce) {
+		if(!r->req.write) {
+			for(i=0;i<r->n;i++) {
+				memcpy(r->iov[i].iov_base,r->bounce+(size_t)i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+			}
+		}
+		disk_free(r->bounce);
+		r->bounce = 0;
+	}
+	r->queued = 0;
+}
+
+static void raw_transfer( int blocknum, struct iovec *iov, int n, int write )
+{
+	struct disk_run r;
+
+	r.blocknum = blocknum;
+	r.iov = iov;
+	r.n = n;
+	run_start(&r,write,diskqueue);
+	run_finish(&r);
+}
+
+static void raw_read( int blocknum, char *data )
+{
+	struct iovec iov = { data, DISK_BLOCK_SIZE };
+	raw_transfer(blocknum,&iov,1,0);
+}
+
+static void raw_write( int blocknum, const char *data )
+{
+	struct iovec iov = { (char *)data, DISK_BLOCK_SIZE };
+	raw_transfer(blocknum,&iov,1,1);
+}
+
+static int compare_io( const void *a, const void *b )
+{
+	const struct disk_io *x = *(struct disk_io * const *)a;
+	const struct disk_io *y = *(struct disk_io * const *)b;
+	return (x->blocknum>y->blocknum) - (x->blocknum<y->blocknum);
+}
+
+static void *xmalloc( size_t size )
+{
+	void *p = malloc(size ? size : 1);
+	if(!p) {
+		printf("ERROR: out of memory in disk layer\n");
+		abort();
+	}
+	return p;
+}
+
+/*
+Sort a batch by block number and start each run of adjacent blocks
+as a single request on the given queue.  The request takes ownership
+of list.
+*/
+
+static struct disk_request *request_start( struct disk_io **list, int n, int write, struct diskq *queue )
+{
+	struct disk_request *r = xmalloc(sizeof(*r));
+	int i, j;
+
+	r->write = write;
+	r->queue = queue;
+	r->list = list;
+	r->n = n;
+	r->iov = xmalloc(sizeof(struct iovec)*n);
+	r->runs = xmalloc(sizeof(struct disk_run)*n);
+	r->nruns = 0;
+
+	qsort(list,n,sizeof(list[0]),compare_io);
+
+	for(i=0;i<n;i++) {
+		r->iov[i].iov_base = list[i]->data;
+		r->iov[i].iov_len = DISK_BLOCK_SIZE;
+	}
+
+	for(i=0;i<n;i=j) {
+		for(j=i+1;j<n && j-i<IOV_MAX && list[j]->blocknum==list[j-1]->blocknum+1;j++) {}
+
+		struct disk_run *run = &r->runs[r->nruns++];
+		run->blocknum = list[i]->blocknum;
+		run->iov = &r->iov[i];
+		run->n = j-i;
+		run_start(run,write,queue);
+	}
+
+	if(queue) diskq_kick(queue);
+
+	return r;
+}
+
+static void request_finish( struct disk_request *r )
+{
+	int i;
+
+	for(i=0;i<r->nruns;i++) {
+		run_finish(&r->runs[i]);
+	}
+
+	free(r->runs);
+	free(r->iov);
+	free(r->list);
+	free(r);
+}
+
+static void lru_unlink( struct cache_entry *e )
+{
+	if(e->prev) e->prev->next = e->next; else lru_head = e->next;
+	if(e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+	e->prev = e->next = 0;
+}
+
+static void lru_push( struct cache_entry *e )
+{
+	e->prev = 0;
+	e->next = lru_head;
+	if(lru_head) lru_head->prev = e; else lru_tail = e;
+	lru_head = e;
+}
+
+static struct cache_entry **hash_slot( int blocknum )
+{
+	return &cache_buckets[blocknum & (cache_nbuckets-1)];
+}
+
+static struct cache_entry *hash_find( int blocknum )
+{
+	struct cache_entry *e;
+	for(e=*hash_slot(blocknum);e;e=e->hnext) {
+		if(e->blocknum==blocknum) return e;
+	}
+	return 0;
+}
+
+static void prefetch_finish( struct disk_prefetch *p )
+{
+	int i;
+
+	request_finish(p->request);
+	for(i=0;i<p->n;i++) {
+		p->entries[i]->pending = 0;
+	}
+
+	if(p->prev) p->prev->next = p->next; else prefetches = p->next;
+	if(p->next) p->next->prev = p->prev;
+
+	free(p->io);
+	free(p->entries);
+	free(p);
+}
+
+static struct cache_entry *cache_find( int blocknum )
+{
+	struct cache_entry *e = hash_find(blocknum);
+	if(e && e->pending) prefetch_finish(e->pending);
+	return e;
+}
+
+static void hash_remove( struct cache_entry *e )
+{
+	struct cache_entry **p;
+	for(p=hash_slot(e->blocknum);*p;p=&(*p)->hnext) {
+		if(*p==e) {
+			*p = e->hnext;
+			break;
+		}
+	}
+	e->hnext = 0;
+}
+
+/*
+Write back a dirty entry along with the dirty entries on either side
+of it, as one request.  Blocks written one after another, like the
+head of a log, then leave the cache in runs rather than one at a time
+as the LRU list reaches them.
+*/
+
+static void cache_writeback( struct cache_entry *e )
+{
+	struct iovec iov[WRITEBACK_MAX];
+	struct cache_entry *f;
+	int first = e->blocknum;
+	int last = e->blocknum;
+	int i;
+
+	while(last-first+1<WRITEBACK_MAX) {
+		f = hash_find(first-1);
+		if(!f || !f->dirty || f->pending) break;
+		first--;
+	}
+	while(last-first+1<WRITEBACK_MAX) {
+		f = hash_find(last+1);
+		if(!f || !f->dirty || f->pending) break;
+		last++;
+	}
+
+	for(i=first;i<=last;i++) {
+		f = hash_find(i);
+		iov[i-first].iov_base = f->data;
+		iov[i-first].iov_len = DISK_BLOCK_SIZE;
+		f->dirty = 0;
+		cache_writebacks++;
+	}
+	raw_transfer(first,iov,last-first+1,1);
+}
+
+/*
+Take the least recently used entry for blocknum, writing back its
+previous contents if they are dirty.
+*/
+
+static struct cache_entry *cache_claim( int blocknum )
+{
+	struct cache_entry *e = lru_tail;
+
+	if(e->pending) prefetch_finish(e->pending);
+
+	if(e->blocknum>=0) {
+		if(e->dirty) {
+			cache_writeback(e);
+		}
+		hash_remove(e);
+		cache_evictions++;
+	}
+
+	e->blocknum = blocknum;
+	e->dirty = 0;
+	e->hnext = *hash_slot(blocknum);
+	*hash_slot(blocknum) = e;
+
+	lru_unlink(e);
+	lru_push(e);
+	return e;
+}
+
+static void cache_free()
+{
+	while(prefetches) prefetch_finish(prefetches);
+	free(cache_entries);
+	free(cache_buckets);
+	disk_free(cache_data);
+	cache_entries = 0;
+	cache_buckets = 0;
+	cache_data = 0;
+	lru_head = lru_tail = 0;
+}
+
+static int cache_alloc()
+{
+	int i;
+
+	cache_free();
+	if(cache_size<=0) return 1;
+
+	cache_nbuckets = 1;
+	while(cache_nbuckets<cache_size*2) cache_nbuckets *= 2;
+
+	cache_entries = calloc(cache_size,sizeof(struct cache_entry));
+	cache_buckets = calloc(cache_nbuckets,sizeof(struct cache_entry *));
+	cache_data = disk_alloc(cache_size);
+	if(!cache_entries || !cache_buckets || !cache_data) {
+		cache_free();
+		return 0;
+	}
+
+	for(i=0;i<cache_size;i++) {
+		cache_entries[i].blocknum = -1;
+		cache_entries[i].data = &cache_data[(size_t)i*DISK_BLOCK_SIZE];
+		lru_push(&cache_entries[i]);
+	}
+
+	return 1;
+}
 
 int disk_init( const char *filename, int n )
+{
+	return disk_init_backend(filename,n,DISK_BACKEND_FILE);
+}
+
+/*
+Open the image with the given backend.  DISK_BACKEND_MMAP maps the
+whole image, so blocks move with memcpy and no system calls; the
+page cache already holds the data, so the block cache is not used,
+and writes become durable through msync on disk_flush/disk_close.
+
+DISK_BACKEND_ASYNC sends every transfer through a diskq with up to
+disk_queue_depth() requests in flight, on io_uring unless
+DISK_ASYNC_THREADS asks for the thread pool.  DISK_ASYNC_DIRECT
+opens the image with O_DIRECT to bypass the page cache, and quietly
+falls back to buffered I/O where the filesystem refuses it.
+
+DISK_BACKEND_FILE reads and writes with pread/pwrite, except that
+disk_prefetch hands its reads to a pool of PREFETCH_THREADS threads.
+*/
+
+int disk_init_backend( const char *filename, int n, int type )
 {
 	diskfile = fopen(filename,"r+");
 	if(!diskfile) diskfile = fopen(filename,"w+");
 	if(!diskfile) return 0;
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	ftruncate(fileno(diskfile),(off_t)n*DISK_BLOCK_SIZE);
+
+	backend = type & DISK_BACKEND_MASK;
+	diskmap = 0;
+	if(backend==DISK_BACKEND_MMAP && n>0) {
+		void *map = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,fileno(diskfile),0);
+		if(map==MAP_FAILED) {
+			fclose(diskfile);
+			diskfile = 0;
+			return 0;
+		}
+		diskmap = map;
+	}
+
+	direct = 0;
+	queuefd = fileno(diskfile);
+	if(backend==DISK_BACKEND_ASYNC) {
+#ifdef O_DIRECT
+		if(type & DISK_ASYNC_DIRECT) {
+			int fd = open(filename,O_RDWR|O_DIRECT);
+			if(fd>=0) {
+				queuefd = fd;
+				direct = 1;
+			}
+		}
+#endif
+		diskqueue = diskq_create(queuefd,queue_depth,!(type & DISK_ASYNC_THREADS));
+		if(!diskqueue) {
+			if(direct) close(queuefd);
+			fclose(diskfile);
+			diskfile = 0;
+			return 0;
+		}
+	}
 
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	nreadreqs = 0;
+	nwritereqs = 0;
+
+	cache_hits = 0;
+	cache_misses = 0;
+	cache_evictions = 0;
+	cache_writebacks = 0;
+	prefetch_blocks = 0;
+
+	if(diskmap) {
+		cache_free();
+	} else if(!cache_alloc()) {
+		fclose(diskfile);
+		diskfile = 0;
+		return 0;
+	}
+
+	if(backend==DISK_BACKEND_FILE) {
+		prefetchqueue = diskq_create(queuefd,PREFETCH_THREADS,0);
+	}
 
 	return 1;
 }
 
+/*
+Change the number of blocks held in the cache.
+Dirty blocks are written back first, and zero disables the cache.
+*/
+
+int disk_cache_resize( int n )
+{
+	if(n<0) n = 0;
+	if(diskfile) disk_flush();
+	cache_size = n;
+	if(!diskfile || diskmap) return 1;
+	return cache_alloc();
+}
+
+/*
+Number of blocks the cache holds, or zero when it is disabled or
+bypassed by the mmap backend.
+*/
+
+int disk_cache_blocks()
+{
+	return cache_entries ? cache_size : 0;
+}
+
+/*
+Set how many requests the async backend keeps in flight.
+This takes effect at the next disk_init_backend.
+*/
+
+void disk_queue_depth( int n )
+{
+	queue_depth = n>0 ? n : 1;
+}
+
+/*
+Allocate buffers for whole blocks aligned to the block size, so the
+async backend can hand them to O_DIRECT without a bounce copy.
+*/
+
+char * disk_alloc( int n )
+{
+	void *p;
+	if(posix_memalign(&p,DISK_BLOCK_SIZE,(size_t)(n>0 ? n : 1)*DISK_BLOCK_SIZE)!=0) {
+		printf("ERROR: out of memory allocating %d disk blocks\n",n);
+		abort();
+	}
+	return p;
+}
+
+void disk_free( char *data )
+{
+	free(data);
+}
+
 int disk_size()
 {
 	return nblocks;
@@ -54,39 +674,282 @@ static void sanity_check( int blocknum, const void *data )
 
 void disk_read( int blocknum, char *data )
 {
+	struct cache_entry *e;
+
 	sanity_check(blocknum,data);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	if(!cache_entries) {
+		raw_read(blocknum,data);
+		return;
+	}
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	e = cache_find(blocknum);
+	if(e) {
+		cache_hits++;
+		lru_unlink(e);
+		lru_push(e);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		cache_misses++;
+		e = cache_claim(blocknum);
+		raw_read(blocknum,e->data);
 	}
+
+	memcpy(data,e->data,DISK_BLOCK_SIZE);
 }
 
 void disk_write( int blocknum, const char *data )
 {
+	struct cache_entry *e;
+
 	sanity_check(blocknum,data);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	if(!cache_entries) {
+		raw_write(blocknum,data);
+		return;
+	}
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	e = cache_find(blocknum);
+	if(e) {
+		cache_hits++;
+		lru_unlink(e);
+		lru_push(e);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		cache_misses++;
+		e = cache_claim(blocknum);
+	}
+
+	memcpy(e->data,data,DISK_BLOCK_SIZE);
+	e->dirty = 1;
+}
+
+/*
+Start a batch of transfers.  For reads, hits are copied out of the
+cache right away and the misses are started with as few requests as
+adjacency allows.  Writes are absorbed as dirty cache entries when
+the cache is enabled, and otherwise started as coalesced runs.
+Block numbers in one batch should be distinct, and the buffers must
+stay untouched until disk_complete returns.
+*/
+
+struct disk_request * disk_submit( struct disk_io *io, int n, int write )
+{
+	struct disk_io **list;
+	struct cache_entry *e;
+	int i, nlist=0;
+
+	list = xmalloc(sizeof(struct disk_io *)*(n>0 ? n : 1));
+
+	for(i=0;i<n;i++) {
+		sanity_check(io[i].blocknum,io[i].data);
+
+		if(write) {
+			if(cache_entries) {
+				disk_write(io[i].blocknum,io[i].data);
+			} else {
+				list[nlist++] = &io[i];
+			}
+			continue;
+		}
+
+		e = cache_entries ? cache_find(io[i].blocknum) : 0;
+		if(e) {
+			cache_hits++;
+			lru_unlink(e);
+			lru_push(e);
+			memcpy(io[i].data,e->data,DISK_BLOCK_SIZE);
+		} else {
+			if(cache_entries) cache_misses++;
+			list[nlist++] = &io[i];
+		}
+	}
+
+	return request_start(list,nlist,write,diskqueue);
+}
+
+/*
+Start reading blocks into the cache without waiting for them, so a
+later read finds them there.  Blocks already cached are skipped, and
+at most half the cache is claimed at once.  Does nothing when the
+cache is disabled.  On the file backend the reads go to the prefetch
+threads, and if those could not be started they are done here before
+returning.
+*/
+
+void disk_prefetch( const int *blocknums, int n )
+{
+	struct disk_prefetch *p;
+	struct disk_io **list;
+	struct cache_entry *e;
+	int i, m=0;
+
+	if(!cache_entries || n<=0) return;
+	if(n>cache_size/2) n = cache_size/2;
+	if(n<=0) return;
+
+	p = xmalloc(sizeof(*p));
+	p->io = xmalloc(sizeof(struct disk_io)*n);
+	p->entries = xmalloc(sizeof(struct cache_entry *)*n);
+	list = xmalloc(sizeof(struct disk_io *)*n);
+
+	for(i=0;i<n;i++) {
+		sanity_check(blocknums[i],blocknums);
+		if(hash_find(blocknums[i])) continue;
+
+		e = cache_claim(blocknums[i]);
+		e->pending = p;
+		p->io[m].blocknum = blocknums[i];
+		p->io[m].data = e->data;
+		p->entries[m] = e;
+		list[m] = &p->io[m];
+		m++;
+	}
+
+	if(m==0) {
+		free(list);
+		free(p->entries);
+		free(p->io);
+		free(p);
+		return;
+	}
+
+	p->n = m;
+	p->request = request_start(list,m,0,diskqueue ? diskqueue : prefetchqueue);
+	p->prev = 0;
+	p->next = prefetches;
+	if(prefetches) prefetches->prev = p;
+	prefetches = p;
+	prefetch_blocks += m;
+}
+
+/*
+Wait for a batch to finish.  Blocks that were read from the image
+are added to the cache, unless a newer copy got there first.
+*/
+
+void disk_complete( struct disk_request *r )
+{
+	struct cache_entry *e;
+	int i;
+
+	for(i=0;i<r->nruns;i++) {
+		run_finish(&r->runs[i]);
+	}
+
+	if(!r->write && cache_entries) {
+		for(i=0;i<r->n;i++) {
+			if(cache_find(r->list[i]->blocknum)) continue;
+			e = cache_claim(r->list[i]->blocknum);
+			memcpy(e->data,r->list[i]->data,DISK_BLOCK_SIZE);
+		}
 	}
+
+	request_finish(r);
+}
+
+void disk_readv( struct disk_io *io, int n )
+{
+	if(n<=0) return;
+	disk_complete(disk_submit(io,n,0));
+}
+
+void disk_writev( const struct disk_io *io, int n )
+{
+	if(n<=0) return;
+	disk_complete(disk_submit((struct disk_io *)io,n,1));
+}
+
+/*
+Write every dirty block back to the image in ascending block order,
+merging neighbours into single requests so that the writeback is
+as sequential as the dirty set allows.
+*/
+
+void disk_flush()
+{
+	struct disk_io *dirty;
+	struct disk_io **list;
+	int i, n=0;
+
+	if(diskmap) {
+		if(msync(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE,MS_SYNC)<0) {
+			printf("ERROR: couldn't sync simulated disk: %s\n",strerror(errno));
+		}
+		return;
+	}
+
+	if(!diskfile || !cache_entries) return;
+
+	dirty = xmalloc(sizeof(struct disk_io)*cache_size);
+	list = xmalloc(sizeof(struct disk_io *)*cache_size);
+
+	for(i=0;i<cache_size;i++) {
+		if(cache_entries[i].blocknum>=0 && cache_entries[i].dirty) {
+			dirty[n].blocknum = cache_entries[i].blocknum;
+			dirty[n].data = cache_entries[i].data;
+			list[n] = &dirty[n];
+			cache_entries[i].dirty = 0;
+			cache_writebacks++;
+			n++;
+		}
+	}
+
+	request_finish(request_start(list,n,1,diskqueue));
+	free(dirty);
+}
+
+void disk_stats()
+{
+	if(diskqueue) {
+		printf("disk backend: async on %s, queue depth %d%s\n",diskq_name(diskqueue),diskq_depth(diskqueue),direct ? ", O_DIRECT" : "");
+	} else {
+		printf("disk backend: %s\n",diskmap ? "mmap" : "file");
+	}
+	if(prefetchqueue) {
+		printf("    prefetch on %s, %d threads\n",diskq_name(prefetchqueue),diskq_depth(prefetchqueue));
+	}
+	printf("disk cache:\n");
+	if(cache_entries) {
+		printf("    %d blocks (%d KB)\n",cache_size,cache_size*DISK_BLOCK_SIZE/1024);
+	} else {
+		printf("    disabled\n");
+	}
+	printf("    %d hits\n",cache_hits);
+	printf("    %d misses\n",cache_misses);
+	printf("    %d evictions\n",cache_evictions);
+	printf("    %d dirty writebacks\n",cache_writebacks);
+	printf("    %d blocks prefetched\n",prefetch_blocks);
+	printf("    %d image block reads in %d requests\n",nreads,nreadreqs);
+	printf("    %d image block writes in %d requests\n",nwrites,nwritereqs);
 }
 
 void disk_close()
 {
 	if(diskfile) {
+		disk_flush();
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
+		printf("%d read requests, %d write requests\n",nreadreqs,nwritereqs);
+		if(cache_entries) {
+			printf("%d cache hits, %d misses, %d evictions\n",cache_hits,cache_misses,cache_evictions);
+		}
+		cache_free();
+		if(diskmap) {
+			munmap(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE);
+			diskmap = 0;
+		}
+		if(diskqueue) {
+			diskq_delete(diskqueue);
+			diskqueue = 0;
+		}
+		if(prefetchqueue) {
+			diskq_delete(prefetchqueue);
+			prefetchqueue = 0;
+		}
+		if(direct) {
+			close(queuefd);
+			direct = 0;
+		}
 		fclose(diskfile);
 		diskfile = 0;
 	}
 }
-
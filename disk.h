@@ -3,10 +3,46 @@
 
 #define DISK_BLOCK_SIZE 4096
 
+// number of blocks the write-back cache holds unless disk_cache_resize says otherwise
+#define DISK_CACHE_DEFAULT 256
+
+// number of requests the async backend keeps in flight unless disk_queue_depth says otherwise
+#define DISK_QUEUE_DEFAULT 32
+
+// backends for disk_init_backend, the async backend takes the DISK_ASYNC flags
+#define DISK_BACKEND_FILE  0
+#define DISK_BACKEND_MMAP  1
+#define DISK_BACKEND_ASYNC 2
+#define DISK_BACKEND_MASK  0xff
+#define DISK_ASYNC_DIRECT  0x100
+#define DISK_ASYNC_THREADS 0x200
+
+// one block of a vectored request
+struct disk_io {
+	int blocknum;
+	char *data;
+};
+
+// a batch in flight between disk_submit and disk_complete
+struct disk_request;
+
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_backend( const char *filename, int nblocks, int backend );
 int  disk_size();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_readv( struct disk_io *io, int n );
+void disk_writev( const struct disk_io *io, int n );
+struct disk_request * disk_submit( struct disk_io *io, int n, int write );
+void disk_complete( struct disk_request *r );
+void disk_prefetch( const int *blocknums, int n );
+void disk_queue_depth( int n );
+char * disk_alloc( int nblocks );
+void disk_free( char *data );
+int  disk_cache_resize( int nblocks );
+int  disk_cache_blocks();
+void disk_flush();
+void disk_stats();
 void disk_close();
 
 
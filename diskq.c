@@ -0,0 +1,361 @@
+
+#include "diskq.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#define DISKQ_MAX_THREADS 8
+
+/*
+The io_uring rings are driven with raw system calls, so there is no
+dependency on liburing.  pending counts entries placed on the
+submission ring that the kernel has not been told about yet.
+*/
+
+struct uring {
+	int fd;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	void *sqes;
+	void *cqes;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_len;
+	size_t cq_len;
+	size_t sqes_len;
+	unsigned pending;
+};
+
+struct diskq {
+	int fd;
+	int depth;
+	int inflight;
+	int use_uring;
+	struct uring ring;
+
+	pthread_t threads[DISKQ_MAX_THREADS];
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct diskq_req *head;
+	struct diskq_req *tail;
+	int stop;
+};
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+static int uring_enter( struct uring *u, unsigned to_submit, unsigned min_complete, unsigned flags )
+{
+	int result;
+	do {
+		result = syscall(__NR_io_uring_enter,u->fd,to_submit,min_complete,flags,NULL,0);
+	} while(result<0 && errno==EINTR);
+	return result;
+}
+
+static void uring_teardown( struct uring *u )
+{
+	if(u->sqes) munmap(u->sqes,u->sqes_len);
+	if(u->cq_ptr && u->cq_ptr!=u->sq_ptr) munmap(u->cq_ptr,u->cq_len);
+	if(u->sq_ptr) munmap(u->sq_ptr,u->sq_len);
+	if(u->fd>=0) close(u->fd);
+	memset(u,0,sizeof(*u));
+	u->fd = -1;
+}
+
+static int uring_setup( struct uring *u, int depth )
+{
+	struct io_uring_params p;
+
+	memset(u,0,sizeof(*u));
+	memset(&p,0,sizeof(p));
+
+	u->fd = syscall(__NR_io_uring_setup,depth,&p);
+	if(u->fd<0) return 0;
+
+	u->sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	u->cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(u->cq_len>u->sq_len) u->sq_len = u->cq_len;
+		u->cq_len = u->sq_len;
+	}
+
+	u->sq_ptr = mmap(0,u->sq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_SQ_RING);
+	if(u->sq_ptr==MAP_FAILED) {
+		u->sq_ptr = 0;
+		uring_teardown(u);
+		return 0;
+	}
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(0,u->cq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_CQ_RING);
+		if(u->cq_ptr==MAP_FAILED) {
+			u->cq_ptr = 0;
+			uring_teardown(u);
+			return 0;
+		}
+	}
+
+	u->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+	u->sqes = mmap(0,u->sqes_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_SQES);
+	if(u->sqes==MAP_FAILED) {
+		u->sqes = 0;
+		uring_teardown(u);
+		return 0;
+	}
+
+	u->sq_tail = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (char *)u->cq_ptr + p.cq_off.cqes;
+
+	return 1;
+}
+
+static void uring_submit( struct uring *u, struct diskq_req *r, int fd )
+{
+	unsigned tail = *u->sq_tail;
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &((struct io_uring_sqe *)u->sqes)[index];
+
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)r->iov;
+	sqe->len = r->iovcnt;
+	sqe->off = r->offset;
+	sqe->user_data = (unsigned long)r;
+
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail,tail+1,__ATOMIC_RELEASE);
+	u->pending++;
+}
+
+static void uring_kick( struct uring *u )
+{
+	while(u->pending>0) {
+		int result = uring_enter(u,u->pending,0,0);
+		if(result<0) {
+			printf("ERROR: io_uring submit failed: %s\n",strerror(errno));
+			abort();
+		}
+		u->pending -= result;
+	}
+}
+
+// collect finished requests, blocking for at least one if wait is set and none are ready
+static int uring_reap( struct diskq *q, int wait )
+{
+	struct uring *u = &q->ring;
+	int count = 0;
+
+	uring_kick(u);
+
+	while(1) {
+		unsigned head = *u->cq_head;
+		unsigned tail = __atomic_load_n(u->cq_tail,__ATOMIC_ACQUIRE);
+
+		if(head==tail) {
+			if(!wait || count>0) return count;
+			if(uring_enter(u,0,1,IORING_ENTER_GETEVENTS)<0) {
+				printf("ERROR: io_uring wait failed: %s\n",strerror(errno));
+				abort();
+			}
+			continue;
+		}
+
+		while(head!=tail) {
+			struct io_uring_cqe *cqe = &((struct io_uring_cqe *)u->cqes)[head & *u->cq_mask];
+			struct diskq_req *r = (struct diskq_req *)(unsigned long)cqe->user_data;
+			r->result = cqe->res;
+			r->done = 1;
+			q->inflight--;
+			count++;
+			head++;
+		}
+		__atomic_store_n(u->cq_head,head,__ATOMIC_RELEASE);
+	}
+}
+
+#else
+
+static int uring_setup( struct uring *u, int depth ) { return 0; }
+static void uring_teardown( struct uring *u ) {}
+static void uring_submit( struct uring *u, struct diskq_req *r, int fd ) {}
+static void uring_kick( struct uring *u ) {}
+static int uring_reap( struct diskq *q, int wait ) { return 0; }
+
+#endif
+
+static void *worker( void *arg )
+{
+	struct diskq *q = arg;
+	struct diskq_req *r;
+
+	pthread_mutex_lock(&q->lock);
+	while(1) {
+		while(!q->head && !q->stop) {
+			pthread_cond_wait(&q->work,&q->lock);
+		}
+		if(!q->head) break;
+
+		r = q->head;
+		q->head = r->next;
+		if(!q->head) q->tail = 0;
+		pthread_mutex_unlock(&q->lock);
+
+		ssize_t result;
+		if(r->write) {
+			result = pwritev(q->fd,r->iov,r->iovcnt,r->offset);
+		} else {
+			result = preadv(q->fd,r->iov,r->iovcnt,r->offset);
+		}
+
+		pthread_mutex_lock(&q->lock);
+		r->result = result<0 ? -errno : result;
+		r->done = 1;
+		q->inflight--;
+		pthread_cond_broadcast(&q->done);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+struct diskq * diskq_create( int fd, int depth, int uring )
+{
+	struct diskq *q = calloc(1,sizeof(*q));
+	int i;
+
+	if(!q) return 0;
+	if(depth<1) depth = 1;
+
+	q->fd = fd;
+	q->depth = depth;
+	q->ring.fd = -1;
+
+	if(uring && uring_setup(&q->ring,depth)) {
+		q->use_uring = 1;
+		return q;
+	}
+
+	pthread_mutex_init(&q->lock,0);
+	pthread_cond_init(&q->work,0);
+	pthread_cond_init(&q->done,0);
+
+	q->nthreads = depth<DISKQ_MAX_THREADS ? depth : DISKQ_MAX_THREADS;
+	for(i=0;i<q->nthreads;i++) {
+		if(pthread_create(&q->threads[i],0,worker,q)!=0) break;
+	}
+	q->nthreads = i;
+
+	if(q->nthreads==0) {
+		diskq_delete(q);
+		return 0;
+	}
+
+	return q;
+}
+
+void diskq_delete( struct diskq *q )
+{
+	int i;
+
+	if(!q) return;
+
+	if(q->use_uring) {
+		while(q->inflight>0) uring_reap(q,1);
+		uring_teardown(&q->ring);
+	} else {
+		pthread_mutex_lock(&q->lock);
+		q->stop = 1;
+		pthread_cond_broadcast(&q->work);
+		pthread_mutex_unlock(&q->lock);
+		for(i=0;i<q->nthreads;i++) {
+			pthread_join(q->threads[i],0);
+		}
+		pthread_mutex_destroy(&q->lock);
+		pthread_cond_destroy(&q->work);
+		pthread_cond_destroy(&q->done);
+	}
+
+	free(q);
+}
+
+void diskq_submit( struct diskq *q, struct diskq_req *r )
+{
+	r->done = 0;
+	r->result = 0;
+	r->next = 0;
+
+	if(q->use_uring) {
+		while(q->inflight>=q->depth) uring_reap(q,1);
+		uring_submit(&q->ring,r,q->fd);
+		q->inflight++;
+		return;
+	}
+
+	pthread_mutex_lock(&q->lock);
+	while(q->inflight>=q->depth) {
+		pthread_cond_wait(&q->done,&q->lock);
+	}
+	if(q->tail) q->tail->next = r; else q->head = r;
+	q->tail = r;
+	q->inflight++;
+	pthread_cond_signal(&q->work);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+Hand any queued submissions to the kernel without waiting for them.
+The thread pool starts work as soon as it is submitted.
+*/
+
+void diskq_kick( struct diskq *q )
+{
+	if(q->use_uring) uring_kick(&q->ring);
+}
+
+void diskq_wait( struct diskq *q, struct diskq_req *r )
+{
+	if(q->use_uring) {
+		while(!r->done) uring_reap(q,1);
+		return;
+	}
+
+	pthread_mutex_lock(&q->lock);
+	while(!r->done) {
+		pthread_cond_wait(&q->done,&q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+
+const char * diskq_name( struct diskq *q )
+{
+	return q->use_uring ? "io_uring" : "threads";
+}
+
+int diskq_depth( struct diskq *q )
+{
+	return q->depth;
+}
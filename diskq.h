@@ -0,0 +1,38 @@
+#ifndef DISKQ_H
+#define DISKQ_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+An asynchronous queue of positioned vectored reads and writes on one
+file descriptor.  It is built on io_uring when the kernel allows it,
+and otherwise (or when uring is zero) on a pool of threads calling
+preadv/pwritev.  At most depth requests are in flight; diskq_submit
+waits for room when the queue is full.  A request must stay valid
+until diskq_wait returns.
+*/
+
+struct diskq_req {
+	int write;
+	off_t offset;
+	struct iovec *iov;
+	int iovcnt;
+	ssize_t result;
+	int done;
+	struct diskq_req *next;
+};
+
+struct diskq;
+
+struct diskq * diskq_create( int fd, int depth, int uring );
+void diskq_delete( struct diskq *q );
+
+void diskq_submit( struct diskq *q, struct diskq_req *r );
+void diskq_kick( struct diskq *q );
+void diskq_wait( struct diskq *q, struct diskq_req *r );
+
+const char * diskq_name( struct diskq *q );
+int  diskq_depth( struct diskq *q );
+
+#endif
@@ -7,6 +7,9 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "lz.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -15,24 +18,291 @@
 #include <unistd.h>
 
 #include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
+#define INODES_PER_BLOCK   64
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
+#define MAX_DEPTH          3
+
+// readahead follows up to RA_STREAMS sequential readers, keeping a window of RA_MIN_WINDOW to
+//  RA_MAX_WINDOW blocks in flight ahead of each one
+#define RA_STREAMS         8
+#define RA_MIN_WINDOW      4
+#define RA_MAX_WINDOW      256
+
+// images from before the double and triple indirect pointers use 32 byte inodes
+#define LEGACY_INODES_PER_BLOCK 128
+#define BITS_PER_BLOCK     (DISK_BLOCK_SIZE * 8)
+
+// set in a pointer to a data block that fs_fallocate reserved but nothing has written yet, it reads back as zeros
+#define BLOCK_UNWRITTEN    0x40000000
+
+// set in the pointers to the blocks holding a compressed cluster, see clusterWrite()
+#define BLOCK_COMPRESSED   0x20000000
+#define BLOCK_FLAGS        (BLOCK_UNWRITTEN | BLOCK_COMPRESSED)
+
+// a compressed file is stored COMPRESS_CLUSTER logical blocks at a time, each cluster starting at a multiple of it
+#define COMPRESS_CLUSTER   8
+
+// superblock state, images from before the saved bitmap carry zero here and no bitmap blocks
+#define FS_CLEAN           1
+#define FS_DIRTY           2
+#define FS_RESCAN          3	// metadata went home outside the journal, the bitmap must be rebuilt
+
+// the journal takes a sixteenth of the disk, up to JOURNAL_MAX blocks, and disks too small for JOURNAL_MIN go without
+#define JOURNAL_MIN        64
+#define JOURNAL_MAX        4096
+
+// a group commit is made once this many operations, or a quarter of the journal's worth of blocks, have piled up
+#define GROUP_COMMIT_OPS   128
+
+// bits of the isvalid word of an inode
+#define INODE_VALID        1
+#define INODE_INLINE       2	// the file data is kept in the inode, in place of the block pointers
+#define INODE_COMPRESSED   4	// data is written in compressed clusters where that saves space
+#define INODE_PACKED       8	// some cluster has been stored compressed, and may still be
+#define INODE_DEDUP        16	// blocks written in full are shared with any block on disk holding the same data
+#define INODE_CLONED       32	// pointer blocks of the file may be shared with a clone, see fs_clone()
+#define INODE_DIR          64	// the file is a directory, see fs_mkdir()
+#define INODE_FLAGS        127	// all of the above
+
+// the rest of the isvalid word counts the directory entries naming the inode, in units of INODE_LINK
+#define INODE_LINK         256
+#define INODE_LINKS        0x7fffff00
+
+// bytes of file data an inode can hold in place of its block pointers
+#define INLINE_BYTES       56
+
+// a log-structured disk is cut into segments of SEGMENT_BLOCKS, or fewer on a disk that would otherwise have
+//  less than SEGMENT_COUNT of them, but never below SEGMENT_MIN
+#define SEGMENT_BLOCKS     256
+#define SEGMENT_MIN        16
+#define SEGMENT_COUNT      32
+
+// the cleaner runs once fewer than one segment in CLEAN_LOW is clean, reclaims up to CLEAN_BATCH segments a pass,
+//  and moves live blocks CLEAN_COPY at a time
+#define CLEAN_LOW          8
+#define CLEAN_BATCH        8
+#define CLEAN_COPY         256
+
+#define CHECKPOINT_MAGIC   0x636b7074
 
 // globals
-int *FREE_BLOCK_BITMAP = NULL;
+struct bitmap *FREE_BLOCK_BITMAP = NULL;
 int MOUNTED_FLAG = 0;
+struct fs_file *OPEN_FILES = NULL;
+int CLEANER_POLICY = FS_CLEANER_COST_BENEFIT;
 
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int bitmapstart;	// first block of the saved free block bitmap
+	int nbitmapblocks;	// zero on images formatted without one
+	int state;		// FS_CLEAN once unmounted, FS_DIRTY while mounted
+	int inodesize;		// bytes per on-disk inode, zero for the legacy 32 byte layout
+	int journalstart;	// first block of the metadata journal
+	int njournalblocks;	// zero on images formatted without one
+	int segstart;		// first block of the log on a log-structured disk
+	int segblocks;		// blocks per segment, zero on images with the in-place layout
+	int nsegments;
+	int ckptstart;		// first block of the two checkpoint regions, which take turns
+	int nckptblocks;	// blocks in each
+	int refstart;		// first block of the block reference table, zero on a log-structured disk, where it is in the log
+	int nrefblocks;		// zero on images formatted without one
+	int rootdir;		// inumber of the root directory, zero until a path is first used
+};
+
+// first block of a checkpoint region, followed by the inode map and the segment ages, with the free block
+//  bitmap in the last blocks of the region
+struct fs_checkpoint {
+	int magic;
+	int sequence;
+	int clock;
+	uint32_t checksum;	// over the sequence, the clock and the rest of the region
 };
 
 struct fs_inode {
+	int isvalid;
+	int size;
+	union {
+		struct {
+			int direct[POINTERS_PER_INODE];
+			int indirect;
+			int dindirect;		// double indirect block
+			int tindirect;		// triple indirect block
+			int reserved[6];
+		};
+		char data[INLINE_BYTES];	// contents of an INODE_INLINE file
+	};
+};
+
+// head of the first block of a compressed cluster, the compressed data follows it and runs on through the
+//  other blocks of the cluster in the order of their pointers
+struct fs_cluster {
+	uint32_t length;	// bytes of compressed data
+	uint32_t size;		// bytes they decompress to, the rest of the cluster is zeros
+};
+
+// an entry of the block reference table, which has one for every block of the disk
+struct fs_blockref {
+	uint32_t hash;		// fingerprint of the data, zero unless the block is in the dedup index
+	uint32_t refs;		// references to the block besides the first, from blocks shared by dedup or a clone
+};
+
+#define REFS_PER_BLOCK     ((int) (DISK_BLOCK_SIZE / sizeof(struct fs_blockref)))
+
+// the dedup index starts out with DEDUP_SLOTS slots and doubles whenever it is half full
+#define DEDUP_SLOTS        1024
+
+// a directory is a file laid out for extendible hashing, block 0 holds its header, the blocks from DIR_TABLE hold a
+//  table of 2^depth bucket numbers indexed by the low bits of the hash of a name, and the buckets, a block each,
+//  follow from DIR_BUCKETS, so a lookup reads the header, one block of the table and one bucket however large
+//  the directory grows
+#define DIR_MAGIC          0x64697268
+#define DIR_MAX_DEPTH      16
+#define DIR_TABLE          1
+#define DIR_SLOTS          ((int) (DISK_BLOCK_SIZE / sizeof(int)))	// table entries per block
+#define DIR_BUCKETS        (DIR_TABLE + (1 << DIR_MAX_DEPTH) / DIR_SLOTS)
+
+struct fs_dirhead {
+	int magic;
+	int depth;		// bits of the hash the table is indexed by
+	int nbuckets;
+	int nentries;
+	int parent;		// inumber of the directory holding this one, the root directory holds itself
+};
+
+// head of a bucket, the entries follow it packed one after another, each an inumber, the hash of the name, the
+//  length of the name and the name itself without a terminating zero
+struct fs_dirbucket {
+	uint16_t depth;		// bits of the hash every entry of the bucket has in common
+	uint16_t count;
+	uint16_t used;		// bytes taken by the entries
+	uint16_t unused;
+};
+
+#define DIRENT_HEAD        9
+
+// fs_defrag moves the blocks of a file up to DEFRAG_BATCH at a time, and takes a file as fragmented when it is in
+//  more extents than one for every DEFRAG_EXTENT blocks
+#define DEFRAG_BATCH       256
+#define DEFRAG_EXTENT      64
+
+// fs_fsck reads the inode table and the pointer blocks FSCK_BATCH blocks at a time and hands each batch to a pool
+//  of workers, printing the first FSCK_REPORT problems of each kind and counting the rest
+#define FSCK_BATCH         1024
+#define FSCK_MAX_WORKERS   64
+#define FSCK_REPORT        10
+
+// no file can map a logical block past this one, sizes being ints
+#define FSCK_MAX_INDEX     ((long long) INT_MAX / DISK_BLOCK_SIZE + 1)
+
+// kinds of problem fs_fsck finds
+#define FSCK_INODE         0	// an inode with flags no version sets
+#define FSCK_POINTER       1	// a pointer outside the data blocks, or past the largest file
+#define FSCK_SIZE          2	// a size short of the blocks the file maps
+#define FSCK_SHARED        3	// a block claimed more often than its reference count allows
+#define FSCK_LEAK          4	// a block in use in the bitmap that nothing claims
+#define FSCK_FREE          5	// a block something claims that is free in the bitmap
+#define FSCK_REFS          6	// a reference count higher than the claims on the block
+#define FSCK_DIR           7	// a damaged directory header or entry
+#define FSCK_LINKS         8	// a link count that differs from the names of the inode
+#define FSCK_KINDS         9
+
+// a growing array of items found by one worker
+struct fs_fsck_list {
+	char *items;
+	int n;
+	int capacity;
+};
+
+// a pointer block or a directory bucket for the workers to look at
+struct fs_fsck_block {
+	int blocknum;
+	int inumber;
+	int height;		// of a pointer block, zero for a bucket
+	int dirty;		// changed by a repair and to be written back
+	long long base;		// logical block mapped by its first pointer, or the logical block of a bucket
+};
+
+// a claim on a block that another claim got to first
+struct fs_fsck_claim {
+	int blocknum;
+	int inumber;
+	int height;		// zero for a data block
+	int parent;		// pointer block holding the claim, zero for the inode
+	int slot;		// pointer of the parent, or of the inode, the direct ones and then the roots by depth
+};
+
+// a data block of a directory
+struct fs_fsck_dirblock {
+	int inumber;
+	int index;
+	int blocknum;
+};
+
+struct fs_fsck;
+
+struct fs_fsck_worker {
+	struct fs_fsck *c;
+	int id;
+	struct fs_fsck_list found[MAX_DEPTH];	// pointer blocks to look at next, by height
+	struct fs_fsck_list claims;
+	struct fs_fsck_list dirblocks;
+};
+
+struct fs_fsck {
+	struct fs_superblock super;
+	int repair;
+	int per_block;
+	int start;			// first block files may point at
+	int end;			// one past the last
+	struct fs_inode *inodes;	// the whole inode table
+	char *dirty;			// inode blocks changed by repairs
+	struct bitmap *used;		// ownership map, a bit set by the first claim on each block
+	int *owner;			// inumber behind that claim, zero for metadata
+	uint32_t *extra;		// claims after the first
+	int *last;			// logical blocks each inode maps, one past the highest
+	int *names;			// directory entries naming each inode
+	int *entries;			// entries found in each directory
+	int links;			// zero if some directory could not be read, so names are not all counted
+
+	// the batch the workers are on, and what they do with it
+	char *buffer;
+	struct fs_fsck_block *items;
+	int first;
+	int n;
+	void (*run)( struct fs_fsck_worker *w, int first, int last );
+
+	int nworkers;
+	struct fs_fsck_worker workers[FSCK_MAX_WORKERS];
+	pthread_t threads[FSCK_MAX_WORKERS];
+	pthread_barrier_t go;
+	pthread_barrier_t done;
+	int quit;
+
+	pthread_mutex_t lock;
+	int problems[FSCK_KINDS];
+	int repaired[FSCK_KINDS];
+	long long reads;
+};
+
+struct fs_legacy_inode {
 	int isvalid;
 	int size;
 	int direct[POINTERS_PER_INODE];
@@ -41,637 +311,6081 @@ struct fs_inode {
 
 union fs_block {
 	struct fs_superblock super;
+	struct fs_checkpoint checkpoint;
+	struct fs_dirhead dirhead;
+	struct fs_dirbucket bucket;
 	struct fs_inode inode[INODES_PER_BLOCK];
+	struct fs_legacy_inode legacy[LEGACY_INODES_PER_BLOCK];
 	int pointers[POINTERS_PER_BLOCK];
 	char data[DISK_BLOCK_SIZE];
 };
 
-// creates a new filesystem on the disk, destroying any data already present
-//  sets aside ten percent of the blocks for inodes, clears the inode table, and writes the superblock
-//  returns one on success, zero otherwise
-//  an attempt to format an already-mounted disk should do nothing and return zero
-int fs_format()
+// the pointer blocks last visited at each level of the block tree, so that neighbouring lookups in a
+//  file read every pointer block once, and changes to them are written back once when the walk moves on
+struct fs_walk {
+	int blocknum[MAX_DEPTH];
+	int dirty[MAX_DEPTH];
+	union fs_block block[MAX_DEPTH];
+};
+
+// a reader fs_read has seen, and the data blocks prefetched into the disk cache ahead of it
+struct fs_readahead {
+	int inumber;			// zero for an unused stream
+	int next;			// logical block a sequential reader asks for next
+	int window;			// blocks to keep ahead of the reader, zero after random access
+	int start;			// logical blocks [start,end) have been prefetched
+	int end;
+	int consumed;			// prefetched blocks below this one have been read
+	unsigned age;			// for recycling the least recently used stream
+};
+
+// an open file, holding its logical to physical block map decoded once by fs_open
+//  the map goes stale when the file is changed other than through this handle, and is decoded again on next use
+struct fs_file {
+	int inumber;
+	int *map;			// disk block of each logical block, zero where there is none
+	int nmap;			// logical blocks covered by map
+	int capacity;
+	int stale;
+	struct fs_file *prev;
+	struct fs_file *next;
+};
+
+// resident copy of the superblock and inode table, inode blocks are read in the first time they are needed
+//  inode lookups are served from memory, and only inode blocks marked dirty are written back
+struct fs_mount_state {
+	struct fs_superblock super;
+	struct fs_inode *inodes;	// ninodes entries, inumber n lives at inodes[n-1]
+	int inodes_per_block;		// 128 for legacy images, INODES_PER_BLOCK otherwise
+	char *loaded;			// one flag per inode block
+	char *dirty;			// one flag per inode block
+	int ndirty;
+
+	// free inumbers among the resident inode blocks, a set bit is an inode in use or one not read in yet
+	//  the cursor is kept at or below the lowest free inumber so new inodes pack into the same blocks
+	struct bitmap *inodemap;
+	int nextload;			// inode blocks below this one have all been read in
+
+	// metadata traffic counters, reported by fs_stats()
+	int inode_block_reads;
+	int inode_block_writes;
+	int inode_lookups;
+	int data_block_reads;
+	int data_block_writes;
+
+	struct fs_readahead readahead[RA_STREAMS];
+	unsigned ra_clock;
+	int ra_blocks;			// blocks prefetched
+	int ra_hits;			// prefetched blocks that were then read
+	int ra_waste;			// prefetched blocks dropped without being read
+
+	int hole_reads;			// blocks read as zeros without touching the disk
+	int inline_reads;		// reads answered from data kept in the inode
+	int zero_writes;		// all-zero blocks fs_write left unallocated
+
+	// the last compressed cluster read or written, so a cluster read or rewritten a piece at a time is
+	//  only decompressed once
+	char *cluster;
+	int cluster_inumber;		// zero when none is held
+	int cluster_index;
+
+	int compress_clusters;		// clusters written compressed
+	int compress_raw;		// clusters that did not compress and were written as they are
+	int compress_saved;		// blocks the compressed clusters did not need
+	int compress_reads;		// clusters read and decompressed
+	int compress_hits;		// cluster reads served from the one held in memory
+
+	// the block reference table, resident while mounted, and the dedup index built from the fingerprints in
+	//  it, an open addressed table of block numbers placed by fingerprint, NULL on images without one
+	struct fs_blockref *refs;
+	char *refdirty;			// one flag per table block
+	int nrefdirty;
+	int *refmap;			// disk block of each table block on a log-structured disk, zero for one never written
+	int *dedup_index;		// zero for an empty slot
+	int dedup_slots;		// a power of two
+	int dedup_entries;
+
+	int dedup_hashed;		// blocks fingerprinted on their way to disk
+	int dedup_hits;			// of those, blocks shared with one already there instead of written
+	int dedup_verify;		// blocks read to check a fingerprint match
+	int dedup_mismatch;		// matches that turned out to hold other data
+	double dedup_cpu;		// seconds spent fingerprinting and looking up
+
+	int clones;			// files cloned
+	int cow_data;			// shared data blocks copied to be written
+	int cow_pointers;		// shared pointer blocks copied to be changed
+
+	int dir_lookups;		// names looked up in a directory
+	int dir_reads;			// directory blocks those lookups read
+	int dir_splits;			// buckets split in two
+	int dir_doublings;		// directory tables doubled
+	int rootdir;			// root directory once checked since the mount, zero before
+
+	// fs_defrag works through a queue of the most fragmented files, and may stop in the middle of one when its
+	//  budget runs out, to go on from there the next time
+	int *defrag_queue;
+	int defrag_nqueue;
+	int defrag_pos;
+	int defrag_inumber;		// file it stopped in the middle of, zero for none
+	int defrag_index;		// logical block of that file to go on from
+	int defrag_next;		// block after the last one moved, where the rest of the file should go
+	int defrag_extents;		// extents the file was in when it was started
+	int defrag_count;		// blocks of the file moved so far
+	double defrag_rate;		// sequential read throughput of the file when it was started, in MB/s
+	int defrag_files;		// files defragmented
+	int defrag_moved;		// blocks moved to do so
+	int defrag_kept;		// shared blocks left where they were
+
+	// metadata changes go through the journal when the disk has one, blocks freed since the last commit
+	//  stay allocated until it is on disk, and those with an older copy in the journal until a checkpoint
+	struct journal *journal;
+	char *bitmap_image;		// the saved free block bitmap as of the last commit
+	struct bitmap *freed;
+	struct bitmap *logfreed;
+	int ops;			// operations since the last commit
+
+	// a log-structured disk writes every block at the head of the log and never overwrites anything the last
+	//  checkpoint refers to, blocks freed since then are held back in freed and bitmap_image is its bitmap
+	int *imap;			// disk block of each inode block, zero for one never written
+	int *segage;			// log clock when each segment was last written
+	char *victim;			// segments being cleaned, never reopened meanwhile, numbered from one as they are taken
+	int clock;
+	int segment;			// segment the head of the log is in, -1 before the first block is written
+	int head;			// next block of the log
+	int nclean;			// clean segments besides the current one, a lower bound between recounts
+	int sequence;			// number of the last checkpoint
+
+	int log_blocks;			// blocks written at the head of the log
+	int log_checkpoints;
+	int clean_passes;
+	int clean_segments;		// segments the cleaner reclaimed
+	int clean_copied;		// live blocks it moved to do so
+};
+
+static struct fs_mount_state MOUNT_STATE;
+
+static int allocExtents( int goal, int n, int *blocks );
+static int blockOverhead( int first, int last );
+static int *blockEntry( struct fs_walk *walk, int inumber, struct fs_inode *inode, int index, const int *reserved, int *next, int nreserved );
+static int blockAssign( struct fs_walk *walk, int inumber, struct fs_inode *inode, int index, const int *reserved, int *next, int nreserved );
+static long long maxBlocks();
+static int maxDepth();
+static int blockPath( int index, int *slots );
+static void walkInit( struct fs_walk *walk );
+static void walkFlush( struct fs_walk *walk );
+static void blockMap( struct fs_inode *inode, int first, int count, int *blocknums );
+static int blockLookup( struct fs_walk *walk, struct fs_inode *inode, int index );
+static int blockSet( struct fs_walk *walk, int inumber, struct fs_inode *inode, int index, int blocknum );
+static int pathShared( struct fs_walk *walk, struct fs_inode *inode, int index );
+static int blockNumber( int ptr );
+static int inlinePromote( struct fs_file *f, int inumber, struct fs_inode *inode );
+static void markPointerBlocks( const int *blocks, int n, int height );
+static int *blockRoot( struct fs_inode *inode, int depth );
+static void blockFreeTree( int blocknum, int height );
+static int logAlloc( int meta );
+static void logRelease( int blocknum );
+static int inVictim( int blocknum );
+static void logOp();
+static void clusterDrop( int inumber );
+static void inodeDelete( int inumber, struct fs_inode *inode );
+static int superValid( const struct fs_superblock *super );
+
+// number of inodes in each inode block of the given filesystem
+static int inodesPerBlock( const struct fs_superblock *super )
 {
-	union fs_block block;
+	return super->inodesize == 0 ? LEGACY_INODES_PER_BLOCK : INODES_PER_BLOCK;
+}
 
-	// if disk is already mounted
-	if(MOUNTED_FLAG == 1){
-		printf("ERROR: filesystem already mounted\n");
-		return 0;
+// unpack the inodes of an inode block into the in-memory layout, legacy inodes have no double or
+//  triple indirect pointers
+static void inodeDecode( const struct fs_superblock *super, const union fs_block *block, struct fs_inode *inodes )
+{
+	if(super->inodesize != 0){
+		memcpy(inodes, block->inode, sizeof(block->inode));
+		return;
 	}
 
-	// set super block data
-	block.super.magic = FS_MAGIC;
-	block.super.nblocks = disk_size();
-	block.super.ninodeblocks = ceil(block.super.nblocks * (0.10));
-	block.super.ninodes = block.super.ninodeblocks * INODES_PER_BLOCK;
+	memset(inodes, 0, sizeof(struct fs_inode) * LEGACY_INODES_PER_BLOCK);
+	int j;
+	for(j = 0; j < LEGACY_INODES_PER_BLOCK; j++){
+		inodes[j].isvalid = block->legacy[j].isvalid;
+		inodes[j].size = block->legacy[j].size;
+		memcpy(inodes[j].direct, block->legacy[j].direct, sizeof(inodes[j].direct));
+		inodes[j].indirect = block->legacy[j].indirect;
+	}
+}
 
-	// destory any data already present on disk by making all valid inodes invalid
-	char raw_data[4096] = {0};
-	char *data = raw_data;
-	int i;
-	for(i = 1; i <= block.super.ninodeblocks; i++){
-		// could read data from inode block and check for validity before writting, but that
-		//  would mean more reads...
-		disk_write(i, data);
+// pack in-memory inodes back into an inode block
+static void inodeEncode( const struct fs_superblock *super, const struct fs_inode *inodes, union fs_block *block )
+{
+	if(super->inodesize != 0){
+		memcpy(block->inode, inodes, sizeof(block->inode));
+		return;
 	}
-	
-	disk_write(0, block.data);
 
-	return 1;
+	int j;
+	for(j = 0; j < LEGACY_INODES_PER_BLOCK; j++){
+		block->legacy[j].isvalid = inodes[j].isvalid;
+		block->legacy[j].size = inodes[j].size;
+		memcpy(block->legacy[j].direct, inodes[j].direct, sizeof(inodes[j].direct));
+		block->legacy[j].indirect = inodes[j].indirect;
+	}
+}
 
+// returns one if a file keeps its data in the inode rather than in data blocks
+static int inodeInline( const struct fs_inode *inode )
+{
+	return (inode->isvalid & INODE_INLINE) != 0;
 }
 
-// scan a mounted filesystem and report on how the inodes and blocks are organized
-void fs_debug()
+// returns one if the mounted disk has the log-structured layout
+static int logMode()
 {
-	union fs_block block;
+	return MOUNT_STATE.super.segblocks > 0;
+}
 
-	disk_read(0, block.data);
+// inode blocks are numbered from 1, right after the superblock
+static int inodeBlock( int inumber )
+{
+	return ((inumber-1) / MOUNT_STATE.inodes_per_block) + 1;
+}
 
-	printf("superblock:\n");
+// where inode block i is on disk, the inode map knows on a log-structured disk and zero there means never written
+static int inodeLocation( int i )
+{
+	return logMode() ? MOUNT_STATE.imap[i-1] : i;
+}
 
-	// check for valid magic number
-	if(block.super.magic == FS_MAGIC){
-		printf("    magic number is valid\n");
+// hand the open inodes of a freshly read inode block to the inode map
+static void inodeLoaded( int i )
+{
+	struct bitmap *map = MOUNT_STATE.inodemap;
+
+	MOUNT_STATE.loaded[i-1] = 1;
+
+	int inumber;
+	for(inumber = (i-1) * MOUNT_STATE.inodes_per_block + 1; inumber <= i * MOUNT_STATE.inodes_per_block; inumber++){
+		if(MOUNT_STATE.inodes[inumber-1].isvalid) continue;
+		bitmap_clear(map, inumber);
+		if(inumber < map->cursor) map->cursor = inumber;
+	}
+}
+
+// make sure inode block i is resident
+static void inodeLoad( int i )
+{
+	if(MOUNT_STATE.loaded[i-1]) return;
+
+	union fs_block block;
+	int blocknum = inodeLocation(i);
+	if(blocknum){
+		disk_read(blocknum, block.data);
+		MOUNT_STATE.inode_block_reads++;
 	}
 	else{
-		printf("    magic number is invalid\n");
+		memset(block.data, 0, DISK_BLOCK_SIZE);
 	}
+	inodeDecode(&MOUNT_STATE.super, &block, &MOUNT_STATE.inodes[(i-1) * MOUNT_STATE.inodes_per_block]);
+	inodeLoaded(i);
+}
 
-	printf("    %d blocks on disk\n", block.super.nblocks);
-	printf("    %d block(s) for inodes\n", block.super.ninodeblocks);
-	printf("    %d inodes total\n", block.super.ninodes);
+// take the lowest free inumber from the inode map, reading in more of the inode table only when
+//  every resident inode is in use, returns zero if the table is full
+static int inodeAlloc()
+{
+	struct bitmap *map = MOUNT_STATE.inodemap;
 
-	// read inode data from each inode block, starting at block 1
-	int i;
-	for(i = 1; i <= block.super.ninodeblocks; i++){
-		disk_read(i, block.data);
+	while(1){
+		if(bitmap_nfree(map) > 0){
+			int inumber = bitmap_find_clear(map, map->cursor, map->nbits);
+			if(inumber > 0){
+				bitmap_set(map, inumber);
+				map->cursor = inumber + 1;
+				return inumber;
+			}
+		}
 
-		// for each inode in the block with a valid bit...
-		int j;
-		for(j = 0; j < INODES_PER_BLOCK; j++){
+		while(MOUNT_STATE.nextload <= MOUNT_STATE.super.ninodeblocks && MOUNT_STATE.loaded[MOUNT_STATE.nextload-1]){
+			MOUNT_STATE.nextload++;
+		}
+		if(MOUNT_STATE.nextload > MOUNT_STATE.super.ninodeblocks){
+			return 0;
+		}
+		inodeLoad(MOUNT_STATE.nextload);
+	}
+}
 
-			if(block.inode[j].isvalid){
-				// print inode number and size
-				int inumber = ((i-1) * 128) + (j+1);
-				printf("inode %d:\n", inumber);
-				printf("    size: %d bytes\n", block.inode[j].size);
+// return an inumber to the inode map
+static void inodeRelease( int inumber )
+{
+	struct bitmap *map = MOUNT_STATE.inodemap;
 
-				// print inode direct blocks if they are not NULL (0)
-				printf("    direct blocks: ");
-				int k;
-				for(k = 0; k < POINTERS_PER_INODE; k++){
-					if(block.inode[j].direct[k]){
-						printf("%d ", block.inode[j].direct[k]);
-					}
-				}
-				printf("\n");
+	bitmap_clear(map, inumber);
+	if(inumber < map->cursor) map->cursor = inumber;
+}
+
+// return the resident inode for inumber, or NULL if it is out of range
+static struct fs_inode *inodeLookup( int inumber )
+{
+	if(inumber < 1 || inumber > MOUNT_STATE.super.ninodes){
+		return NULL;
+	}
+	inodeLoad(inodeBlock(inumber));
+	MOUNT_STATE.inode_lookups++;
+	return &MOUNT_STATE.inodes[inumber-1];
+}
+
+static void inodeDirty( int inumber )
+{
+	int i = inodeBlock(inumber);
+	if(!MOUNT_STATE.dirty[i-1]){
+		MOUNT_STATE.dirty[i-1] = 1;
+		MOUNT_STATE.ndirty++;
+	}
+}
 
-				// if there is a non-zero indirect byte...
-				if(block.inode[j].indirect){
-					printf("    indirect block: %d\n", block.inode[j].indirect);
+// read a metadata block, the journal holds the current copy of anything changed since the last checkpoint
+static void metaRead( int blocknum, char *data )
+{
+	if(!MOUNT_STATE.journal || !journal_read(MOUNT_STATE.journal, blocknum, data)){
+		disk_read(blocknum, data);
+	}
+}
 
-					// read the indirect block (array of ints) at the location given by the indirect integer
-					disk_read(block.inode[j].indirect, block.data);
+// write a metadata block, through the journal when the disk has one
+static void metaWrite( int blocknum, const char *data )
+{
+	if(MOUNT_STATE.journal){
+		journal_write(MOUNT_STATE.journal, blocknum, data);
+	}
+	else{
+		disk_write(blocknum, data);
+	}
+}
 
-					// print the location of the indirect data blocks from the pointers array if non-zero
-					printf("    indirect data blocks: ");
-					int l;
-					for(l = 0; l < POINTERS_PER_BLOCK; l++){
-						if(block.pointers[l]){
-							printf("%d ", block.pointers[l]);
-						}
-					}
-					printf("\n");
-				}
-				// read the inode block data again before the next iteration
-				disk_read(i, block.data);
-			}
+// returns one if blocknum is in use in a saved bitmap image
+static int imageTest( const char *image, int blocknum )
+{
+	const uint64_t *words = (const uint64_t *) image;
+	return (words[blocknum / 64] >> (blocknum % 64)) & 1;
+}
+
+// mark the block reference table block holding the entry of blocknum for the next flush
+static void refDirty( int blocknum )
+{
+	int k = blocknum / REFS_PER_BLOCK;
+	if(!MOUNT_STATE.refdirty[k]){
+		MOUNT_STATE.refdirty[k] = 1;
+		MOUNT_STATE.nrefdirty++;
+	}
+}
+
+// returns one if more than one block pointer refers to blocknum, so it may not be written over in place
+static int refShared( int blocknum )
+{
+	return MOUNT_STATE.refs && MOUNT_STATE.refs[blocknum].refs > 0;
+}
+
+// count one more pointer to blocknum
+static void refTake( int blocknum )
+{
+	MOUNT_STATE.refs[blocknum].refs++;
+	refDirty(blocknum);
+}
+
+// count one pointer fewer to blocknum, returns one if it is still in use after that
+static int refDrop( int blocknum )
+{
+	if(!refShared(blocknum)) return 0;
+	MOUNT_STATE.refs[blocknum].refs--;
+	refDirty(blocknum);
+	return 1;
+}
+
+static int dedupHome( uint32_t hash )
+{
+	return hash & (MOUNT_STATE.dedup_slots - 1);
+}
+
+// put blocknum, whose fingerprint is in its table entry, into the dedup index, doubling it when half full
+static void dedupInsert( int blocknum )
+{
+	if(2 * (MOUNT_STATE.dedup_entries + 1) > MOUNT_STATE.dedup_slots){
+		int *old = MOUNT_STATE.dedup_index;
+		int nold = MOUNT_STATE.dedup_slots;
+		MOUNT_STATE.dedup_slots = nold ? 2 * nold : DEDUP_SLOTS;
+		MOUNT_STATE.dedup_index = calloc(MOUNT_STATE.dedup_slots, sizeof(int));
+		MOUNT_STATE.dedup_entries = 0;
 
+		int i;
+		for(i = 0; i < nold; i++){
+			if(old[i]) dedupInsert(old[i]);
 		}
+		free(old);
 	}
 
+	int mask = MOUNT_STATE.dedup_slots - 1;
+	int i = dedupHome(MOUNT_STATE.refs[blocknum].hash);
+	while(MOUNT_STATE.dedup_index[i]){
+		i = (i + 1) & mask;
+	}
+	MOUNT_STATE.dedup_index[i] = blocknum;
+	MOUNT_STATE.dedup_entries++;
 }
 
-// examine the disk for a filesystem
-//  if one is present, read the superblock, build a free block bitmap, and prepare the filesystem for use
-//  return one on success, zero otherwise
-int fs_mount()
+// take blocknum out of the dedup index and clear its fingerprint, the entries after it in the same run are
+//  shifted back so that every one stays reachable from its home slot
+static void dedupForget( int blocknum )
 {
-	union fs_block block;
+	if(!MOUNT_STATE.refs || !MOUNT_STATE.refs[blocknum].hash) return;
 
-	// check for magic number in super block
-	disk_read(0, block.data);
+	int mask = MOUNT_STATE.dedup_slots - 1;
+	int i = dedupHome(MOUNT_STATE.refs[blocknum].hash);
+	while(MOUNT_STATE.dedup_index[i] != blocknum){
+		i = (i + 1) & mask;
+	}
 
-	int magic = block.super.magic;
-	int nblocks = block.super.nblocks;
-	int ninodeblocks = block.super.ninodeblocks;
+	int j = i;
+	while(1){
+		j = (j + 1) & mask;
+		int b = MOUNT_STATE.dedup_index[j];
+		if(!b) break;
 
-	if(block.super.magic != FS_MAGIC){
-		printf("ERROR: invalid magic number on super block: %x", magic);
-		return 0;
+		// b may fill the hole at i unless its home lies cyclically after i, up to j
+		int home = dedupHome(MOUNT_STATE.refs[b].hash);
+		if(((j - home) & mask) >= ((j - i) & mask)){
+			MOUNT_STATE.dedup_index[i] = b;
+			i = j;
+		}
 	}
+	MOUNT_STATE.dedup_index[i] = 0;
+	MOUNT_STATE.dedup_entries--;
 
-	// build free block bit map
-	FREE_BLOCK_BITMAP = (int*) malloc(sizeof(int) * nblocks);
+	MOUNT_STATE.refs[blocknum].hash = 0;
+	refDirty(blocknum);
+}
 
-	// initialize to zeros
-	int j;
-	for(j = 0; j < nblocks; j++){
-		FREE_BLOCK_BITMAP[j] = 0;
+// record that blocknum holds data with the given fingerprint, so later writes of the same data can share it
+static void dedupAdd( int blocknum, uint32_t hash )
+{
+	if(MOUNT_STATE.refs[blocknum].hash == hash) return;
+	dedupForget(blocknum);
+	MOUNT_STATE.refs[blocknum].hash = hash;
+	dedupInsert(blocknum);
+	refDirty(blocknum);
+}
+
+// hand the references to a block and its place in the dedup index on to the copy of its data in another
+static void refMove( int from, int to )
+{
+	if(!MOUNT_STATE.refs) return;
+
+	struct fs_blockref r = MOUNT_STATE.refs[from];
+	if(!r.hash && !r.refs) return;
+
+	dedupForget(from);
+	MOUNT_STATE.refs[from].refs = 0;
+	refDirty(from);
+	MOUNT_STATE.refs[to].refs = r.refs;
+	refDirty(to);
+	if(r.hash){
+		dedupAdd(to, r.hash);
 	}
+}
 
-	// set super block to 1
-	FREE_BLOCK_BITMAP[0] = 1;
+// give a block back to the free block map, or hold on to it until the journal or the next checkpoint says it
+//  is safe to reuse
+//  a block shared by dedup stays where it is for the pointers left, it only goes once the last one lets go
+static void blockRelease( int blocknum )
+{
+	if(refDrop(blocknum)) return;
+	dedupForget(blocknum);
 
-	// read inode blocks
-	int i;
-	for(i = 1; i <= ninodeblocks; i++){
-		disk_read(i, block.data);
+	if(logMode()){
+		if(imageTest(MOUNT_STATE.bitmap_image, blocknum)){
+			bitmap_set(MOUNT_STATE.freed, blocknum);
+		}
+		else{
+			logRelease(blocknum);
+		}
+	}
+	else if(!MOUNT_STATE.journal){
+		bitmap_clear(FREE_BLOCK_BITMAP, blocknum);
+	}
+	else if(journal_forget(MOUNT_STATE.journal, blocknum)){
+		bitmap_set(MOUNT_STATE.logfreed, blocknum);
+	}
+	else{
+		bitmap_set(MOUNT_STATE.freed, blocknum);
+	}
+}
 
-		int j;
-		for(j = 0; j < INODES_PER_BLOCK; j++){
-			// identify inode block in bitmap
-			if(block.inode[j].isvalid){
-				FREE_BLOCK_BITMAP[i] = 1;
+// write every dirty inode block back, through the journal if there is one
+//  on a log-structured disk they go to the head of the log instead, and the inode map follows them
+//  returns zero if the log filled up with some of them left unwritten
+static int inodeFlush()
+{
+	union fs_block block;
 
-				// identify direct data blocks in bitmap
-				int k;
-				for(k = 0; k < POINTERS_PER_INODE; k++){
-					int direct_block = block.inode[j].direct[k];
-					if(direct_block != 0){
-						FREE_BLOCK_BITMAP[direct_block] = 1;
-					}
-				}
+	int i;
+	for(i = 1; i <= MOUNT_STATE.super.ninodeblocks && MOUNT_STATE.ndirty > 0; i++){
+		if(!MOUNT_STATE.dirty[i-1]) continue;
 
-				// if there is an indirect section, identify the corresponding data blocks
-				int indirect = block.inode[j].indirect;
-				if(indirect != 0){
-					FREE_BLOCK_BITMAP[indirect] = 1;
-					disk_read(indirect, block.data);
-						int l;
-						for(l = 0; l < POINTERS_PER_BLOCK; l++){
-							int block_ptr = block.pointers[l];
-							if(block_ptr != 0){
-								FREE_BLOCK_BITMAP[block_ptr] = 1;
-							}
-						}
-				}
-				// read the inode block data again before the next iteration
-				disk_read(i, block.data);
-			}
+		inodeEncode(&MOUNT_STATE.super, &MOUNT_STATE.inodes[(i-1) * MOUNT_STATE.inodes_per_block], &block);
+		int where = logMode() ? MOUNT_STATE.imap[i-1] : 0;
+		if(where && !imageTest(MOUNT_STATE.bitmap_image, where) && !inVictim(where)){
+			// written since the last checkpoint, which does not refer to it, and not being cleaned out
+			disk_write(where, block.data);
 		}
+		else if(logMode()){
+			int blocknum = logAlloc(1);
+			if(!blocknum){
+				printf("ERROR: log full, inode block %d left unwritten\n", i);
+				return 0;
+			}
+			disk_write(blocknum, block.data);
+			if(MOUNT_STATE.imap[i-1]) blockRelease(MOUNT_STATE.imap[i-1]);
+			MOUNT_STATE.imap[i-1] = blocknum;
+		}
+		else{
+			metaWrite(i, block.data);
+		}
+		MOUNT_STATE.inode_block_writes++;
+		MOUNT_STATE.dirty[i-1] = 0;
+		MOUNT_STATE.ndirty--;
+	}
+	return 1;
+}
+
+// write every changed block of the block reference table back, through the journal if there is one, or to
+//  the head of the log on a log-structured disk, the same way as the inode blocks, returns zero if the log filled up
+static int refFlush()
+{
+	int k;
+	for(k = 0; k < MOUNT_STATE.super.nrefblocks && MOUNT_STATE.nrefdirty > 0; k++){
+		if(!MOUNT_STATE.refdirty[k]) continue;
+
+		const char *data = (const char *) MOUNT_STATE.refs + (size_t) k * DISK_BLOCK_SIZE;
+		int where = logMode() ? MOUNT_STATE.refmap[k] : 0;
+		if(where && !imageTest(MOUNT_STATE.bitmap_image, where) && !inVictim(where)){
+			disk_write(where, data);
+		}
+		else if(logMode()){
+			int blocknum = logAlloc(1);
+			if(!blocknum){
+				printf("ERROR: log full, reference table block %d left unwritten\n", k);
+				return 0;
+			}
+			disk_write(blocknum, data);
+			if(MOUNT_STATE.refmap[k]) blockRelease(MOUNT_STATE.refmap[k]);
+			MOUNT_STATE.refmap[k] = blocknum;
+		}
+		else{
+			metaWrite(MOUNT_STATE.super.refstart + k, data);
+		}
+		MOUNT_STATE.refdirty[k] = 0;
+		MOUNT_STATE.nrefdirty--;
+	}
+	return 1;
+}
+
+// the first block after the inode table, the saved bitmap, the journal and the checkpoint regions
+//  a log-structured disk keeps its inode table in the log, so it has none of its own
+static int dataStart( struct fs_superblock *super )
+{
+	int start = super->segblocks > 0 ? 1 : super->ninodeblocks + 1;
+	if(super->nbitmapblocks > 0 && super->bitmapstart + super->nbitmapblocks > start){
+		start = super->bitmapstart + super->nbitmapblocks;
+	}
+	if(super->njournalblocks > 0 && super->journalstart + super->njournalblocks > start){
+		start = super->journalstart + super->njournalblocks;
+	}
+	if(super->nckptblocks > 0 && super->ckptstart + 2 * super->nckptblocks > start){
+		start = super->ckptstart + 2 * super->nckptblocks;
+	}
+	if(super->refstart > 0 && super->refstart + super->nrefblocks > start){
+		start = super->refstart + super->nrefblocks;
+	}
+	return start;
+}
+
+// write the free block bitmap out to its reserved blocks
+static void bitmapSave()
+{
+	int n = MOUNT_STATE.super.nbitmapblocks;
+	char *buffer = disk_alloc(n);
+	memset(buffer, 0, (size_t) n * DISK_BLOCK_SIZE);
+	bitmap_store(FREE_BLOCK_BITMAP, buffer);
+
+	struct disk_io *io = malloc(sizeof(struct disk_io) * n);
+	int i;
+	for(i = 0; i < n; i++){
+		io[i].blocknum = MOUNT_STATE.super.bitmapstart + i;
+		io[i].data = buffer + (size_t) i * DISK_BLOCK_SIZE;
+	}
+	disk_writev(io, n);
+
+	free(io);
+	disk_free(buffer);
+}
+
+// read the saved free block bitmap back in
+static void bitmapLoad()
+{
+	int n = MOUNT_STATE.super.nbitmapblocks;
+	char *buffer = disk_alloc(n);
+
+	struct disk_io *io = malloc(sizeof(struct disk_io) * n);
+	int i;
+	for(i = 0; i < n; i++){
+		io[i].blocknum = MOUNT_STATE.super.bitmapstart + i;
+		io[i].data = buffer + (size_t) i * DISK_BLOCK_SIZE;
+	}
+	disk_readv(io, n);
+	bitmap_load(FREE_BLOCK_BITMAP, buffer);
+
+	free(io);
+	disk_free(buffer);
+}
+
+// read the block reference table in, from its own blocks or from wherever the log put them
+static void refLoad()
+{
+	int n = MOUNT_STATE.super.nrefblocks;
+	if(n == 0) return;
+
+	MOUNT_STATE.refs = (struct fs_blockref *) disk_alloc(n);
+	memset(MOUNT_STATE.refs, 0, (size_t) n * DISK_BLOCK_SIZE);
+	MOUNT_STATE.refdirty = calloc(n, sizeof(char));
+	MOUNT_STATE.nrefdirty = 0;
+
+	struct disk_io *io = malloc(sizeof(struct disk_io) * n);
+	int nio = 0;
+	int k;
+	for(k = 0; k < n; k++){
+		int blocknum = logMode() ? MOUNT_STATE.refmap[k] : MOUNT_STATE.super.refstart + k;
+		if(!blocknum) continue;
+		io[nio].blocknum = blocknum;
+		io[nio].data = (char *) MOUNT_STATE.refs + (size_t) k * DISK_BLOCK_SIZE;
+		nio++;
+	}
+	disk_readv(io, nio);
+	free(io);
+}
+
+// write the whole block reference table out to its own blocks, bypassing the journal
+static void refSave()
+{
+	int n = MOUNT_STATE.super.nrefblocks;
+	struct disk_io *io = malloc(sizeof(struct disk_io) * n);
+	int k;
+	for(k = 0; k < n; k++){
+		io[k].blocknum = MOUNT_STATE.super.refstart + k;
+		io[k].data = (char *) MOUNT_STATE.refs + (size_t) k * DISK_BLOCK_SIZE;
+		MOUNT_STATE.refdirty[k] = 0;
+	}
+	disk_writev(io, n);
+	MOUNT_STATE.nrefdirty = 0;
+	free(io);
+}
+
+// build the dedup index from the fingerprints in the block reference table, forgetting those of blocks that
+//  are not in use, which an unclean shutdown can leave behind
+static void dedupBuild()
+{
+	int b;
+	for(b = 0; b < MOUNT_STATE.super.nblocks; b++){
+		struct fs_blockref *r = &MOUNT_STATE.refs[b];
+		if(!r->hash && !r->refs) continue;
+
+		if(!bitmap_test(FREE_BLOCK_BITMAP, b)){
+			r->hash = 0;
+			r->refs = 0;
+			refDirty(b);
+		}
+		else if(r->hash){
+			dedupInsert(b);
+		}
+	}
+}
+
+// write the resident superblock back to block 0
+static void superSave()
+{
+	union fs_block block;
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	block.super = MOUNT_STATE.super;
+	disk_write(0, block.data);
+}
+
+// mark the blocks of a set of held back blocks free in a saved bitmap image
+static void imageRelease( char *image, struct bitmap *held )
+{
+	uint64_t *words = (uint64_t *) image;
+	int b = bitmap_find_set(held, 0, held->nbits);
+	while(b >= 0){
+		words[b / 64] &= ~((uint64_t) 1 << (b % 64));
+		b = bitmap_find_set(held, b + 1, held->nbits);
+	}
+}
+
+// log the blocks of the free block bitmap that changed since the last commit
+//  blocks held back until a checkpoint are free in the logged copy, since replay always ends with one
+static void bitmapLog()
+{
+	int n = MOUNT_STATE.super.nbitmapblocks;
+	char *buffer = disk_alloc(n);
+	memset(buffer, 0, (size_t) n * DISK_BLOCK_SIZE);
+	bitmap_store(FREE_BLOCK_BITMAP, buffer);
+	imageRelease(buffer, MOUNT_STATE.logfreed);
+
+	int i;
+	for(i = 0; i < n; i++){
+		char *now = buffer + (size_t) i * DISK_BLOCK_SIZE;
+		char *then = MOUNT_STATE.bitmap_image + (size_t) i * DISK_BLOCK_SIZE;
+		if(memcmp(now, then, DISK_BLOCK_SIZE) == 0) continue;
+
+		journal_write(MOUNT_STATE.journal, MOUNT_STATE.super.bitmapstart + i, now);
+		memcpy(then, now, DISK_BLOCK_SIZE);
+	}
+
+	disk_free(buffer);
+}
+
+// hand the blocks held back in a set of freed blocks to the free block map
+static void bitmapRelease( struct bitmap *held )
+{
+	int n = bitmap_find_set(held, 0, held->nbits);
+	while(n >= 0){
+		bitmap_clear(FREE_BLOCK_BITMAP, n);
+		bitmap_clear(held, n);
+		n = bitmap_find_set(held, n + 1, held->nbits);
+	}
+}
+
+// commit the metadata changed since the last commit as one journal transaction, and checkpoint as well if asked
+//  blocks freed before the commit are free in the bitmap it logs, while those with an older copy in the journal
+//  are only handed back after a checkpoint, since replaying that copy would overwrite whatever reused them
+static void journalCommit( int checkpoint )
+{
+	struct journal *j = MOUNT_STATE.journal;
+
+	inodeFlush();
+	refFlush();
+	bitmapRelease(MOUNT_STATE.freed);
+	bitmapLog();
+
+	int checkpoints = j->checkpoints;
+	if(!journal_commit(j)){
+		// too much for one transaction, so it goes home directly, and the next mount rescans if that is interrupted
+		MOUNT_STATE.super.state = FS_RESCAN;
+		superSave();
+		disk_flush();
+		journal_checkpoint(j);
+		journal_bypass(j);
+		MOUNT_STATE.super.state = FS_DIRTY;
+		superSave();
+		disk_flush();
+	}
+	// a checkpoint journal_commit made to find room does not cover the transaction it then logged
+	if(checkpoint && j->head > 1){
+		journal_checkpoint(j);
+	}
+	if(j->checkpoints != checkpoints){
+		bitmapRelease(MOUNT_STATE.logfreed);
+	}
+
+	MOUNT_STATE.ops = 0;
+}
+
+// note the end of an operation that changed metadata, and make a group commit once enough have piled up
+//  a checkpoint stands in for the commit on a log-structured disk
+static void journalOp()
+{
+	struct journal *j = MOUNT_STATE.journal;
+	if(logMode()){
+		logOp();
+		return;
+	}
+	if(!j) return;
+
+	MOUNT_STATE.ops++;
+	if(MOUNT_STATE.ops >= GROUP_COMMIT_OPS || journal_pending(j) >= j->nblocks / 4){
+		journalCommit(0);
+	}
+}
+
+// forget what a stream has prefetched, anything it never read counts as waste
+static void raReset( struct fs_readahead *ra )
+{
+	int unread = ra->end - (ra->consumed > ra->start ? ra->consumed : ra->start);
+	if(unread > 0) MOUNT_STATE.ra_waste += unread;
+	ra->start = ra->end = ra->consumed = 0;
+}
+
+// stop following inumber, or every stream when inumber is zero
+static void raDrop( int inumber )
+{
+	int i;
+	for(i = 0; i < RA_STREAMS; i++){
+		struct fs_readahead *ra = &MOUNT_STATE.readahead[i];
+		if(ra->inumber == 0 || (inumber != 0 && ra->inumber != inumber)) continue;
+
+		raReset(ra);
+		ra->inumber = 0;
+	}
+}
+
+// the stream following inumber, recycling the least recently used one if there is none yet
+static struct fs_readahead *raStream( int inumber )
+{
+	struct fs_readahead *ra = NULL;
+
+	int i;
+	for(i = 0; i < RA_STREAMS; i++){
+		struct fs_readahead *s = &MOUNT_STATE.readahead[i];
+		if(s->inumber == inumber){
+			ra = s;
+			break;
+		}
+		if(!ra || s->age < ra->age) ra = s;
+	}
+
+	if(ra->inumber != inumber){
+		raReset(ra);
+		ra->inumber = inumber;
+		ra->next = 0;
+		ra->window = 0;
+	}
+
+	ra->age = ++MOUNT_STATE.ra_clock;
+	return ra;
+}
+
+// mark the open files on inumber stale after a change made around them, every open file when inumber is zero
+static void fileChanged( int inumber, struct fs_file *except )
+{
+	struct fs_file *f;
+	for(f = OPEN_FILES; f; f = f->next){
+		if(f != except && (inumber == 0 || f->inumber == inumber)){
+			f->stale = 1;
+		}
+	}
+}
+
+// record that logical block index of an open file lives at blocknum, growing the map as needed
+static void fileSet( struct fs_file *f, int index, int blocknum )
+{
+	if(index >= f->capacity){
+		int capacity = f->capacity ? f->capacity : 16;
+		while(capacity <= index) capacity *= 2;
+		f->map = realloc(f->map, sizeof(int) * capacity);
+		f->capacity = capacity;
+	}
+	while(f->nmap <= index){
+		f->map[f->nmap++] = 0;
+	}
+	f->map[index] = blocknum;
+}
+
+// decode the whole block map of an open file from its inode
+static void fileLoad( struct fs_file *f, struct fs_inode *inode )
+{
+	int nblocks = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+
+	f->nmap = 0;
+	if(nblocks > 0 && !inodeInline(inode)){
+		fileSet(f, nblocks - 1, 0);
+		blockMap(inode, 0, nblocks, f->map);
+	}
+	f->stale = 0;
+}
+
+// the inode behind an open file, with its map brought up to date, or NULL if the file is gone
+static struct fs_inode *fileInode( struct fs_file *f )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return NULL;
+	}
+
+	struct fs_inode *inode = inodeLookup(f->inumber);
+	if(!inode || !inode->isvalid){
+		printf("ERROR: Invalid inode\n");
+		return NULL;
+	}
+
+	if(f->stale){
+		fileLoad(f, inode);
+	}
+	return inode;
+}
+
+// translate count logical blocks from first into block pointers, by indexing the map of an open file
+//  or by walking the block tree when there is none, holes come back as zero
+static void fileMap( struct fs_file *f, struct fs_inode *inode, int first, int count, int *blocknums )
+{
+	if(!f){
+		blockMap(inode, first, count, blocknums);
+		return;
+	}
+
+	int i;
+	for(i = 0; i < count; i++){
+		blocknums[i] = first + i < f->nmap ? f->map[first+i] : 0;
+	}
+}
+
+// the pointer to logical block index of a file, or zero if it is a hole
+static int fileLookup( struct fs_file *f, struct fs_walk *walk, struct fs_inode *inode, int index )
+{
+	int ptr;
+	if(f){
+		ptr = index < f->nmap ? f->map[index] : 0;
+	}
+	else{
+		ptr = blockLookup(walk, inode, index);
+	}
+	return blockNumber(ptr) ? ptr : 0;
+}
+
+// let readahead see a read of count logical blocks from first before they are fetched
+//  the window grows while the reader stays sequential and shrinks when it jumps, and the next window is
+//  handed to disk_prefetch once half of the last one has been used up
+static void readahead( struct fs_file *f, int inumber, struct fs_inode *inode, int first, int count )
+{
+	// prefetched blocks live in the disk cache, so the window must fit there comfortably
+	int limit = disk_cache_blocks() / 4;
+	if(limit > RA_MAX_WINDOW) limit = RA_MAX_WINDOW;
+	if(limit < RA_MIN_WINDOW) return;
+
+	// a directory is read a block at a time going from its header to its table to a bucket, which only looks
+	//  sequential
+	if(inode->isvalid & INODE_DIR) return;
+
+	struct fs_readahead *ra = raStream(inumber);
+	int last = first + count;
+
+	// a reader picking up in the block where it left off is still sequential
+	if(first == ra->next || first + 1 == ra->next){
+		ra->window = ra->window ? ra->window * 2 : RA_MIN_WINDOW;
+		if(ra->window > limit) ra->window = limit;
+	}
+	else{
+		raReset(ra);
+		ra->window /= 2;
+		if(ra->window < RA_MIN_WINDOW) ra->window = 0;
+	}
+	ra->next = last;
+
+	// count the prefetched blocks this read uses
+	if(first < ra->end && last > ra->start){
+		int lo = ra->consumed > ra->start ? ra->consumed : ra->start;
+		if(lo < first) lo = first;
+		int hi = last < ra->end ? last : ra->end;
+		if(hi > lo){
+			MOUNT_STATE.ra_hits += hi - lo;
+			ra->consumed = hi;
+		}
+	}
+
+	if(ra->window == 0 || ra->end - last >= ra->window / 2) return;
+
+	// fetch from the end of what is already prefetched up to a window ahead of the reader
+	int nblocks = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	int from = ra->end > last ? ra->end : last;
+	int to = last + ra->window < nblocks ? last + ra->window : nblocks;
+	if(to <= from) return;
+
+	if(from != ra->end){
+		raReset(ra);
+		ra->start = ra->consumed = from;
+	}
+
+	// holes have nothing on disk to fetch, but still count toward the window
+	int *blocknums = malloc(sizeof(int) * (to - from));
+	fileMap(f, inode, from, to - from, blocknums);
+	int i;
+	int n = 0;
+	for(i = 0; i < to - from; i++){
+		if(blockNumber(blocknums[i]) && !(blocknums[i] & BLOCK_UNWRITTEN)){
+			blocknums[n++] = blockNumber(blocknums[i]);
+		}
+	}
+	disk_prefetch(blocknums, n);
+	ra->end = to;
+	MOUNT_STATE.ra_blocks += to - from;
+	free(blocknums);
+}
+
+// first block of segment s
+static int segStart( int s )
+{
+	return MOUNT_STATE.super.segstart + s * MOUNT_STATE.super.segblocks;
+}
+
+// the segment blocknum lies in, or -1 if it is outside the log
+static int segOf( int blocknum )
+{
+	struct fs_superblock *super = &MOUNT_STATE.super;
+	if(blocknum < super->segstart) return -1;
+	int s = (blocknum - super->segstart) / super->segblocks;
+	return s < super->nsegments ? s : -1;
+}
+
+// count the clean segments again, those with no block in use that are neither being written nor cleaned
+static void logCount()
+{
+	struct fs_superblock *super = &MOUNT_STATE.super;
+
+	MOUNT_STATE.nclean = 0;
+	int s;
+	for(s = 0; s < super->nsegments; s++){
+		if(s == MOUNT_STATE.segment || MOUNT_STATE.victim[s]) continue;
+		if(bitmap_count(FREE_BLOCK_BITMAP, segStart(s), segStart(s) + super->segblocks) == 0){
+			MOUNT_STATE.nclean++;
+		}
+	}
+}
+
+// free a block the last checkpoint does not refer to, counting its segment as clean if it was the last in use
+static void logRelease( int blocknum )
+{
+	bitmap_clear(FREE_BLOCK_BITMAP, blocknum);
+
+	int s = segOf(blocknum);
+	if(s < 0 || s == MOUNT_STATE.segment || MOUNT_STATE.victim[s]) return;
+	if(bitmap_count(FREE_BLOCK_BITMAP, segStart(s), segStart(s) + MOUNT_STATE.super.segblocks) == 0){
+		MOUNT_STATE.nclean++;
+	}
+}
+
+// blocks the cleaner must leave at the head of the log for the pointer and inode blocks that follow the last
+//  block it moves, the room set aside for metadata being what it has to work with when the log is nearly full
+static int cleanReserve()
+{
+	return MOUNT_STATE.ndirty + MOUNT_STATE.nrefdirty + 2 * (MAX_DEPTH + 1);
+}
+
+// blocks the head of the log keeps for the next checkpoint, the metadata dirty now and what one more operation may
+//  dirty, an inode block or two and any block of the reference table
+static int metaReserve()
+{
+	return cleanReserve() + 2 + MOUNT_STATE.super.nrefblocks - MOUNT_STATE.nrefdirty;
+}
+
+// blocks that can be written at the head of the log before the cleaner has to run
+static int logRoom()
+{
+	int left = 0;
+	if(MOUNT_STATE.segment >= 0){
+		left = segStart(MOUNT_STATE.segment) + MOUNT_STATE.super.segblocks - MOUNT_STATE.head;
+	}
+	return left + MOUNT_STATE.nclean * MOUNT_STATE.super.segblocks;
+}
+
+// move the head of the log to the next clean segment, returns zero if there is none
+static int logOpen()
+{
+	struct fs_superblock *super = &MOUNT_STATE.super;
+
+	int i;
+	for(i = 1; i <= super->nsegments; i++){
+		int s = (MOUNT_STATE.segment + i + super->nsegments) % super->nsegments;
+		if(s == MOUNT_STATE.segment || MOUNT_STATE.victim[s]) continue;
+		if(bitmap_count(FREE_BLOCK_BITMAP, segStart(s), segStart(s) + super->segblocks) != 0) continue;
+
+		MOUNT_STATE.segment = s;
+		MOUNT_STATE.head = segStart(s);
+		MOUNT_STATE.segage[s] = ++MOUNT_STATE.clock;
+		if(MOUNT_STATE.nclean > 0) MOUNT_STATE.nclean--;
+		return 1;
+	}
+	return 0;
+}
+
+// take the next block at the head of the log, moving on to a clean segment when this one is full
+//  data may not use the last segment's worth of room, nor what is kept for the metadata written after it
+//  returns zero if the log is full
+static int logAlloc( int meta )
+{
+	if(!meta && logRoom() <= MOUNT_STATE.super.segblocks + metaReserve()) return 0;
+
+	if(MOUNT_STATE.segment < 0 || MOUNT_STATE.head == segStart(MOUNT_STATE.segment) + MOUNT_STATE.super.segblocks){
+		if(!logOpen()) return 0;
+	}
+
+	int blocknum = MOUNT_STATE.head++;
+	bitmap_set(FREE_BLOCK_BITMAP, blocknum);
+	MOUNT_STATE.log_blocks++;
+	return blocknum;
+}
+
+// blocks of a checkpoint region taken by the inode map, which follows the header, by the map of the block
+//  reference table, which comes after the segment ages, and by the bitmap at its end
+static int checkpointImapBlocks( const struct fs_superblock *super )
+{
+	return (super->ninodeblocks * sizeof(int) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+}
+
+static int checkpointRefmapBlocks( const struct fs_superblock *super )
+{
+	return (super->nrefblocks * sizeof(int) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+}
+
+static int checkpointBitmapBlocks( const struct fs_superblock *super )
+{
+	return (super->nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+}
+
+// FNV-1a over the sequence and clock of a checkpoint and everything in its region past the header
+static uint32_t checkpointSum( const char *region, int nblocks )
+{
+	const struct fs_checkpoint *c = (const struct fs_checkpoint *) region;
+	int head[2] = { c->sequence, c->clock };
+	uint32_t h = 2166136261u;
+
+	const unsigned char *p = (const unsigned char *) head;
+	size_t i;
+	for(i = 0; i < sizeof(head); i++){
+		h = (h ^ p[i]) * 16777619u;
+	}
+	p = (const unsigned char *) region + DISK_BLOCK_SIZE;
+	for(i = 0; i < (size_t) (nblocks - 1) * DISK_BLOCK_SIZE; i++){
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+// seal a checkpoint region whose inode map, segment ages and bitmap are filled in, and write it over the
+//  older of the two regions, so that a crash in the middle leaves the newer one intact
+static void checkpointWrite( const struct fs_superblock *super, char *region, int sequence, int clock )
+{
+	struct fs_checkpoint *c = (struct fs_checkpoint *) region;
+	c->magic = CHECKPOINT_MAGIC;
+	c->sequence = sequence;
+	c->clock = clock;
+	c->checksum = checkpointSum(region, super->nckptblocks);
+
+	int n = super->nckptblocks;
+	struct disk_io *io = malloc(sizeof(struct disk_io) * n);
+	int i;
+	for(i = 0; i < n; i++){
+		io[i].blocknum = super->ckptstart + (sequence % 2) * n + i;
+		io[i].data = region + (size_t) i * DISK_BLOCK_SIZE;
+	}
+	disk_writev(io, n);
+	free(io);
+}
+
+// read the newest intact checkpoint into region, returns its sequence number, or zero if neither region holds one
+static int checkpointRead( const struct fs_superblock *super, char *region )
+{
+	int n = super->nckptblocks;
+	char *both = disk_alloc(2 * n);
+	struct disk_io *io = malloc(sizeof(struct disk_io) * 2 * n);
+	int i;
+	for(i = 0; i < 2 * n; i++){
+		io[i].blocknum = super->ckptstart + i;
+		io[i].data = both + (size_t) i * DISK_BLOCK_SIZE;
+	}
+	disk_readv(io, 2 * n);
+	free(io);
+
+	int sequence = 0;
+	for(i = 0; i < 2; i++){
+		char *r = both + (size_t) i * n * DISK_BLOCK_SIZE;
+		struct fs_checkpoint *c = (struct fs_checkpoint *) r;
+		if(c->magic != CHECKPOINT_MAGIC || c->sequence <= sequence || c->checksum != checkpointSum(r, n)) continue;
+
+		memcpy(region, r, (size_t) n * DISK_BLOCK_SIZE);
+		sequence = c->sequence;
+	}
+
+	disk_free(both);
+	return sequence;
+}
+
+// write a checkpoint of the mounted log-structured disk once everything it refers to is on disk
+//  the blocks held back since the last one are free in it, and can be reused from here on
+//  returns zero, leaving the last checkpoint in place, if the log has no room for the metadata it would refer to
+static int logCheckpoint()
+{
+	struct fs_superblock *super = &MOUNT_STATE.super;
+
+	if(!inodeFlush() || !refFlush()){
+		return 0;
+	}
+	disk_flush();
+
+	int n = super->nckptblocks;
+	int nbitmap = checkpointBitmapBlocks(super);
+	char *region = disk_alloc(n);
+	memset(region, 0, (size_t) n * DISK_BLOCK_SIZE);
+	char *imap = region + DISK_BLOCK_SIZE;
+	char *ages = imap + (size_t) checkpointImapBlocks(super) * DISK_BLOCK_SIZE;
+	char *bits = region + (size_t) (n - nbitmap) * DISK_BLOCK_SIZE;
+	char *refmap = bits - (size_t) checkpointRefmapBlocks(super) * DISK_BLOCK_SIZE;
+
+	memcpy(imap, MOUNT_STATE.imap, sizeof(int) * super->ninodeblocks);
+	memcpy(ages, MOUNT_STATE.segage, sizeof(int) * super->nsegments);
+	if(super->nrefblocks > 0){
+		memcpy(refmap, MOUNT_STATE.refmap, sizeof(int) * super->nrefblocks);
+	}
+	bitmap_store(FREE_BLOCK_BITMAP, bits);
+	imageRelease(bits, MOUNT_STATE.freed);
+
+	MOUNT_STATE.sequence++;
+	checkpointWrite(super, region, MOUNT_STATE.sequence, MOUNT_STATE.clock);
+	disk_flush();
+
+	memcpy(MOUNT_STATE.bitmap_image, bits, (size_t) nbitmap * DISK_BLOCK_SIZE);
+	bitmapRelease(MOUNT_STATE.freed);
+	disk_free(region);
+
+	MOUNT_STATE.log_checkpoints++;
+	MOUNT_STATE.ops = 0;
+	logCount();
+	return 1;
+}
+
+// load the newest checkpoint of a log-structured disk into the mount state, returns zero if there is none intact
+//  nothing written after it is referred to by it, so that is all the recovery a crash needs
+static int logLoad()
+{
+	struct fs_superblock *super = &MOUNT_STATE.super;
+
+	int n = super->nckptblocks;
+	int nbitmap = checkpointBitmapBlocks(super);
+	char *region = disk_alloc(n);
+	int sequence = checkpointRead(super, region);
+	if(!sequence){
+		disk_free(region);
+		return 0;
+	}
+
+	struct fs_checkpoint *c = (struct fs_checkpoint *) region;
+	char *imap = region + DISK_BLOCK_SIZE;
+	char *ages = imap + (size_t) checkpointImapBlocks(super) * DISK_BLOCK_SIZE;
+	char *bits = region + (size_t) (n - nbitmap) * DISK_BLOCK_SIZE;
+	char *refmap = bits - (size_t) checkpointRefmapBlocks(super) * DISK_BLOCK_SIZE;
+
+	MOUNT_STATE.imap = malloc(sizeof(int) * super->ninodeblocks);
+	memcpy(MOUNT_STATE.imap, imap, sizeof(int) * super->ninodeblocks);
+	MOUNT_STATE.segage = malloc(sizeof(int) * super->nsegments);
+	memcpy(MOUNT_STATE.segage, ages, sizeof(int) * super->nsegments);
+	if(super->nrefblocks > 0){
+		MOUNT_STATE.refmap = malloc(sizeof(int) * super->nrefblocks);
+		memcpy(MOUNT_STATE.refmap, refmap, sizeof(int) * super->nrefblocks);
+	}
+	MOUNT_STATE.victim = calloc(super->nsegments, sizeof(char));
+	bitmap_load(FREE_BLOCK_BITMAP, bits);
+	MOUNT_STATE.bitmap_image = disk_alloc(nbitmap);
+	memcpy(MOUNT_STATE.bitmap_image, bits, (size_t) nbitmap * DISK_BLOCK_SIZE);
+	MOUNT_STATE.freed = bitmap_create(super->nblocks);
+
+	MOUNT_STATE.sequence = sequence;
+	MOUNT_STATE.clock = c->clock;
+	MOUNT_STATE.segment = -1;
+	MOUNT_STATE.head = 0;
+	MOUNT_STATE.ops = 0;
+	MOUNT_STATE.log_blocks = 0;
+	MOUNT_STATE.log_checkpoints = 0;
+	MOUNT_STATE.clean_passes = 0;
+	MOUNT_STATE.clean_segments = 0;
+	MOUNT_STATE.clean_copied = 0;
+	logCount();
+
+	disk_free(region);
+	return 1;
+}
+
+// a segment the cleaner could take, and how much taking it is worth under the cleaner policy
+struct fs_victim {
+	int segment;
+	int live;
+	double score;
+};
+
+static int victimCompare( const void *a, const void *b )
+{
+	double x = ((const struct fs_victim *) a)->score;
+	double y = ((const struct fs_victim *) b)->score;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// live data blocks on their way from the segments being cleaned to the head of the log
+struct fs_copy {
+	int n;
+	int from[CLEAN_COPY];
+	int to[CLEAN_COPY];
+	char *buffer;
+	int *moved;			// where each shared block of the segments being cleaned went, zero until it has
+	int *remap;			// pairs of where a pointer block shared with a clone was and where it went
+	int nremap;
+	int remapcap;
+};
+
+static void copyFlush( struct fs_copy *c )
+{
+	struct disk_io io[CLEAN_COPY];
+
+	int i;
+	for(i = 0; i < c->n; i++){
+		io[i].blocknum = c->from[i];
+		io[i].data = c->buffer + (size_t) i * DISK_BLOCK_SIZE;
+	}
+	disk_readv(io, c->n);
+	for(i = 0; i < c->n; i++){
+		io[i].blocknum = c->to[i];
+	}
+	disk_writev(io, c->n);
+
+	MOUNT_STATE.data_block_reads += c->n;
+	MOUNT_STATE.data_block_writes += c->n;
+	MOUNT_STATE.clean_copied += c->n;
+	c->n = 0;
+}
+
+// returns one if blocknum lies in a segment being cleaned
+static int inVictim( int blocknum )
+{
+	int s = segOf(blocknum);
+	return s >= 0 && MOUNT_STATE.victim[s];
+}
+
+// move whatever lies in the segments being cleaned under a block pointer of the given height, zero for a
+//  data block, to the head of the log, and return what the pointer should be now
+//  pointer blocks above anything that moved move too, so nothing the last checkpoint refers to is changed
+static int cleanTree( struct fs_copy *c, int ptr, int height )
+{
+	int blocknum = blockNumber(ptr);
+	if(!blocknum) return ptr;
+
+	if(height == 0){
+		// stop moving data while there is only room left for the metadata that has to follow it
+		if(!inVictim(blocknum) || logRoom() <= cleanReserve()) return ptr;
+
+		// a shared block moves once, its references going with it, and its other pointers follow
+		int *moved = NULL;
+		if(c->moved){
+			int s = segOf(blocknum);
+			moved = &c->moved[(MOUNT_STATE.victim[s] - 1) * MOUNT_STATE.super.segblocks + blocknum - segStart(s)];
+			if(*moved) return *moved | (ptr & BLOCK_FLAGS);
+		}
+
+		int to = logAlloc(1);
+		if(!to) return ptr;
+		if(!(ptr & BLOCK_UNWRITTEN)){
+			c->from[c->n] = blocknum;
+			c->to[c->n] = to;
+			if(++c->n == CLEAN_COPY) copyFlush(c);
+		}
+		if(moved){
+			*moved = to;
+		}
+		refMove(blocknum, to);
+		blockRelease(blocknum);
+		return to | (ptr & BLOCK_FLAGS);
+	}
+
+	// a pointer block shared with a clone moves once, the other files follow it there
+	int r;
+	for(r = 0; r < c->nremap; r++){
+		if(c->remap[2*r] == blocknum) return c->remap[2*r+1];
+	}
+
+	union fs_block block;
+	metaRead(blocknum, block.data);
+	MOUNT_STATE.data_block_reads++;
+
+	int changed = 0;
+	int l;
+	for(l = 0; l < POINTERS_PER_BLOCK; l++){
+		if(!block.pointers[l]) continue;
+
+		int p = cleanTree(c, block.pointers[l], height - 1);
+		if(p != block.pointers[l]){
+			block.pointers[l] = p;
+			changed = 1;
+		}
+	}
+	if(!changed && !inVictim(blocknum)) return ptr;
+
+	// one the last checkpoint does not refer to is changed where it is, unless it is being cleaned out
+	if(!inVictim(blocknum) && !imageTest(MOUNT_STATE.bitmap_image, blocknum)){
+		disk_write(blocknum, block.data);
+		MOUNT_STATE.data_block_writes++;
+		return ptr;
+	}
+
+	// the room kept for metadata makes running out here unlikely, but if it happens the block is changed
+	//  where it is, giving up the crash safety of the log rather than losing what moved below it
+	int to = logAlloc(1);
+	if(!to){
+		disk_write(blocknum, block.data);
+		return ptr;
+	}
+	disk_write(to, block.data);
+	MOUNT_STATE.data_block_writes++;
+	if(refShared(blocknum)){
+		if(c->nremap == c->remapcap){
+			c->remapcap = c->remapcap ? 2 * c->remapcap : 64;
+			c->remap = realloc(c->remap, sizeof(int) * 2 * c->remapcap);
+		}
+		c->remap[2*c->nremap] = blocknum;
+		c->remap[2*c->nremap+1] = to;
+		c->nremap++;
+		refMove(blocknum, to);
+	}
+	blockRelease(blocknum);
+	return to;
+}
+
+// read in every inode block the log holds that is not resident yet, CLEAN_COPY blocks per request
+static void logLoadInodes()
+{
+	struct fs_superblock *super = &MOUNT_STATE.super;
+	char *buffer = disk_alloc(CLEAN_COPY);
+	struct disk_io io[CLEAN_COPY];
+	int group[CLEAN_COPY];
+
+	int i = 1;
+	while(i <= super->ninodeblocks){
+		int n = 0;
+		for(; i <= super->ninodeblocks && n < CLEAN_COPY; i++){
+			if(MOUNT_STATE.loaded[i-1] || !MOUNT_STATE.imap[i-1]) continue;
+			group[n] = i;
+			io[n].blocknum = MOUNT_STATE.imap[i-1];
+			io[n].data = buffer + (size_t) n * DISK_BLOCK_SIZE;
+			n++;
+		}
+		disk_readv(io, n);
+		MOUNT_STATE.inode_block_reads += n;
+
+		int j;
+		for(j = 0; j < n; j++){
+			inodeDecode(super, (union fs_block *) io[j].data, &MOUNT_STATE.inodes[(group[j]-1) * MOUNT_STATE.inodes_per_block]);
+			inodeLoaded(group[j]);
+		}
+	}
+
+	disk_free(buffer);
+}
+
+// one pass of the segment cleaner: rank the segments by the cleaner policy, copy what is still live in the
+//  best of them to the head of the log, and checkpoint so that they can be written again
+//  only called between operations, since it moves blocks out from under any walk in progress
+//  returns the number of segments reclaimed
+static int logClean()
+{
+	struct fs_superblock *super = &MOUNT_STATE.super;
+
+	// blocks held back since the last checkpoint still look live, and may free whole segments by themselves
+	if(bitmap_nfree(MOUNT_STATE.freed) < MOUNT_STATE.freed->nbits){
+		logCheckpoint();
+	}
+
+	// greedy takes the emptiest segments, cost-benefit weighs the free space against the age of the data, as
+	//  cold data left in place stays put while hot data is about to free its segment anyway
+	//  with the log nearly full only the emptiest are sure to give back more room than cleaning them takes
+	int greedy = CLEANER_POLICY == FS_CLEANER_GREEDY || MOUNT_STATE.nclean < 2;
+	struct fs_victim *v = malloc(sizeof(struct fs_victim) * super->nsegments);
+	int nv = 0;
+	int s;
+	for(s = 0; s < super->nsegments; s++){
+		if(s == MOUNT_STATE.segment) continue;
+
+		int live = bitmap_count(FREE_BLOCK_BITMAP, segStart(s), segStart(s) + super->segblocks);
+		if(live == 0 || live == super->segblocks) continue;
+
+		double u = (double) live / super->segblocks;
+		double age = MOUNT_STATE.clock - MOUNT_STATE.segage[s] + 1;
+		v[nv].segment = s;
+		v[nv].live = live;
+		v[nv].score = greedy ? 1 - u : (1 - u) * age / (1 + u);
+		nv++;
+	}
+	qsort(v, nv, sizeof(struct fs_victim), victimCompare);
+
+	// take as many as there is room to move their live blocks to, with as much again left over for the pointer
+	//  blocks above them, which move along with them
+	int room = (logRoom() - cleanReserve()) / 2;
+	int nvictims = 0;
+	int i;
+	for(i = 0; i < nv && nvictims < CLEAN_BATCH; i++){
+		if(v[i].live > room) continue;
+		room -= v[i].live;
+		MOUNT_STATE.victim[v[i].segment] = ++nvictims;
+	}
+	if(nvictims == 0){
+		free(v);
+		return 0;
+	}
+
+	// nothing says which file a block belongs to, so every block tree is walked
+	logLoadInodes();
+
+	struct fs_copy c;
+	c.n = 0;
+	c.buffer = disk_alloc(CLEAN_COPY);
+	c.moved = MOUNT_STATE.refs ? calloc((size_t) nvictims * super->segblocks, sizeof(int)) : NULL;
+	c.remap = NULL;
+	c.nremap = 0;
+	c.remapcap = 0;
+
+	// blocks of the reference table in a segment being cleaned move with the next flush, as inode blocks do
+	for(i = 0; i < super->nrefblocks; i++){
+		if(inVictim(MOUNT_STATE.refmap[i])){
+			refDirty(i * REFS_PER_BLOCK);
+		}
+	}
+
+	for(i = 1; i <= super->ninodeblocks; i++){
+		if(!MOUNT_STATE.loaded[i-1]) continue;
+
+		// an inode block in a segment being cleaned moves with the next flush
+		if(inVictim(MOUNT_STATE.imap[i-1]) && !MOUNT_STATE.dirty[i-1]){
+			MOUNT_STATE.dirty[i-1] = 1;
+			MOUNT_STATE.ndirty++;
+		}
+
+		int inumber;
+		for(inumber = (i-1) * MOUNT_STATE.inodes_per_block + 1; inumber <= i * MOUNT_STATE.inodes_per_block; inumber++){
+			struct fs_inode *inode = &MOUNT_STATE.inodes[inumber-1];
+			if(!inode->isvalid || inodeInline(inode)) continue;
+
+			int changed = 0;
+			int k;
+			for(k = 0; k < POINTERS_PER_INODE; k++){
+				int p = cleanTree(&c, inode->direct[k], 0);
+				if(p != inode->direct[k]){
+					inode->direct[k] = p;
+					changed = 1;
+				}
+			}
+			int depth;
+			for(depth = 1; depth <= maxDepth(); depth++){
+				int *root = blockRoot(inode, depth);
+				int p = cleanTree(&c, *root, depth);
+				if(p != *root){
+					*root = p;
+					changed = 1;
+				}
+			}
+
+			if(changed){
+				inodeDirty(inumber);
+			}
+		}
+	}
+	copyFlush(&c);
+	disk_free(c.buffer);
+	free(c.moved);
+	free(c.remap);
+	raDrop(0);
+
+	// a pointer block written since the last checkpoint is changed where it is, so data can move under a root
+	//  that stays put, and every open file maps its blocks again
+	fileChanged(0, NULL);
+
+	// the old copies were live at the last checkpoint, so the segments are clean once the next one is written
+	logCheckpoint();
+
+	int reclaimed = 0;
+	for(s = 0; s < super->nsegments; s++){
+		if(!MOUNT_STATE.victim[s]) continue;
+		MOUNT_STATE.victim[s] = 0;
+		if(bitmap_count(FREE_BLOCK_BITMAP, segStart(s), segStart(s) + super->segblocks) == 0) reclaimed++;
+	}
+	logCount();
+	free(v);
+
+	MOUNT_STATE.clean_passes++;
+	MOUNT_STATE.clean_segments += reclaimed;
+	return reclaimed;
+}
+
+// make room in the log for an operation about to write up to nblocks blocks of data, checkpointing to free
+//  what is held back and then cleaning, called before the operation starts for the same reason as logClean
+//  the cleaner starts a segment early, while it still has room to move live blocks to
+//  returns zero if there is not even room for the metadata the operation may dirty, which it must then refuse,
+//  though deleting goes ahead regardless, being how room is made
+static int logMakeRoom( int nblocks )
+{
+	if(MOUNTED_FLAG != 1 || !logMode()) return 1;
+	if(nblocks < 0) nblocks = 0;
+
+	long long need = (long long) nblocks + nblocks / POINTERS_PER_BLOCK + MAX_DEPTH + 1 + 2 * MOUNT_STATE.super.segblocks;
+	if(logRoom() >= need) return 1;
+
+	if(bitmap_nfree(MOUNT_STATE.freed) < MOUNT_STATE.freed->nbits){
+		logCheckpoint();
+	}
+	while(logRoom() < need){
+		int room = logRoom();
+		if(!logClean() || logRoom() <= room) break;
+	}
+	return logRoom() >= metaReserve();
+}
+
+// note the end of an operation on a log-structured disk, checkpoint once enough have piled up, and then
+//  clean if the clean segments are running short
+static void logOp()
+{
+	MOUNT_STATE.ops++;
+	if(MOUNT_STATE.ops < GROUP_COMMIT_OPS) return;
+
+	logCheckpoint();
+	if(MOUNT_STATE.nclean < MOUNT_STATE.super.nsegments / CLEAN_LOW){
+		logClean();
+	}
+}
+
+// release the resident state of a previous mount
+static void unmountState()
+{
+	disk_free((char*) MOUNT_STATE.inodes);
+	free(MOUNT_STATE.loaded);
+	free(MOUNT_STATE.dirty);
+	bitmap_delete(MOUNT_STATE.inodemap);
+	bitmap_delete(FREE_BLOCK_BITMAP);
+	journal_close(MOUNT_STATE.journal);
+	disk_free(MOUNT_STATE.bitmap_image);
+	bitmap_delete(MOUNT_STATE.freed);
+	bitmap_delete(MOUNT_STATE.logfreed);
+	free(MOUNT_STATE.imap);
+	free(MOUNT_STATE.segage);
+	free(MOUNT_STATE.victim);
+	disk_free(MOUNT_STATE.cluster);
+	disk_free((char*) MOUNT_STATE.refs);
+	free(MOUNT_STATE.refdirty);
+	free(MOUNT_STATE.refmap);
+	free(MOUNT_STATE.dedup_index);
+	free(MOUNT_STATE.defrag_queue);
+	MOUNT_STATE.refs = NULL;
+	MOUNT_STATE.refdirty = NULL;
+	MOUNT_STATE.nrefdirty = 0;
+	MOUNT_STATE.refmap = NULL;
+	MOUNT_STATE.dedup_index = NULL;
+	MOUNT_STATE.dedup_slots = 0;
+	MOUNT_STATE.dedup_entries = 0;
+	MOUNT_STATE.cluster = NULL;
+	MOUNT_STATE.cluster_inumber = 0;
+	MOUNT_STATE.imap = NULL;
+	MOUNT_STATE.segage = NULL;
+	MOUNT_STATE.victim = NULL;
+	MOUNT_STATE.journal = NULL;
+	MOUNT_STATE.bitmap_image = NULL;
+	MOUNT_STATE.freed = NULL;
+	MOUNT_STATE.logfreed = NULL;
+	MOUNT_STATE.inodemap = NULL;
+	MOUNT_STATE.inodes = NULL;
+	MOUNT_STATE.loaded = NULL;
+	MOUNT_STATE.dirty = NULL;
+	MOUNT_STATE.ndirty = 0;
+	MOUNT_STATE.rootdir = 0;
+	MOUNT_STATE.defrag_queue = NULL;
+	MOUNT_STATE.defrag_nqueue = 0;
+	MOUNT_STATE.defrag_pos = 0;
+	FREE_BLOCK_BITMAP = NULL;
+	MOUNTED_FLAG = 0;
+}
+
+// lay out a new filesystem with the in-place or the log-structured layout
+static int formatDisk( int log )
+{
+	union fs_block block;
+
+	// if disk is already mounted
+	if(MOUNTED_FLAG == 1){
+		printf("ERROR: filesystem already mounted\n");
+		return 0;
+	}
+
+	// set super block data
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	block.super.magic = FS_MAGIC;
+	block.super.nblocks = disk_size();
+	block.super.ninodeblocks = ceil(block.super.nblocks * (0.10));
+	block.super.ninodes = block.super.ninodeblocks * INODES_PER_BLOCK;
+	block.super.inodesize = sizeof(struct fs_inode);
+
+	block.super.state = FS_CLEAN;
+	block.super.nrefblocks = (block.super.nblocks + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+
+	if(log){
+		// the inode table and the block reference table live in the log, and the inode map, the segment ages,
+		//  the map of the reference table and the free block bitmap are saved in two checkpoint regions right
+		//  after the superblock, the rest of the disk is cut into segments
+		int nimap = checkpointImapBlocks(&block.super);
+		int nrefmap = checkpointRefmapBlocks(&block.super);
+		int nbitmap = checkpointBitmapBlocks(&block.super);
+		int avail = block.super.nblocks - 1 - 2 * (1 + nimap + nrefmap + nbitmap);
+		int segblocks = SEGMENT_BLOCKS;
+		while(segblocks > SEGMENT_MIN && avail / segblocks < SEGMENT_COUNT){
+			segblocks /= 2;
+		}
+		int nages = (avail / segblocks * sizeof(int) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+		if(nages < 1) nages = 1;
+
+		block.super.ckptstart = 1;
+		block.super.nckptblocks = 1 + nimap + nages + nrefmap + nbitmap;
+		block.super.segblocks = segblocks;
+		block.super.segstart = dataStart(&block.super);
+		block.super.nsegments = block.super.segstart < block.super.nblocks ? (block.super.nblocks - block.super.segstart) / segblocks : 0;
+
+		// the cleaner needs somewhere to move live data to besides the segment being written and the reserve
+		if(block.super.nsegments < 4){
+			printf("ERROR: disk too small to format\n");
+			return 0;
+		}
+	}
+	else{
+		// the free block bitmap is saved right after the inode table, and the disk starts out clean
+		block.super.bitmapstart = block.super.ninodeblocks + 1;
+		block.super.nbitmapblocks = (block.super.nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+
+		// and the journal right after that
+		int njournal = block.super.nblocks / 16;
+		if(njournal > JOURNAL_MAX) njournal = JOURNAL_MAX;
+		if(njournal >= JOURNAL_MIN){
+			block.super.journalstart = block.super.bitmapstart + block.super.nbitmapblocks;
+			block.super.njournalblocks = njournal;
+		}
+
+		// and the block reference table after that
+		block.super.refstart = dataStart(&block.super);
+
+		if(dataStart(&block.super) >= block.super.nblocks){
+			printf("ERROR: disk too small to format\n");
+			return 0;
+		}
+	}
+
+	// destory any data already present on disk by making all valid inodes invalid, and empty the block reference table
+	//  a log-structured disk has neither until its first checkpoint says where their blocks are
+	char raw_data[4096] = {0};
+	char *data = raw_data;
+	int i;
+	for(i = 1; i <= block.super.ninodeblocks && !log; i++){
+		// could read data from inode block and check for validity before writting, but that
+		//  would mean more reads...
+		disk_write(i, data);
+	}
+	for(i = 0; i < block.super.nrefblocks && !log; i++){
+		disk_write(block.super.refstart + i, data);
+	}
+
+	// the only blocks in use on a fresh disk are the superblock, the inode table and the bitmap itself,
+	//  along with whatever is left over past the last whole segment
+	struct bitmap *map = bitmap_create(block.super.nblocks);
+	for(i = 0; i < dataStart(&block.super); i++){
+		bitmap_set(map, i);
+	}
+	if(log){
+		for(i = block.super.segstart + block.super.nsegments * block.super.segblocks; i < block.super.nblocks; i++){
+			bitmap_set(map, i);
+		}
+
+		// the first checkpoint has an empty inode map, and the other region must not hold one from before
+		int n = block.super.nckptblocks;
+		char *region = disk_alloc(n);
+		memset(region, 0, (size_t) n * DISK_BLOCK_SIZE);
+		disk_write(block.super.ckptstart, region);
+		bitmap_store(map, region + (size_t) (n - checkpointBitmapBlocks(&block.super)) * DISK_BLOCK_SIZE);
+		checkpointWrite(&block.super, region, 1, 0);
+		disk_free(region);
+	}
+	else{
+		char *bits = disk_alloc(block.super.nbitmapblocks);
+		memset(bits, 0, (size_t) block.super.nbitmapblocks * DISK_BLOCK_SIZE);
+		bitmap_store(map, bits);
+		for(i = 0; i < block.super.nbitmapblocks; i++){
+			disk_write(block.super.bitmapstart + i, bits + (size_t) i * DISK_BLOCK_SIZE);
+		}
+		disk_free(bits);
+	}
+	bitmap_delete(map);
+
+	if(block.super.njournalblocks > 0){
+		journal_format(block.super.journalstart, block.super.njournalblocks);
+	}
+	
+	disk_write(0, block.data);
+	disk_flush();
+
+	return 1;
+
+}
+
+// creates a new filesystem on the disk, destroying any data already present
+//  sets aside ten percent of the blocks for inodes, clears the inode table, and writes the superblock
+//  returns one on success, zero otherwise
+//  an attempt to format an already-mounted disk should do nothing and return zero
+int fs_format()
+{
+	return formatDisk(0);
+}
+
+// like fs_format, but lays the disk out as a log: data, pointer blocks and inode blocks are all written
+//  sequentially at its head, an inode map saved by each checkpoint finds the inodes, and a segment cleaner
+//  reclaims the space left behind by overwritten and deleted data
+int fs_format_log()
+{
+	return formatDisk(1);
+}
+
+// count one more data block of a file toward its extents, a new extent starts whenever the block
+//  does not directly follow the previous one on disk
+static void countExtent( int blocknum, int *last, int *nblocks, int *nextents )
+{
+	if(*last < 0 || blocknum != *last + 1){
+		(*nextents)++;
+	}
+	(*nblocks)++;
+	*last = blocknum;
+}
+
+// print the data blocks under a pointer block of the given height and count them into the extents
+//  a pointer block laid out right in front of its data does not break the extent
+static void debugTree( int blocknum, int height, int nblocks_disk, int *last, int *nblocks, int *nextents )
+{
+	union fs_block block;
+
+	if(blocknum <= 0 || blocknum >= nblocks_disk) return;
+
+	if(*last >= 0 && blocknum == *last + 1){
+		*last = blocknum;
+	}
+
+	metaRead(blocknum, block.data);
+
+	int l;
+	for(l = 0; l < POINTERS_PER_BLOCK; l++){
+		if(!block.pointers[l]) continue;
+
+		if(height > 1){
+			debugTree(block.pointers[l], height - 1, nblocks_disk, last, nblocks, nextents);
+		}
+		else{
+			int blocknum = block.pointers[l] & ~BLOCK_FLAGS;
+			printf("%d ", blocknum);
+			countExtent(blocknum, last, nblocks, nextents);
+		}
+	}
+}
+
+// scan a mounted filesystem and report on how the inodes and blocks are organized
+void fs_debug()
+{
+	union fs_block block;
+
+	disk_read(0, block.data);
+
+	printf("superblock:\n");
+
+	// check for valid magic number
+	if(block.super.magic == FS_MAGIC){
+		printf("    magic number is valid\n");
+	}
+	else{
+		printf("    magic number is invalid\n");
+	}
+
+	printf("    %d blocks on disk\n", block.super.nblocks);
+	printf("    %d block(s) for inodes\n", block.super.ninodeblocks);
+	printf("    %d inodes total\n", block.super.ninodes);
+	printf("    %d byte inodes\n", block.super.inodesize == 0 ? (int) sizeof(struct fs_legacy_inode) : block.super.inodesize);
+	if(block.super.nbitmapblocks > 0){
+		printf("    %d block(s) for the free bitmap, starting at %d\n", block.super.nbitmapblocks, block.super.bitmapstart);
+		printf("    state is %s\n", block.super.state == FS_CLEAN ? "clean" : "dirty");
+	}
+	if(block.super.njournalblocks > 0){
+		printf("    %d block(s) for the journal, starting at %d\n", block.super.njournalblocks, block.super.journalstart);
+	}
+	if(block.super.nrefblocks > 0){
+		if(block.super.refstart > 0){
+			printf("    %d block(s) for block references, starting at %d\n", block.super.nrefblocks, block.super.refstart);
+		}
+		else{
+			printf("    %d block(s) for block references, kept in the log\n", block.super.nrefblocks);
+		}
+	}
+	if(block.super.segblocks > 0){
+		printf("    log-structured, %d segments of %d blocks starting at %d\n", block.super.nsegments, block.super.segblocks, block.super.segstart);
+		printf("    two %d block checkpoint regions, starting at %d\n", block.super.nckptblocks, block.super.ckptstart);
+		printf("    state is %s\n", block.super.state == FS_CLEAN ? "clean" : "dirty");
+	}
+
+	// extent totals for the fragmentation summary
+	int nfiles = 0;
+	int total_blocks = 0;
+	int total_extents = 0;
+
+	// a log-structured disk finds its inode blocks through the inode map, resident while it is mounted and
+	//  otherwise read from the newest checkpoint
+	struct fs_superblock super = block.super;
+	int *imap = NULL;
+	char *region = NULL;
+	if(super.segblocks > 0){
+		if(MOUNTED_FLAG == 1){
+			imap = MOUNT_STATE.imap;
+		}
+		else{
+			region = disk_alloc(super.nckptblocks);
+			int sequence = checkpointRead(&super, region);
+			printf("    newest checkpoint is %d\n", sequence);
+			if(sequence) imap = (int *) (region + DISK_BLOCK_SIZE);
+		}
+	}
+
+	// read inode data from each inode block, starting at block 1
+	int per_block = inodesPerBlock(&super);
+	struct fs_inode inodes[LEGACY_INODES_PER_BLOCK];
+	int i;
+	for(i = 1; i <= super.ninodeblocks; i++){
+		int where = i;
+		if(super.segblocks > 0){
+			where = imap ? imap[i-1] : 0;
+			if(!where) continue;
+		}
+		metaRead(where, block.data);
+		inodeDecode(&super, &block, inodes);
+
+		// for each inode in the block with a valid bit...
+		int j;
+		for(j = 0; j < per_block; j++){
+			struct fs_inode *inode = &inodes[j];
+
+			if(inode->isvalid){
+				// print inode number and size
+				int inumber = ((i-1) * per_block) + (j+1);
+				printf("inode %d:\n", inumber);
+				printf("    size: %d bytes\n", inode->size);
+				if(inode->isvalid & INODE_LINKS){
+					printf("    names: %d\n", (inode->isvalid & INODE_LINKS) / INODE_LINK);
+				}
+
+				// an extent is a run of data blocks that are consecutive both in the file and on disk
+				int nblocks = 0;
+				int nextents = 0;
+				int last = -1;
+
+				if(inodeInline(inode)){
+					printf("    inline data: %d bytes\n", inode->size);
+					continue;
+				}
+				if(inode->isvalid & INODE_COMPRESSED){
+					printf("    compressed\n");
+				}
+				if(inode->isvalid & INODE_DEDUP){
+					printf("    dedup\n");
+				}
+				if(inode->isvalid & INODE_CLONED){
+					printf("    cloned\n");
+				}
+				if(inode->isvalid & INODE_DIR){
+					printf("    directory\n");
+				}
+
+				// print inode direct blocks if they are not NULL (0)
+				printf("    direct blocks: ");
+				int k;
+				for(k = 0; k < POINTERS_PER_INODE; k++){
+					if(inode->direct[k]){
+						int blocknum = inode->direct[k] & ~BLOCK_FLAGS;
+						printf("%d ", blocknum);
+						countExtent(blocknum, &last, &nblocks, &nextents);
+					}
+				}
+				printf("\n");
+
+				// then each of the indirect, double and triple indirect trees that is present
+				static const char *names[MAX_DEPTH] = { "indirect", "double indirect", "triple indirect" };
+				int depth;
+				for(depth = 1; depth <= MAX_DEPTH; depth++){
+					int root = *blockRoot(inode, depth);
+					if(!root) continue;
+
+					printf("    %s block: %d\n", names[depth-1], root);
+					printf("    %s data blocks: ", names[depth-1]);
+					debugTree(root, depth, super.nblocks, &last, &nblocks, &nextents);
+					printf("\n");
+				}
+
+				if(nextents > 0){
+					printf("    extents: %d (average %.2f blocks)\n", nextents, (double) nblocks / nextents);
+					nfiles++;
+					total_blocks += nblocks;
+					total_extents += nextents;
+				}
+			}
+
+		}
+	}
+
+	if(total_extents > 0){
+		printf("fragmentation:\n");
+		printf("    %d extents over %d files, average extent length %.2f blocks\n",
+			total_extents, nfiles, (double) total_blocks / total_extents);
+	}
+
+	disk_free(region);
+
+}
+
+// mark a block found by a scan as used, a block found again is shared and counts one more reference
+//  returns one the first time, so a pointer block shared with a clone has what is below it marked once
+static int markBlock( int blocknum )
+{
+	if(MOUNT_STATE.refs && bitmap_test(FREE_BLOCK_BITMAP, blocknum)){
+		refTake(blocknum);
+		return 0;
+	}
+	bitmap_set(FREE_BLOCK_BITMAP, blocknum);
+	return 1;
+}
+
+// rebuild the free block bitmap, and the reference counts of shared blocks, from the inode table, used for legacy
+//  images and after an unclean shutdown
+static void scanBlocks()
+{
+	struct fs_superblock *super = &MOUNT_STATE.super;
+
+	// the super block, the inode table and the saved bitmap are never handed out
+	int j;
+	for(j = 0; j < dataStart(super); j++){
+		bitmap_set(FREE_BLOCK_BITMAP, j);
+	}
+
+	// the references to shared blocks are counted again along the way
+	if(MOUNT_STATE.refs){
+		for(j = 0; j < super->nblocks; j++){
+			MOUNT_STATE.refs[j].refs = 0;
+		}
+		for(j = 0; j < super->nrefblocks; j++){
+			refDirty(j * REFS_PER_BLOCK);
+		}
+	}
+
+	// read all inode blocks with a single vectored request and unpack them into the resident table
+	char *buffer = disk_alloc(super->ninodeblocks);
+	struct disk_io *io = malloc(sizeof(struct disk_io) * super->ninodeblocks);
+	int i;
+	for(i = 1; i <= super->ninodeblocks; i++){
+		io[i-1].blocknum = i;
+		io[i-1].data = buffer + (size_t) (i-1) * DISK_BLOCK_SIZE;
+	}
+	disk_readv(io, super->ninodeblocks);
+	MOUNT_STATE.inode_block_reads += super->ninodeblocks;
+	free(io);
+
+	for(i = 1; i <= super->ninodeblocks; i++){
+		inodeDecode(super, (union fs_block*) (buffer + (size_t) (i-1) * DISK_BLOCK_SIZE), &MOUNT_STATE.inodes[(i-1) * MOUNT_STATE.inodes_per_block]);
+		inodeLoaded(i);
+	}
+	disk_free(buffer);
+
+	// walk the resident inodes to mark their blocks in the bitmap, the roots of the indirect trees are
+	//  collected by height along the way and read in batches afterwards
+	int *roots[MAX_DEPTH];
+	int nroots[MAX_DEPTH];
+	int depth;
+	for(depth = 1; depth <= MAX_DEPTH; depth++){
+		roots[depth-1] = malloc(sizeof(int) * super->ninodes);
+		nroots[depth-1] = 0;
+	}
+
+	for(i = 1; i <= super->ninodes; i++){
+		struct fs_inode *inode = &MOUNT_STATE.inodes[i-1];
+
+		if(!inode->isvalid || inodeInline(inode)) continue;
+
+		// identify direct data blocks in bitmap
+		int k;
+		for(k = 0; k < POINTERS_PER_INODE; k++){
+			int direct_block = blockNumber(inode->direct[k]);
+			if(direct_block != 0){
+				markBlock(direct_block);
+			}
+		}
+
+		// if there are indirect trees, identify the corresponding data blocks below
+		for(depth = 1; depth <= MAX_DEPTH; depth++){
+			int root = *blockRoot(inode, depth);
+			if(root > 0 && root < super->nblocks && markBlock(root)){
+				roots[depth-1][nroots[depth-1]++] = root;
+			}
+		}
+	}
+
+	for(depth = 1; depth <= MAX_DEPTH; depth++){
+		markPointerBlocks(roots[depth-1], nroots[depth-1], depth);
+		free(roots[depth-1]);
+	}
+}
+
+// examine the disk for a filesystem
+//  if one is present, read the superblock, build a free block bitmap, and prepare the filesystem for use
+//  the superblock and every inode block are kept resident until the next mount
+//  return one on success, zero otherwise
+int fs_mount()
+{
+	union fs_block block;
+
+	// check for magic number in super block
+	disk_read(0, block.data);
+
+	int nblocks = block.super.nblocks;
+	int ninodeblocks = block.super.ninodeblocks;
+
+	// a damaged superblock could send the scan and the lookups that follow off the end of the disk
+	if(!superValid(&block.super)){
+		return 0;
+	}
+
+	// drop anything left over from an earlier mount
+	if(MOUNTED_FLAG == 1){
+		fs_unmount();
+	}
+
+	MOUNT_STATE.super = block.super;
+	MOUNT_STATE.inodes_per_block = inodesPerBlock(&block.super);
+	MOUNT_STATE.inodes = (struct fs_inode*) disk_alloc((ninodeblocks * MOUNT_STATE.inodes_per_block * sizeof(struct fs_inode) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE);
+	MOUNT_STATE.loaded = (char*) calloc(ninodeblocks, sizeof(char));
+	MOUNT_STATE.dirty = (char*) calloc(ninodeblocks, sizeof(char));
+	MOUNT_STATE.ndirty = 0;
+	MOUNT_STATE.inode_block_reads = 0;
+	MOUNT_STATE.inode_block_writes = 0;
+	MOUNT_STATE.inode_lookups = 0;
+	MOUNT_STATE.data_block_reads = 0;
+	MOUNT_STATE.data_block_writes = 0;
+	memset(MOUNT_STATE.readahead, 0, sizeof(MOUNT_STATE.readahead));
+	MOUNT_STATE.ra_clock = 0;
+	MOUNT_STATE.ra_blocks = 0;
+	MOUNT_STATE.ra_hits = 0;
+	MOUNT_STATE.ra_waste = 0;
+	MOUNT_STATE.hole_reads = 0;
+	MOUNT_STATE.inline_reads = 0;
+	MOUNT_STATE.zero_writes = 0;
+	MOUNT_STATE.cluster_inumber = 0;
+	MOUNT_STATE.compress_clusters = 0;
+	MOUNT_STATE.compress_raw = 0;
+	MOUNT_STATE.compress_saved = 0;
+	MOUNT_STATE.compress_reads = 0;
+	MOUNT_STATE.compress_hits = 0;
+	MOUNT_STATE.dedup_hashed = 0;
+	MOUNT_STATE.dedup_hits = 0;
+	MOUNT_STATE.dedup_verify = 0;
+	MOUNT_STATE.dedup_mismatch = 0;
+	MOUNT_STATE.dedup_cpu = 0;
+	MOUNT_STATE.clones = 0;
+	MOUNT_STATE.cow_data = 0;
+	MOUNT_STATE.cow_pointers = 0;
+	MOUNT_STATE.dir_lookups = 0;
+	MOUNT_STATE.dir_reads = 0;
+	MOUNT_STATE.dir_splits = 0;
+	MOUNT_STATE.dir_doublings = 0;
+	MOUNT_STATE.defrag_inumber = 0;
+	MOUNT_STATE.defrag_files = 0;
+	MOUNT_STATE.defrag_moved = 0;
+	MOUNT_STATE.defrag_kept = 0;
+
+	// every inumber starts out taken until its inode block is read in, and inumber zero is never handed out
+	MOUNT_STATE.inodemap = bitmap_create(block.super.ninodes + 1);
+	int j;
+	for(j = 0; j <= block.super.ninodes; j++){
+		bitmap_set(MOUNT_STATE.inodemap, j);
+	}
+	MOUNT_STATE.inodemap->cursor = block.super.ninodes + 1;
+	MOUNT_STATE.nextload = 1;
+
+	// build free block bit map, one bit per block
+	FREE_BLOCK_BITMAP = bitmap_create(nblocks);
+
+	// the journal holds everything committed since the disk was last clean, replaying it brings the inode
+	//  table, the block trees and the saved bitmap up to date in time bounded by the size of the journal
+	if(block.super.njournalblocks > 0){
+		MOUNT_STATE.journal = journal_open(block.super.journalstart, block.super.njournalblocks);
+		MOUNT_STATE.freed = bitmap_create(nblocks);
+		MOUNT_STATE.logfreed = bitmap_create(nblocks);
+		MOUNT_STATE.ops = 0;
+		if(block.super.state != FS_CLEAN){
+			int n = journal_replay(MOUNT_STATE.journal);
+			printf("filesystem was not cleanly unmounted, replayed %d journal transaction(s)\n", n);
+		}
+	}
+
+	if(block.super.segblocks > 0){
+		// a log-structured disk picks up from its newest checkpoint, which needs neither a replay nor a scan
+		if(!logLoad()){
+			printf("ERROR: no intact checkpoint on the log\n");
+			unmountState();
+			return 0;
+		}
+		refLoad();
+		if(block.super.state != FS_CLEAN){
+			printf("filesystem was not cleanly unmounted, recovered checkpoint %d\n", MOUNT_STATE.sequence);
+		}
+	} else if(block.super.nbitmapblocks > 0 && (block.super.state == FS_CLEAN || (block.super.state == FS_DIRTY && MOUNT_STATE.journal))){
+		// cleanly unmounted or recovered, the saved bitmap is trustworthy and inode blocks are read as they are needed
+		bitmapLoad();
+		refLoad();
+	} else {
+		if(block.super.nbitmapblocks > 0){
+			printf("filesystem was not cleanly unmounted, rebuilding the free block bitmap\n");
+		}
+		refLoad();
+		scanBlocks();
+		if(MOUNT_STATE.journal){
+			bitmapSave();
+			if(MOUNT_STATE.refs) refSave();
+		}
+	}
+	FREE_BLOCK_BITMAP->cursor = dataStart(&block.super);
+	if(MOUNT_STATE.refs){
+		dedupBuild();
+	}
+
+	// later commits log the bitmap blocks that differ from the saved copy
+	if(MOUNT_STATE.journal){
+		MOUNT_STATE.bitmap_image = disk_alloc(block.super.nbitmapblocks);
+		memset(MOUNT_STATE.bitmap_image, 0, (size_t) block.super.nbitmapblocks * DISK_BLOCK_SIZE);
+		bitmap_store(FREE_BLOCK_BITMAP, MOUNT_STATE.bitmap_image);
+	}
+
+	// mark the disk dirty until fs_unmount saves the bitmap again, so a crash forces a scan next time
+	if(block.super.nbitmapblocks > 0 || block.super.segblocks > 0){
+		MOUNT_STATE.super.state = FS_DIRTY;
+		superSave();
+		disk_flush();
+	}
+
+	MOUNTED_FLAG = 1;
+	return 1;
+}
+
+// read the given pointer blocks MOUNT_BATCH at a time and mark every block they point to as used,
+//  blocks of height one point at data and taller ones at the next level of pointer blocks
+#define MOUNT_BATCH 256
+static void markPointerBlocks( const int *blocks, int n, int height )
+{
+	union fs_block *batch = (union fs_block*) disk_alloc(MOUNT_BATCH);
+	struct disk_io io[MOUNT_BATCH];
+	int *children = height > 1 ? malloc(sizeof(int) * MOUNT_BATCH * POINTERS_PER_BLOCK) : NULL;
+
+	int i;
+	for(i = 0; i < n; i += MOUNT_BATCH){
+		int count = n - i < MOUNT_BATCH ? n - i : MOUNT_BATCH;
+		int nchildren = 0;
+
+		int j;
+		for(j = 0; j < count; j++){
+			io[j].blocknum = blocks[i+j];
+			io[j].data = batch[j].data;
+		}
+		disk_readv(io, count);
+		MOUNT_STATE.data_block_reads += count;
+
+		for(j = 0; j < count; j++){
+			int l;
+			for(l = 0; l < POINTERS_PER_BLOCK; l++){
+				int block_ptr = blockNumber(batch[j].pointers[l]);
+				if(block_ptr == 0) continue;
+
+				if(!markBlock(block_ptr)) continue;
+				if(children){
+					children[nchildren++] = block_ptr;
+				}
+			}
+		}
+
+		// the next level down is read before the batch buffer is reused
+		if(children){
+			markPointerBlocks(children, nchildren, height - 1);
+		}
+	}
+
+	free(children);
+	disk_free((char*) batch);
+}
+
+// write back everything fs_mount keeps resident, save the free block bitmap and mark the disk clean
+//  returns one on success, zero if nothing is mounted or a log-structured disk has no room left for its checkpoint
+int fs_unmount()
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	raDrop(0);
+	fileChanged(0, NULL);
+	if(MOUNT_STATE.journal){
+		journalCommit(1);
+	}
+	if(logMode()){
+		// without room for a checkpoint the disk is left dirty, and the next mount recovers the last one
+		if(!logCheckpoint()){
+			printf("ERROR: log full, changes since the last checkpoint are lost\n");
+			disk_flush();
+			unmountState();
+			return 0;
+		}
+		MOUNT_STATE.super.state = FS_CLEAN;
+		superSave();
+	}
+	inodeFlush();
+	refFlush();
+	if(MOUNT_STATE.super.nbitmapblocks > 0){
+		bitmapSave();
+		MOUNT_STATE.super.state = FS_CLEAN;
+		superSave();
+	}
+	disk_flush();
+
+	unmountState();
+	return 1;
+}
+
+// returns one if a filesystem is currently mounted
+int fs_mounted()
+{
+	return MOUNTED_FLAG;
+}
+
+// make everything written so far survive a crash, committing the metadata to the journal if there is one
+//  or writing a checkpoint on a log-structured disk
+//  returns one on success, zero if nothing is mounted or the log has no room left for the checkpoint
+int fs_sync()
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	if(MOUNT_STATE.journal){
+		journalCommit(0);
+	}
+	else if(logMode()){
+		if(!logCheckpoint()){
+			disk_flush();
+			return 0;
+		}
+	}
+	else{
+		inodeFlush();
+		refFlush();
+	}
+	disk_flush();
+	return 1;
+}
+
+// run one pass of the segment cleaner on a log-structured disk, returns the number of segments it reclaimed
+int fs_clean()
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+	if(!logMode()){
+		printf("ERROR: not a log-structured disk\n");
+		return 0;
+	}
+	return logClean();
+}
+
+// choose how the segment cleaner picks the segments it reclaims, returns one on success
+int fs_cleaner_policy( int policy )
+{
+	if(policy != FS_CLEANER_GREEDY && policy != FS_CLEANER_COST_BENEFIT){
+		printf("ERROR: unknown cleaner policy %d\n", policy);
+		return 0;
+	}
+	CLEANER_POLICY = policy;
+	return 1;
+}
+
+// create a new inode of zero length, on success: return the (positive) inumber, on failure: return zero
+int fs_create()
+{
+
+	//if no fs mounted, fail
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		 return 0;
+	}
+
+	// take the lowest open (invalid) inode from the inode map
+	if(!logMakeRoom(0)){
+		printf("ERROR: Disk full\n");
+		return 0;
+	}
+	int inumber = inodeAlloc();
+	if(inumber == 0){
+		// return the error if there are no more inodes
+		printf("ERROR: inode table full\n");
+		return 0;
+	}
+
+	// set isvalid to 1 and size to 0, and write back
+	//  a new file starts out inline, legacy inodes have no room for that and legacy readers would not know the flag
+	struct fs_inode *inode = &MOUNT_STATE.inodes[inumber-1];
+	memset(inode, 0, sizeof(struct fs_inode));
+	inode->isvalid = INODE_VALID;
+	if(MOUNT_STATE.super.inodesize != 0){
+		inode->isvalid |= INODE_INLINE;
+	}
+	inode->size = 0;
+	inodeDirty(inumber);
+	inodeFlush();
+	journalOp();
+
+	return inumber;
+
+}
+
+//Delete the inode indicated by the inumber. Release all data and 
+//indirect blocks assigned to this inode and return them to the free 
+//block map. On success, return one. On failure, return 0.
+int fs_delete( int inumber )
+{
+
+	//if no fs mounted, fail
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		 return 0;
+	}
+
+	//check inode number is in valid range
+	struct fs_inode *inode = inodeLookup(inumber);
+	if (!inode){
+		printf("ERROR: Inode out of range\n");
+		return 0;
+	}
+
+	if(inode->isvalid == 0){
+		printf("ERROR: Invalid inode\n");
+		return 0;
+	}
+
+	//a named file would leave its names pointing at nothing, and a directory its entries
+	if(inode->isvalid & INODE_DIR){
+		printf("ERROR: inode %d is a directory, unlink it by name\n", inumber);
+		return 0;
+	}
+	if(inode->isvalid & INODE_LINKS){
+		printf("ERROR: inode %d still has names, unlink them first\n", inumber);
+		return 0;
+	}
+
+	logMakeRoom(0);
+	inodeDelete(inumber, inode);
+	journalOp();
+
+	return 1;
+}
+
+// let go of the blocks of an inode and free it, for fs_delete and for fs_unlink once the last name is gone
+static void inodeDelete( int inumber, struct fs_inode *inode )
+{
+	if(MOUNT_STATE.defrag_inumber == inumber) MOUNT_STATE.defrag_inumber = 0;
+	raDrop(inumber);
+	fileChanged(inumber, NULL);
+	clusterDrop(inumber);
+
+	//an inline file has no blocks to give back, clearing its data leaves no pointers behind either
+	if(inodeInline(inode)){
+		memset(inode->data, 0, INLINE_BYTES);
+	}
+
+	//delete all direct pointers
+	int j;
+	for(j = 0; j < POINTERS_PER_INODE; j++){
+		if (blockNumber(inode->direct[j])){
+			blockRelease(blockNumber(inode->direct[j]));  //Set bitmap to 0
+			inode->direct[j] = 0; 	//Remove pointer
+		}
+	}
+
+	//delete the indirect, double and triple indirect trees along with all the data they map
+	int depth;
+	for(depth = 1; depth <= MAX_DEPTH; depth++){
+		int *root = blockRoot(inode, depth);
+		if(*root != 0){
+			blockFreeTree(*root, depth);
+			*root = 0;
+		}
+	}
+
+	inode->isvalid = 0;
+	inode->size = 0;
+	inodeDirty(inumber);
+	inodeFlush();
+	inodeRelease(inumber);
+}
+
+// create a new inode holding a copy of the given one, return its inumber, or zero on failure
+//  the copy shares every data block and pointer block of the original, each taking one more reference, so
+//  however large the file it only costs the inode and a few blocks of the reference table, a block is copied
+//  the first time either file writes to it, along with the pointer blocks above it, see blockWrite()
+int fs_clone( int inumber )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(!inode || !inode->isvalid){
+		printf("ERROR: Invalid inode\n");
+		return 0;
+	}
+
+	// the entries of a directory name other inodes, which a copy would have to count as well
+	if(inode->isvalid & INODE_DIR){
+		printf("ERROR: inode %d is a directory\n", inumber);
+		return 0;
+	}
+
+	// shared blocks are only safe where their references are counted, an inline file has none to share
+	if(!MOUNT_STATE.refs && !inodeInline(inode)){
+		printf("ERROR: clone needs a disk formatted with a block reference table\n");
+		return 0;
+	}
+
+	if(!logMakeRoom(0)){
+		printf("ERROR: Disk full\n");
+		return 0;
+	}
+	int clone = inodeAlloc();
+	if(clone == 0){
+		printf("ERROR: inode table full\n");
+		return 0;
+	}
+
+	// the copy starts out without a name
+	struct fs_inode *copy = &MOUNT_STATE.inodes[clone-1];
+	*copy = *inode;
+	copy->isvalid &= ~INODE_LINKS;
+	if(!inodeInline(inode)){
+		int j;
+		for(j = 0; j < POINTERS_PER_INODE; j++){
+			if(blockNumber(inode->direct[j])) refTake(blockNumber(inode->direct[j]));
+		}
+
+		// below the roots the pointer blocks are shared too, until one of the files changes them
+		int depth;
+		for(depth = 1; depth <= MAX_DEPTH; depth++){
+			int root = *blockRoot(inode, depth);
+			if(root <= 0 || root >= MOUNT_STATE.super.nblocks) continue;
+			refTake(root);
+			if(!(inode->isvalid & INODE_CLONED)){
+				inode->isvalid |= INODE_CLONED;
+				inodeDirty(inumber);
+			}
+			copy->isvalid |= INODE_CLONED;
+		}
+	}
+	inodeDirty(clone);
+	inodeFlush();
+	MOUNT_STATE.clones++;
+	journalOp();
+
+	return clone;
+}
+
+// return the logical size of the given inode, in bytes
+int fs_getsize( int inumber )
+{
+	//if no fs mounted, fail
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		 return -1;
+	}
+
+	//check inode number is in valid range
+	struct fs_inode *inode = inodeLookup(inumber);
+	if (!inode){
+		printf("ERROR: Inode out of range\n");
+		return 0;
+	}
+
+	return inode->size;
+
+	// TODO Error checking
+	// return -1;
+}
+
+// returns one if the cluster whose first block has the given pointer is stored compressed
+static int clusterCompressed( int ptr )
+{
+	return blockNumber(ptr) && (ptr & BLOCK_COMPRESSED);
+}
+
+// forget the cluster held in memory if it belongs to inumber
+static void clusterDrop( int inumber )
+{
+	if(MOUNT_STATE.cluster_inumber == inumber){
+		MOUNT_STATE.cluster_inumber = 0;
+	}
+}
+
+// the contents of compressed cluster index of a file, given the pointers of its blocks, decompressed into
+//  the buffer held in memory unless it is there already, and zero filled past the end of the data
+//  returns NULL if the cluster is damaged
+static char *clusterLoad( int inumber, int index, const int *ptrs )
+{
+	if(!MOUNT_STATE.cluster){
+		MOUNT_STATE.cluster = disk_alloc(COMPRESS_CLUSTER);
+	}
+	if(MOUNT_STATE.cluster_inumber == inumber && MOUNT_STATE.cluster_index == index){
+		MOUNT_STATE.compress_hits++;
+		return MOUNT_STATE.cluster;
+	}
+	MOUNT_STATE.cluster_inumber = 0;
+
+	// the compressed data fills the blocks at the front of the cluster, with one request to read them
+	char *stage = disk_alloc(COMPRESS_CLUSTER);
+	struct disk_io io[COMPRESS_CLUSTER];
+	int n = 0;
+	while(n < COMPRESS_CLUSTER && clusterCompressed(ptrs[n])){
+		io[n].blocknum = blockNumber(ptrs[n]);
+		io[n].data = stage + (size_t) n * DISK_BLOCK_SIZE;
+		n++;
+	}
+	disk_readv(io, n);
+	MOUNT_STATE.data_block_reads += n;
+	MOUNT_STATE.compress_reads++;
+
+	struct fs_cluster head = *(struct fs_cluster *) stage;
+	int size = -1;
+	if(head.length <= n * DISK_BLOCK_SIZE - sizeof(head) && head.size <= COMPRESS_CLUSTER * DISK_BLOCK_SIZE){
+		size = lz_decompress(stage + sizeof(head), head.length, MOUNT_STATE.cluster, head.size);
+	}
+	disk_free(stage);
+
+	if(size < 0 || size != head.size){
+		printf("ERROR: compressed cluster %d of inode %d is damaged\n", index, inumber);
+		return NULL;
+	}
+	memset(MOUNT_STATE.cluster + size, 0, COMPRESS_CLUSTER * DISK_BLOCK_SIZE - size);
+
+	MOUNT_STATE.cluster_inumber = inumber;
+	MOUNT_STATE.cluster_index = index;
+	return MOUNT_STATE.cluster;
+}
+
+// read from an inode that has been checked, through its open file if there is one
+static int fileRead( struct fs_file *f, int inumber, struct fs_inode *inode, char *data, int length, int offset )
+{
+	// get data from given inode, nothing to read at or past the end of the file
+	int size = inode->size;
+	if(offset < 0 || length <= 0 || offset >= size) return 0;
+	if(length > size - offset) length = size - offset;
+
+	// an inline file is read straight out of the resident inode
+	if(inodeInline(inode)){
+		memcpy(data, inode->data + offset, length);
+		MOUNT_STATE.inline_reads++;
+		return length;
+	}
+
+	// map the logical blocks covering the request to disk blocks, out to whole clusters so the pointers of
+	//  any compressed cluster the request reaches into are at hand
+	int first = getLocation(offset);
+	int count = getLocation(offset + length - 1) - first + 1;
+	readahead(f, inumber, inode, first, count);
+
+	int mfirst = first;
+	int mcount = count;
+	if(inode->isvalid & INODE_PACKED){
+		mfirst = first - first % COMPRESS_CLUSTER;
+		mcount = (first + count - mfirst + COMPRESS_CLUSTER - 1) / COMPRESS_CLUSTER * COMPRESS_CLUSTER;
+	}
+	int *map = calloc(mcount, sizeof(int));
+	fileMap(f, inode, mfirst, mfirst + mcount <= maxBlocks() ? mcount : maxBlocks() - mfirst, map);
+	int *blocknums = map + (first - mfirst);
+
+	// read them all with one vectored request, blocks that lie wholly inside the request go straight
+	//  into the caller's buffer and only a partial head or tail block is staged in the bounce buffer
+	//  holes, and blocks reserved but never written, are zero filled without any disk I/O, and blocks of a
+	//  compressed cluster are copied out of it once it is decompressed
+	char *bounce = disk_alloc(2);
+	char **dest = malloc(sizeof(char*) * count);
+	struct disk_io *io = malloc(sizeof(struct disk_io) * (count + 1));
+	int nio = 0;
+	int i;
+	for(i = 0; i < count; i++){
+		int start = (first + i) * DISK_BLOCK_SIZE - offset;
+		if(start >= 0 && start + DISK_BLOCK_SIZE <= length){
+			dest[i] = data + start;
+		}
+		else{
+			dest[i] = i == 0 ? bounce : bounce + DISK_BLOCK_SIZE;
+		}
+
+		int index = first + i;
+		int *cluster = map + (index - index % COMPRESS_CLUSTER - mfirst);
+		if((inode->isvalid & INODE_PACKED) && clusterCompressed(cluster[0])){
+			char *contents = clusterLoad(inumber, index / COMPRESS_CLUSTER, cluster);
+			if(contents){
+				memcpy(dest[i], contents + (size_t) (index % COMPRESS_CLUSTER) * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+			}
+			else{
+				memset(dest[i], 0, DISK_BLOCK_SIZE);
+			}
+			continue;
+		}
+
+		if(blocknums[i] == 0 || (blocknums[i] & BLOCK_UNWRITTEN)){
+			memset(dest[i], 0, DISK_BLOCK_SIZE);
+			MOUNT_STATE.hole_reads++;
+			continue;
+		}
+		io[nio].blocknum = blocknums[i];
+		io[nio].data = dest[i];
+		nio++;
+	}
+	disk_readv(io, nio);
+	MOUNT_STATE.data_block_reads += nio;
+
+	// copy out the partial head and tail
+	if(dest[0] == bounce){
+		int n = DISK_BLOCK_SIZE - offset % DISK_BLOCK_SIZE;
+		if(n > length) n = length;
+		memcpy(data, bounce + offset % DISK_BLOCK_SIZE, n);
+	}
+	if(count > 1 && dest[count-1] == bounce + DISK_BLOCK_SIZE){
+		int start = (first + count - 1) * DISK_BLOCK_SIZE - offset;
+		memcpy(data + start, bounce + DISK_BLOCK_SIZE, length - start);
+	}
+
+	free(io);
+	free(dest);
+	disk_free(bounce);
+	free(map);
+
+	return length;
+
+}
+
+// read data from a valid inode, copy "length" bytes from the inode into the "data" pointer, starting at "offset" in the inode
+//  return the total number of bytes read, the number of bytes actually read could be smaller than the number of bytes requested, 
+//  perhaps if the end of the inode is reached, if the given inumber is invalid, or any other error is encountered, return 0
+int fs_read( int inumber, char *data, int length, int offset )
+{
+	//if no fs mounted, fail
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		 return 0;
+	}
+
+	//check inode number is in valid range
+	struct fs_inode *inode = inodeLookup(inumber);
+	if (!inode){
+		printf("ERROR: Inode out of range\n");
+		return 0;
+	}
+
+	// if inode is invalid, return 0
+	if(!inode->isvalid){
+		printf("ERROR: invalid inode\n");
+		return 0;
+	}
+
+	return fileRead(NULL, inumber, inode, data, length, offset);
+}
+
+// return one if the n bytes at data are all zero, a vector at a time where the compiler allows
+//  and giving up at the first 64 bytes that are not
+static int isZero( const char *data, int n )
+{
+	int i = 0;
+#if defined(__AVX2__)
+	for(; i + 64 <= n; i += 64){
+		__m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(data + i)),
+			_mm256_loadu_si256((const __m256i *)(data + i + 32)));
+		if(!_mm256_testz_si256(v, v)) return 0;
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	for(; i + 64 <= n; i += 64){
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(data + i)), _mm_loadu_si128((const __m128i *)(data + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(data + i + 32)), _mm_loadu_si128((const __m128i *)(data + i + 48))));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) return 0;
+	}
+#endif
+	for(; i < n; i++){
+		if(data[i]) return 0;
+	}
+	return 1;
+}
+
+static uint64_t rotl64( uint64_t v, int n )
+{
+	return (v << n) | (v >> (64 - n));
+}
+
+// fingerprint of a block of data for the dedup index, never zero
+//  four lanes of 64 bit multiply and rotate rounds in the manner of xxHash, then folded down to 32 bits
+static uint32_t blockHash( const char *data )
+{
+	const uint64_t p1 = 0x9e3779b185ebca87ull;
+	const uint64_t p2 = 0xc2b2ae3d27d4eb4full;
+	uint64_t lane[4] = { p1 + p2, p2, 0, -p1 };
+
+	int i;
+	for(i = 0; i < DISK_BLOCK_SIZE; i += 32){
+		int l;
+		for(l = 0; l < 4; l++){
+			uint64_t v;
+			memcpy(&v, data + i + 8 * l, sizeof(v));
+			lane[l] = rotl64(lane[l] + v * p2, 31) * p1;
+		}
+	}
+
+	uint64_t h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18);
+	h ^= h >> 33;
+	h *= p2;
+	h ^= h >> 29;
+	h *= p1;
+	h ^= h >> 32;
+	uint32_t hash = (uint32_t) h;
+	return hash ? hash : 1;
+}
+
+// a block on disk holding the same data as the given block, found through the dedup index, or zero if
+//  there is none, a fingerprint only points at candidates, which are read back to be sure
+static int dedupFind( uint32_t hash, const char *data, char *buffer )
+{
+	if(!MOUNT_STATE.dedup_index) return 0;
+
+	int mask = MOUNT_STATE.dedup_slots - 1;
+	int i;
+	for(i = dedupHome(hash); MOUNT_STATE.dedup_index[i]; i = (i + 1) & mask){
+		int b = MOUNT_STATE.dedup_index[i];
+		if(MOUNT_STATE.refs[b].hash != hash || MOUNT_STATE.refs[b].refs == UINT32_MAX) continue;
+
+		disk_read(b, buffer);
+		MOUNT_STATE.data_block_reads++;
+		MOUNT_STATE.dedup_verify++;
+		if(memcmp(buffer, data, DISK_BLOCK_SIZE) == 0) return b;
+		MOUNT_STATE.dedup_mismatch++;
+	}
+	return 0;
+}
+
+// fingerprint the blocks of a write that cover logical blocks first on and are written in full, and look
+//  each up, first among the earlier blocks of the same write and then in the dedup index
+//  repeat[i] is one more than the earlier block of the write holding the same data, share[i] the block on
+//  disk that does, which is counted as taken right away so nothing in the write can overwrite it in place
+static void dedupLookup( const char *data, int offset, int length, int first, int count, const int *blocks, const char *zero, uint32_t *hash, int *share, int *repeat )
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+	// the blocks of the write seen so far, open addressed by fingerprint, holding one more than their index
+	int nseen = 1;
+	while(nseen < 2 * count) nseen *= 2;
+	int *seen = calloc(nseen, sizeof(int));
+	char *buffer = disk_alloc(1);
+
+	int i;
+	for(i = 0; i < count; i++){
+		long long lo = (long long) (first + i) * DISK_BLOCK_SIZE;
+		if(zero[i] || lo < offset || lo + DISK_BLOCK_SIZE > (long long) offset + length) continue;
+
+		const char *block = data + (lo - offset);
+		hash[i] = blockHash(block);
+		MOUNT_STATE.dedup_hashed++;
+
+		int slot = hash[i] & (nseen - 1);
+		while(seen[slot]){
+			int j = seen[slot] - 1;
+			const char *other = data + ((long long) (first + j) * DISK_BLOCK_SIZE - offset);
+			if(hash[j] == hash[i] && memcmp(other, block, DISK_BLOCK_SIZE) == 0){
+				repeat[i] = j + 1;
+				break;
+			}
+			slot = (slot + 1) & (nseen - 1);
+		}
+		if(repeat[i]){
+			MOUNT_STATE.dedup_hits++;
+			continue;
+		}
+		seen[slot] = i + 1;
+
+		share[i] = dedupFind(hash[i], block, buffer);
+		if(share[i]){
+			MOUNT_STATE.dedup_hits++;
+			if(share[i] != blockNumber(blocks[i])) refTake(share[i]);
+		}
+	}
+
+	disk_free(buffer);
+	free(seen);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	MOUNT_STATE.dedup_cpu += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// write to the data blocks of an inode that has been checked, through its open file if there is one
+//  returns the number of bytes written, leaving the size and the inode for the caller to bring up to date
+static int blockWrite( struct fs_file *f, int inumber, struct fs_inode *inode, const char *data, int length, int offset )
+{
+	//the write covers logical blocks first_ptr to last_ptr, anything between the current end of the file
+	// and first_ptr is left as a hole
+	int first_ptr = getLocation(offset);
+	int last_ptr = getLocation(offset + length - 1);
+	if(last_ptr >= maxBlocks()){
+		last_ptr = maxBlocks() - 1;
+	}
+	if(first_ptr > last_ptr){
+		printf("ERROR: File too large\n");
+		return 0;
+	}
+	int count = last_ptr - first_ptr + 1;
+
+	//blocks that are already mapped are overwritten in place, only the missing ones are allocated
+	// a block that has never been written (a hole, or one reserved by fs_fallocate) is fresh, it holds zeros
+	// around the write, and stays as it is if the write puts nothing but zeros there
+	// on a log-structured disk a mapped block the last checkpoint refers to moves to the head of the log
+	// instead, as does a block shared with another file anywhere, directly or through a pointer block of a
+	// clone, even a fresh one, so old[] keeps where the data was for merging a partial block
+	struct fs_walk walk;
+	walkInit(&walk);
+
+	int *blocks = malloc(sizeof(int) * count);
+	int *old = malloc(sizeof(int) * count);
+	char *fresh = malloc(count);
+	char *zero = malloc(count);
+	char *moving = malloc(count);
+	int i;
+	for(i = 0; i < count; i++){
+		long long lo = (long long) (first_ptr + i) * DISK_BLOCK_SIZE;
+		int from = lo < offset ? offset - lo : 0;
+		int to = lo + DISK_BLOCK_SIZE > (long long) offset + length ? offset + length - lo : DISK_BLOCK_SIZE;
+
+		blocks[i] = fileLookup(f, &walk, inode, first_ptr + i);
+		old[i] = blocks[i];
+		fresh[i] = blocks[i] == 0 || (blocks[i] & BLOCK_UNWRITTEN);
+		zero[i] = fresh[i] && isZero(data + (lo + from - offset), to - from);
+	}
+
+	//a file that dedups points a block it writes in full at one on disk, or earlier in the write, holding
+	// the same data instead of writing it again, such a block needs no data block of its own, but a hole
+	// still needs the pointer blocks down to it
+	int *share = calloc(count, sizeof(int));
+	int *repeat = calloc(count, sizeof(int));
+	uint32_t *hash = NULL;
+	if((inode->isvalid & INODE_DEDUP) && MOUNT_STATE.refs){
+		hash = calloc(count, sizeof(uint32_t));
+		dedupLookup(data, offset, length, first_ptr, count, blocks, zero, hash, share, repeat);
+	}
+
+	int missing = 0;
+	int paths = 0;
+	int first_missing = -1;
+	for(i = 0; i < count; i++){
+		int b = blockNumber(blocks[i]);
+		int shared = b && (refShared(b) || pathShared(&walk, inode, first_ptr + i));
+		moving[i] = !share[i] && !repeat[i] && !zero[i] && ((!fresh[i] && logMode() && imageTest(MOUNT_STATE.bitmap_image, b)) || shared);
+		if(moving[i] && shared) MOUNT_STATE.cow_data++;
+		if((blocks[i] == 0 && !zero[i]) || moving[i]){
+			if(share[i] || repeat[i]) paths++; else missing++;
+			if(first_missing < 0) first_missing = first_ptr + i;
+		}
+	}
+
+	//reserve the missing blocks up front, as one contiguous extent if the disk allows, placed right
+	// after the block that precedes them in the file, a log-structured disk takes them from the head of the
+	// log as they are needed instead
+	int *reserved = NULL;
+	int nreserved = 0;
+	int next = 0;
+	if((missing > 0 || paths > 0) && !logMode()){
+		int need = missing + blockOverhead(first_missing, last_ptr);
+		int goal = -1;
+		if(first_missing > 0){
+			int prev = blockNumber(fileLookup(f, &walk, inode, first_missing - 1));
+			if(prev > 0 && prev + 1 < MOUNT_STATE.super.nblocks) goal = prev + 1;
+		}
+		reserved = malloc(sizeof(int) * need);
+		nreserved = allocExtents(goal, need, reserved);
+	}
+
+	for(i = 0; i < count; i++){
+		if(zero[i]) continue;
+
+		if(share[i] || repeat[i]){
+			//point at the block holding the same data, unless that is the one already there
+			int target = share[i] ? share[i] : blockNumber(blocks[repeat[i]-1]);
+			if(target == blockNumber(blocks[i])) continue;
+
+			int *entry = blockEntry(&walk, inumber, inode, first_ptr + i, reserved, &next, nreserved);
+			if(!entry){
+				printf("ERROR: Disk full\n");
+				break;
+			}
+			*entry = target;
+			blocks[i] = target;
+			if(repeat[i]){
+				refTake(target);
+			}
+		}
+		else if(blocks[i] == 0 || moving[i]){
+			//take the next reserved block, along with any pointer blocks needed to reach it
+			blocks[i] = blockAssign(&walk, inumber, inode, first_ptr + i, reserved, &next, nreserved);
+			if(blocks[i] == 0){
+				printf("ERROR: Disk full\n");
+				break;
+			}
+		}
+		else if(blocks[i] & BLOCK_UNWRITTEN){
+			//the first write to a block reserved by fs_fallocate turns it into an ordinary one
+			blocks[i] &= ~BLOCK_UNWRITTEN;
+			blockSet(&walk, inumber, inode, first_ptr + i, blocks[i]);
+		}
+		else{
+			continue;
+		}
+
+		if(f){
+			fileSet(f, first_ptr + i, blocks[i]);
+		}
+	}
+	//blocks past where the disk filled up let go of those they were to share
+	int k;
+	for(k = i; k < count; k++){
+		if(share[k] && share[k] != blockNumber(old[k])) refDrop(share[k]);
+	}
+	count = i;
+	walkFlush(&walk);
+
+	//give back whatever was reserved but not used
+	while(next < nreserved){
+		bitmap_clear(FREE_BLOCK_BITMAP, reserved[next++]);
+	}
+	free(reserved);
+
+	//a block the write only partly covers is merged with what is already there, or zero filled if it is fresh,
+	// at most the head and tail block need this and they are read with one request
+	char *staging = disk_alloc(2);
+	memset(staging, 0, 2 * DISK_BLOCK_SIZE);
+
+	struct disk_io merge[2];
+	int nmerge = 0;
+	for(i = 0; i < count; i++){
+		if(fresh[i]) continue;
+
+		long long lo = (long long) (first_ptr + i) * DISK_BLOCK_SIZE;
+		if(lo >= offset && lo + DISK_BLOCK_SIZE <= (long long) offset + length) continue;
+
+		merge[nmerge].blocknum = old[i];
+		merge[nmerge].data = staging + (i == 0 ? 0 : DISK_BLOCK_SIZE);
+		nmerge++;
+	}
+	disk_readv(merge, nmerge);
+	MOUNT_STATE.data_block_reads += nmerge;
+
+	//data blocks are written with one vectored request, full blocks straight from the caller's buffer
+	struct disk_io *io = malloc(sizeof(struct disk_io) * (count + 1));
+	int nio = 0;
+	for(i = 0; i < count; i++){
+		if(zero[i]){
+			MOUNT_STATE.zero_writes++;
+			continue;
+		}
+		if(share[i] || repeat[i]) continue;
+
+		long long lo = (long long) (first_ptr + i) * DISK_BLOCK_SIZE;
+		io[nio].blocknum = blocks[i];
+
+		if(lo >= offset && lo + DISK_BLOCK_SIZE <= (long long) offset + length){
+			io[nio].data = (char*) data + (lo - offset);
+		}
+		else{
+			char *block = staging + (i == 0 ? 0 : DISK_BLOCK_SIZE);
+			int from = lo < offset ? offset - lo : 0;
+			int to = lo + DISK_BLOCK_SIZE > (long long) offset + length ? offset + length - lo : DISK_BLOCK_SIZE;
+			memcpy(block + from, data + (lo + from - offset), to - from);
+			io[nio].data = block;
+		}
+		nio++;
+	}
+	disk_writev(io, nio);
+	MOUNT_STATE.data_block_writes += nio;
+
+	//the blocks that moved are given up once their new copies are written, as are those given up for shared
+	// ones, and the dedup index learns what the blocks written now hold
+	for(i = 0; i < count; i++){
+		int b = blockNumber(old[i]);
+		if(moving[i]){
+			blockRelease(b);
+		}
+		else if(share[i] || repeat[i]){
+			if(b && b != blockNumber(blocks[i])) blockRelease(b);
+			continue;
+		}
+		else if(zero[i]){
+			continue;
+		}
+
+		if(hash && hash[i]){
+			dedupAdd(blockNumber(blocks[i]), hash[i]);
+		}
+		else{
+			dedupForget(blockNumber(blocks[i]));
+		}
+	}
+
+	free(hash);
+	free(repeat);
+	free(share);
+	free(io);
+	disk_free(staging);
+	free(moving);
+	free(zero);
+	free(fresh);
+	free(old);
+	free(blocks);
+
+	//bytes written run up to the end of the last block that was dealt with
+	long long end = (long long) (first_ptr + count) * DISK_BLOCK_SIZE;
+	if(end > (long long) offset + length) end = (long long) offset + length;
+	int written = end > offset ? end - offset : 0;
+	return written;
+}
+
+// returns one if a write of length bytes at offset has to go a cluster at a time, because the file is
+//  compressed or the write reaches into a cluster that is stored compressed
+static int clusterNeeded( struct fs_file *f, struct fs_inode *inode, int offset, int length )
+{
+	if(inode->isvalid & INODE_COMPRESSED) return 1;
+	if(!(inode->isvalid & INODE_PACKED)) return 0;
+
+	struct fs_walk walk;
+	walkInit(&walk);
+
+	int last = getLocation(offset + length - 1);
+	if(last >= maxBlocks()) last = maxBlocks() - 1;
+	int c;
+	for(c = getLocation(offset) / COMPRESS_CLUSTER; c <= last / COMPRESS_CLUSTER; c++){
+		if(clusterCompressed(fileLookup(f, &walk, inode, c * COMPRESS_CLUSTER))) return 1;
+	}
+	return 0;
+}
+
+// let go of the blocks a cluster held, after its pointers have been cleared
+static void clusterRelease( const int *ptrs, int n )
+{
+	int j;
+	for(j = 0; j < n; j++){
+		if(blockNumber(ptrs[j])){
+			blockRelease(blockNumber(ptrs[j]));
+		}
+	}
+}
+
+// write n bytes at byte at of cluster index of a file that is to hold size bytes, returning n, or zero if
+//  the disk is full
+//  the cluster is put together in memory from what it held and the new data, then stored compressed if the
+//  file asks for that and it takes at least a block less that way, as plain blocks if not, and as a hole if
+//  it is all zeros
+//  a compressed cluster takes the blocks at the front of it, pointed to with BLOCK_COMPRESSED set, and the
+//  pointers of the rest of it are left zero
+static int clusterPut( struct fs_file *f, int inumber, struct fs_inode *inode, int index, const char *data, int at, int n, long long size )
+{
+	int base = index * COMPRESS_CLUSTER;
+	long long lo = (long long) base * DISK_BLOCK_SIZE;
+	int offset = lo + at;
+	int nslots = maxBlocks() - base < COMPRESS_CLUSTER ? maxBlocks() - base : COMPRESS_CLUSTER;
+
+	struct fs_walk walk;
+	walkInit(&walk);
+
+	int ptrs[COMPRESS_CLUSTER];
+	int j;
+	for(j = 0; j < COMPRESS_CLUSTER; j++){
+		ptrs[j] = j < nslots ? fileLookup(f, &walk, inode, base + j) : 0;
+	}
+	int packed = clusterCompressed(ptrs[0]);
+
+	// plain clusters of a file that is no longer compressed are written as those of any other file
+	if(!packed && !(inode->isvalid & INODE_COMPRESSED)){
+		return blockWrite(f, inumber, inode, data, n, offset);
+	}
+
+	// bytes of the cluster that hold file data before and after the write, the rest of it is zeros
+	int old = inode->size - lo < 0 ? 0 : inode->size - lo;
+	if(old > nslots * DISK_BLOCK_SIZE) old = nslots * DISK_BLOCK_SIZE;
+	int bytes = size - lo < nslots * DISK_BLOCK_SIZE ? size - lo : nslots * DISK_BLOCK_SIZE;
+	int nvalid = (bytes + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+
+	// put the cluster together, what it held only has to be read if the write leaves some of it
+	char *buffer = disk_alloc(COMPRESS_CLUSTER);
+	memset(buffer, 0, COMPRESS_CLUSTER * DISK_BLOCK_SIZE);
+	if(old > 0 && (at > 0 || at + n < old)){
+		if(packed){
+			char *contents = clusterLoad(inumber, index, ptrs);
+			if(!contents){
+				disk_free(buffer);
+				return 0;
+			}
+			memcpy(buffer, contents, COMPRESS_CLUSTER * DISK_BLOCK_SIZE);
+		}
+		else{
+			struct disk_io io[COMPRESS_CLUSTER];
+			int nio = 0;
+			for(j = 0; j < nslots; j++){
+				if(!blockNumber(ptrs[j]) || (ptrs[j] & BLOCK_UNWRITTEN)) continue;
+				if(j * DISK_BLOCK_SIZE >= at && (j + 1) * DISK_BLOCK_SIZE <= at + n) continue;
+				io[nio].blocknum = blockNumber(ptrs[j]);
+				io[nio].data = buffer + (size_t) j * DISK_BLOCK_SIZE;
+				nio++;
+			}
+			disk_readv(io, nio);
+			MOUNT_STATE.data_block_reads += nio;
+		}
+	}
+	memcpy(buffer + at, data, n);
+
+	// compress it, the compressor looks at how the first stretch goes and gives up early on data that does
+	//  not shrink, which is then written as it is
+	int zero = isZero(buffer, bytes);
+	char *packing = NULL;
+	int k = 0;
+	if(!zero && (inode->isvalid & INODE_COMPRESSED) && nvalid > 1){
+		packing = disk_alloc(nvalid - 1);
+		int head = sizeof(struct fs_cluster);
+		int length = lz_compress(buffer, bytes, packing + head, (nvalid - 1) * DISK_BLOCK_SIZE - head);
+		if(length > 0){
+			((struct fs_cluster *) packing)->length = length;
+			((struct fs_cluster *) packing)->size = bytes;
+			k = (head + length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+			memset(packing + head + length, 0, (size_t) k * DISK_BLOCK_SIZE - head - length);
+		}
+		else{
+			MOUNT_STATE.compress_raw++;
+		}
+	}
+
+	// a cluster of zeros gives up its blocks, and one that stays plain is written as blocks, the blocks of
+	//  a compressed cluster it replaces are let go once the plain copy is in place
+	if(zero || k == 0){
+		int result = n;
+		if(packed || zero){
+			// clearing a pointer in a block shared with a clone takes a copy of it, if there is no room for
+			//  that the cluster is put back the way it was
+			for(j = 0; j < nslots; j++){
+				if(!ptrs[j]) continue;
+				if(!blockSet(&walk, inumber, inode, base + j, 0)) break;
+				if(f){
+					fileSet(f, base + j, 0);
+				}
+			}
+			if(j < nslots){
+				int m;
+				for(m = 0; m < j; m++){
+					if(!ptrs[m]) continue;
+					blockSet(&walk, inumber, inode, base + m, ptrs[m]);
+					if(f){
+						fileSet(f, base + m, ptrs[m]);
+					}
+				}
+				walkFlush(&walk);
+				disk_free(packing);
+				disk_free(buffer);
+				printf("ERROR: Disk full\n");
+				return 0;
+			}
+			walkFlush(&walk);
+			clusterDrop(inumber);
+
+			if(zero){
+				MOUNT_STATE.zero_writes += nvalid;
+			}
+			else if(blockWrite(f, inumber, inode, buffer, bytes, lo) < bytes){
+				result = 0;
+			}
+			clusterRelease(ptrs, nslots);
+		}
+		else{
+			result = blockWrite(f, inumber, inode, data, n, offset);
+		}
+		disk_free(packing);
+		disk_free(buffer);
+		return result;
+	}
+
+	// blocks the cluster held may be written over where they are when nothing could be left pointing at
+	//  them by a crash in the middle, on a disk with no journal, or one the last checkpoint of a log does not
+	//  refer to, and no other file shares them or a pointer block above them, the rest are let go after the write
+	int keep[COMPRESS_CLUSTER];
+	int drop[COMPRESS_CLUSTER];
+	int nkeep = 0;
+	int ndrop = 0;
+	int cow = 0;
+	for(j = 0; j < nslots; j++){
+		int b = blockNumber(ptrs[j]);
+		if(!b) continue;
+		int shared = pathShared(&walk, inode, base + j);
+		cow |= shared;
+		if(shared || refShared(b) || (logMode() ? imageTest(MOUNT_STATE.bitmap_image, b) : MOUNT_STATE.journal != NULL)){
+			drop[ndrop++] = b;
+		}
+		else{
+			keep[nkeep++] = b;
+			dedupForget(b);
+		}
+	}
+
+	// the rest come from one extent if the disk allows, placed after the blocks kept or else after the last
+	//  block of the cluster before, or from the head of the log, along with copies of the pointer blocks
+	//  above the cluster that a clone shares
+	int *reserved = NULL;
+	int nreserved = 0;
+	int next = 0;
+	if((nkeep < k || cow) && !logMode()){
+		int need = k - nkeep + blockOverhead(base, base + nslots - 1);
+		int prev = nkeep > 0 ? keep[nkeep-1] : 0;
+		for(j = base - 1; !prev && j >= 0 && j >= base - COMPRESS_CLUSTER; j--){
+			prev = blockNumber(fileLookup(f, &walk, inode, j));
+		}
+		int goal = prev > 0 && prev + 1 < MOUNT_STATE.super.nblocks ? prev + 1 : -1;
+		reserved = malloc(sizeof(int) * need);
+		nreserved = allocExtents(goal, need, reserved);
+	}
+
+	int blocks[COMPRESS_CLUSTER];
+	for(j = 0; j < k; j++){
+		blocks[j] = j < nkeep ? keep[j] : blockAssign(&walk, inumber, inode, base + j, reserved, &next, nreserved);
+		if(blocks[j] == 0) break;
+	}
+
+	if(j < k){
+		// put the cluster back the way it was
+		int m;
+		for(m = nkeep; m < j; m++){
+			if(logMode()) logRelease(blocks[m]); else bitmap_clear(FREE_BLOCK_BITMAP, blocks[m]);
+			blockSet(&walk, inumber, inode, base + m, ptrs[m]);
+		}
+		walkFlush(&walk);
+		while(next < nreserved){
+			bitmap_clear(FREE_BLOCK_BITMAP, reserved[next++]);
+		}
+		free(reserved);
+		disk_free(packing);
+		disk_free(buffer);
+		printf("ERROR: Disk full\n");
+		return 0;
+	}
+
+	for(j = 0; j < nslots; j++){
+		int ptr = j < k ? blocks[j] | BLOCK_COMPRESSED : 0;
+		if(j >= k && !ptrs[j]) continue;
+		int *entry = blockEntry(&walk, inumber, inode, base + j, reserved, &next, nreserved);
+		if(entry){
+			*entry = ptr;
+		}
+		if(f){
+			fileSet(f, base + j, ptr);
+		}
+	}
+	walkFlush(&walk);
+
+	while(next < nreserved){
+		bitmap_clear(FREE_BLOCK_BITMAP, reserved[next++]);
+	}
+	free(reserved);
+
+	// write the compressed cluster with one request, then let go of the blocks it no longer needs
+	struct disk_io io[COMPRESS_CLUSTER];
+	for(j = 0; j < k; j++){
+		io[j].blocknum = blocks[j];
+		io[j].data = packing + (size_t) j * DISK_BLOCK_SIZE;
+	}
+	disk_writev(io, k);
+	MOUNT_STATE.data_block_writes += k;
+
+	for(j = k; j < nkeep; j++){
+		blockRelease(keep[j]);
+	}
+	for(j = 0; j < ndrop; j++){
+		blockRelease(drop[j]);
+	}
+
+	// the cluster just written is the one held in memory from now on
+	disk_free(MOUNT_STATE.cluster);
+	MOUNT_STATE.cluster = buffer;
+	MOUNT_STATE.cluster_inumber = inumber;
+	MOUNT_STATE.cluster_index = index;
+
+	inode->isvalid |= INODE_PACKED;
+	inodeDirty(inumber);
+	MOUNT_STATE.compress_clusters++;
+	MOUNT_STATE.compress_saved += nvalid - k;
+	disk_free(packing);
+	return n;
+}
+
+// write to a file that is compressed, or has clusters stored compressed, a cluster at a time
+//  returns the number of bytes written, leaving the size and the inode for the caller to bring up to date
+static int clusterWrite( struct fs_file *f, int inumber, struct fs_inode *inode, const char *data, int length, int offset )
+{
+	int first = getLocation(offset);
+	int last = getLocation(offset + length - 1);
+	if(last >= maxBlocks()){
+		last = maxBlocks() - 1;
+	}
+	if(first > last){
+		printf("ERROR: File too large\n");
+		return 0;
+	}
+
+	// the file runs to size once the write is done
+	long long end = (long long) offset + length;
+	if(end > (long long) (last + 1) * DISK_BLOCK_SIZE) end = (long long) (last + 1) * DISK_BLOCK_SIZE;
+	long long size = end > inode->size ? end : inode->size;
+
+	int written = 0;
+	int c;
+	for(c = first / COMPRESS_CLUSTER; c <= last / COMPRESS_CLUSTER; c++){
+		long long lo = (long long) c * COMPRESS_CLUSTER * DISK_BLOCK_SIZE;
+		long long from = offset > lo ? offset : lo;
+		long long to = lo + COMPRESS_CLUSTER * DISK_BLOCK_SIZE < end ? lo + COMPRESS_CLUSTER * DISK_BLOCK_SIZE : end;
+
+		int n = clusterPut(f, inumber, inode, c, data + (from - offset), from - lo, to - from, size);
+		written += n;
+		if(n < to - from) break;
+	}
+	return written;
+}
+
+// write to an inode that has been checked, through its open file if there is one
+//  an open file keeps its map up to date and leaves the inode dirty for fs_close to write back
+static int fileWrite( struct fs_file *f, int inumber, struct fs_inode *inode, const char *data, int length, int offset )
+{
+	if(length <= 0 || offset < 0) return 0;
+	if(length > INT_MAX - offset) length = INT_MAX - offset;
+
+	//an inline file keeps its data in the inode for as long as it fits, the bytes past its size are always zero
+	if(inodeInline(inode)){
+		if(offset <= INLINE_BYTES && length <= INLINE_BYTES - offset){
+			memcpy(inode->data + offset, data, length);
+			if(offset + length > inode->size){
+				inode->size = offset + length;
+			}
+			inodeDirty(inumber);
+			if(!f){
+				inodeFlush();
+			}
+			fileChanged(inumber, f);
+			return length;
+		}
+		if(!inlinePromote(f, inumber, inode)){
+			printf("ERROR: Disk full\n");
+			return 0;
+		}
+	}
+
+	//a compressed file, or one with clusters still stored compressed, is written a cluster at a time
+	int written;
+	if(clusterNeeded(f, inode, offset, length)){
+		written = clusterWrite(f, inumber, inode, data, length, offset);
+	}
+	else{
+		written = blockWrite(f, inumber, inode, data, length, offset);
+	}
+
+	if(written > 0 && offset + written > inode->size){
+		inode->size = offset + written;
+	}
+	inodeDirty(inumber);
+	if(!f){
+		inodeFlush();
+	}
+	fileChanged(inumber, f);
+	return written;
+}
+
+// move the data of an inline file out to an ordinary data block so the file can grow past INLINE_BYTES
+//  returns one on success, or zero with the file left inline if the disk is full
+static int inlinePromote( struct fs_file *f, int inumber, struct fs_inode *inode )
+{
+	char data[INLINE_BYTES];
+	int size = inode->size;
+	memcpy(data, inode->data, INLINE_BYTES);
+
+	memset(inode->data, 0, INLINE_BYTES);
+	inode->isvalid &= ~INODE_INLINE;
+	inode->size = 0;
+	if(f){
+		f->nmap = 0;
+	}
+
+	// the data fits in direct block zero, so a failed write has allocated nothing
+	if(size > 0 && fileWrite(f, inumber, inode, data, size, 0) != size){
+		memcpy(inode->data, data, INLINE_BYTES);
+		inode->isvalid |= INODE_INLINE;
+		inode->size = size;
+		return 0;
+	}
+	return 1;
+}
+
+// blocks a write of length bytes to a file may take at the head of the log, a compressed file rewrites
+//  whole clusters
+static int writeRoom( struct fs_inode *inode, int length )
+{
+	int need = length / DISK_BLOCK_SIZE + 2;
+	if(inode && (inode->isvalid & (INODE_COMPRESSED | INODE_PACKED))){
+		need += 2 * COMPRESS_CLUSTER;
+	}
+	return need;
+}
+
+// write data to a valid inode, copy "length" bytes from the pointer "data" into the inode starting at "offset" bytes allocate
+//  any necessary direct and indirect blocks in the process, return the number of bytes actually written, the number of bytes
+//  actually written could be smaller than the number of bytes request, perhaps if the disk becomes full
+//  If the given inumber is invalid, or any other error is encountered, return 0
+int fs_write( int inumber, const char *data, int length, int offset )
+{
+	//if no fs mounted, fail
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		 return 0;
+	}
+
+	//check inode number is in valid range
+	struct fs_inode *inode = inodeLookup(inumber);
+	if (!inode){
+		printf("ERROR: Inode our of range\n");
+		return 0;
+	}
+
+	//make sure inumber is valid
+	if(!inode->isvalid){
+		printf("ERROR: Invalid inode\n");
+		return 0;
+	}
+
+	if(!logMakeRoom(writeRoom(inode, length))){
+		printf("ERROR: Disk full\n");
+		return 0;
+	}
+	int written = fileWrite(NULL, inumber, inode, data, length, offset);
+	journalOp();
+	return written;
+}
+
+// returns one if logical block index of a file has data on disk, or lies in a compressed cluster that does
+static int blockPresent( struct fs_walk *walk, struct fs_inode *inode, int index )
+{
+	if(blockNumber(blockLookup(walk, inode, index))) return 1;
+	return (inode->isvalid & INODE_PACKED) && clusterCompressed(blockLookup(walk, inode, index - index % COMPRESS_CLUSTER));
+}
+
+// reserve disk blocks for length bytes of an inode from offset without writing them, and grow the file to
+//  cover them, the blocks read back as zeros until they are first written and blocks already there are kept
+//  return one on success, zero on failure
+int fs_fallocate( int inumber, int offset, int length )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(!inode || !inode->isvalid){
+		printf("ERROR: Invalid inode\n");
+		return 0;
+	}
+
+	// legacy readers would take a reserved block for one holding data
+	if(MOUNT_STATE.super.inodesize == 0){
+		printf("ERROR: fallocate needs a disk formatted with %d byte inodes\n", (int) sizeof(struct fs_inode));
+		return 0;
+	}
+
+	if(offset < 0 || length <= 0 || length > INT_MAX - offset){
+		printf("ERROR: Invalid range\n");
+		return 0;
+	}
+
+	int first = getLocation(offset);
+	int last = getLocation(offset + length - 1);
+	if(last >= maxBlocks()){
+		printf("ERROR: File too large\n");
+		return 0;
+	}
+
+	// reserved blocks only make sense for a file kept in blocks
+	if(!logMakeRoom(last - first + 2)){
+		printf("ERROR: Disk full\n");
+		return 0;
+	}
+	if(inodeInline(inode) && !inlinePromote(NULL, inumber, inode)){
+		printf("ERROR: Disk full\n");
+		return 0;
+	}
+
+	struct fs_walk walk;
+	walkInit(&walk);
+
+	// find the holes in the range, and reserve blocks for them and their pointer blocks in one go
+	int missing = 0;
+	int first_missing = -1;
+	int i;
+	for(i = first; i <= last; i++){
+		if(blockPresent(&walk, inode, i)) continue;
+		missing++;
+		if(first_missing < 0) first_missing = i;
+	}
+
+	int ok = 1;
+	if(missing > 0){
+		// a log-structured disk hands out blocks from the head of the log as they are needed
+		int *reserved = NULL;
+		int nreserved = 0;
+		int next = 0;
+		if(!logMode()){
+			int need = missing + blockOverhead(first_missing, last);
+			int goal = -1;
+			if(first_missing > 0){
+				int prev = blockNumber(blockLookup(&walk, inode, first_missing - 1));
+				if(prev > 0 && prev + 1 < MOUNT_STATE.super.nblocks) goal = prev + 1;
+			}
+			reserved = malloc(sizeof(int) * need);
+			nreserved = allocExtents(goal, need, reserved);
+		}
+
+		// the holes filled so far, and the pointer trees the file had, so a failure part way leaves the file
+		//  as it was
+		int *assigned = malloc(sizeof(int) * missing);
+		int nassigned = 0;
+		int roots[MAX_DEPTH + 1];
+		int depth;
+		for(depth = 1; depth <= maxDepth(); depth++){
+			roots[depth] = *blockRoot(inode, depth);
+		}
+		for(i = first_missing; i <= last; i++){
+			if(blockPresent(&walk, inode, i)) continue;
+
+			int blocknum = blockAssign(&walk, inumber, inode, i, reserved, &next, nreserved);
+			if(blocknum == 0){
+				printf("ERROR: Disk full\n");
+				ok = 0;
+				break;
+			}
+			blockSet(&walk, inumber, inode, i, blocknum | BLOCK_UNWRITTEN);
+			assigned[nassigned++] = i;
+		}
+		while(!ok && nassigned > 0){
+			i = assigned[--nassigned];
+			int blocknum = blockNumber(blockLookup(&walk, inode, i));
+			if(!blockSet(&walk, inumber, inode, i, 0)) break;
+			blockRelease(blocknum);
+		}
+		free(assigned);
+		walkFlush(&walk);
+
+		for(depth = 1; depth <= maxDepth() && !ok; depth++){
+			if(roots[depth] == 0 && *blockRoot(inode, depth) != 0){
+				blockFreeTree(*blockRoot(inode, depth), depth);
+				*blockRoot(inode, depth) = 0;
+			}
+		}
+
+		while(next < nreserved){
+			bitmap_clear(FREE_BLOCK_BITMAP, reserved[next++]);
+		}
+		free(reserved);
+	}
+
+	if(ok && offset + length > inode->size){
+		inode->size = offset + length;
+	}
+	inodeDirty(inumber);
+	inodeFlush();
+	fileChanged(inumber, NULL);
+	journalOp();
+	return ok;
+}
+
+// choose whether what is written to an inode from now on is compressed, clusters already written stay as they
+//  are until they are next written, return one on success
+int fs_compress( int inumber, int on )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(!inode || !inode->isvalid){
+		printf("ERROR: Invalid inode\n");
+		return 0;
+	}
+
+	// legacy readers would take compressed data for the file itself
+	if(MOUNT_STATE.super.inodesize == 0){
+		printf("ERROR: compression needs a disk formatted with %d byte inodes\n", (int) sizeof(struct fs_inode));
+		return 0;
+	}
+
+	if(on){
+		inode->isvalid |= INODE_COMPRESSED;
+	}
+	else{
+		inode->isvalid &= ~INODE_COMPRESSED;
+	}
+	inodeDirty(inumber);
+	inodeFlush();
+	journalOp();
+	return 1;
+}
+
+// choose whether blocks written to an inode from now on are shared with blocks on disk holding the same data,
+//  what is already written stays as it is, return one on success
+int fs_dedup( int inumber, int on )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(!inode || !inode->isvalid){
+		printf("ERROR: Invalid inode\n");
+		return 0;
+	}
+
+	// shared blocks are only safe where their references are counted
+	if(!MOUNT_STATE.refs){
+		printf("ERROR: dedup needs a disk formatted with a block reference table\n");
+		return 0;
+	}
+
+	if(on){
+		inode->isvalid |= INODE_DEDUP;
+	}
+	else{
+		inode->isvalid &= ~INODE_DEDUP;
+	}
+	inodeDirty(inumber);
+	inodeFlush();
+	journalOp();
+	return 1;
+}
+
+// open an inode for repeated reads and writes, decoding its block map once
+//  return the handle, or NULL if nothing is mounted or the inode is invalid
+struct fs_file *fs_open( int inumber )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return NULL;
+	}
+
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(!inode || !inode->isvalid){
+		printf("ERROR: Invalid inode\n");
+		return NULL;
+	}
+
+	struct fs_file *f = calloc(1, sizeof(struct fs_file));
+	f->inumber = inumber;
+	fileLoad(f, inode);
+
+	f->next = OPEN_FILES;
+	if(OPEN_FILES) OPEN_FILES->prev = f;
+	OPEN_FILES = f;
+
+	return f;
+}
+
+// fs_read through an open file, logical blocks are found by indexing its map
+int fs_read_h( struct fs_file *f, char *data, int length, int offset )
+{
+	struct fs_inode *inode = fileInode(f);
+	if(!inode) return 0;
+
+	return fileRead(f, f->inumber, inode, data, length, offset);
+}
+
+// fs_write through an open file, the inode is written back by fs_close
+int fs_write_h( struct fs_file *f, const char *data, int length, int offset )
+{
+	if(MOUNTED_FLAG == 1 && !logMakeRoom(writeRoom(inodeLookup(f->inumber), length))){
+		printf("ERROR: Disk full\n");
+		return 0;
+	}
+	struct fs_inode *inode = fileInode(f);
+	if(!inode) return 0;
+
+	int written = fileWrite(f, f->inumber, inode, data, length, offset);
+	journalOp();
+	return written;
+}
+
+// write back whatever an open file changed and release it, return one on success
+int fs_close( struct fs_file *f )
+{
+	if(!f) return 0;
+
+	if(MOUNTED_FLAG == 1){
+		inodeFlush();
+		journalOp();
+	}
+
+	if(f->prev) f->prev->next = f->next; else OPEN_FILES = f->next;
+	if(f->next) f->next->prev = f->prev;
+
+	free(f->map);
+	free(f);
+	return 1;
+}
+
+// read block index of a directory, what lies past its end, or in a hole, reads as zeros
+static void dirRead( int inumber, struct fs_inode *inode, int index, union fs_block *block )
+{
+	int n = fileRead(NULL, inumber, inode, block->data, DISK_BLOCK_SIZE, index * DISK_BLOCK_SIZE);
+	if(n < 0) n = 0;
+	memset(block->data + n, 0, DISK_BLOCK_SIZE - n);
+}
+
+// write block index of a directory, returns zero if the disk is full
+static int dirWrite( int inumber, struct fs_inode *inode, int index, const union fs_block *block )
+{
+	return fileWrite(NULL, inumber, inode, block->data, DISK_BLOCK_SIZE, index * DISK_BLOCK_SIZE) == DISK_BLOCK_SIZE;
+}
+
+// hash of a name, FNV-1a with a final mix so the low bits the table is indexed by depend on every byte
+static uint32_t dirHash( const char *name, int len )
+{
+	uint32_t h = 2166136261u;
+	int i;
+	for(i = 0; i < len; i++){
+		h ^= (unsigned char) name[i];
+		h *= 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return h;
+}
+
+// the block of a directory table being worked on, written back once another one is needed
+struct fs_dirtable {
+	int index;			// block of the directory held, zero for none
+	int dirty;
+	union fs_block block;
+};
+
+static int dirTableFlush( int inumber, struct fs_inode *inode, struct fs_dirtable *t )
+{
+	if(!t->dirty) return 1;
+	t->dirty = 0;
+	return dirWrite(inumber, inode, t->index, &t->block);
+}
+
+// the table entry for slot, with the block holding it read in, returns NULL if the block before could not be
+//  written back
+static int *dirTableSlot( int inumber, struct fs_inode *inode, struct fs_dirtable *t, int slot )
+{
+	int index = DIR_TABLE + slot / DIR_SLOTS;
+	if(t->index != index){
+		if(!dirTableFlush(inumber, inode, t)) return NULL;
+		dirRead(inumber, inode, index, &t->block);
+		t->index = index;
+	}
+	return &t->block.pointers[slot % DIR_SLOTS];
+}
+
+// the entry at byte off of a bucket, its inumber, hash and name length
+static int direntInumber( const union fs_block *bucket, int off )
+{
+	int inumber;
+	memcpy(&inumber, bucket->data + sizeof(struct fs_dirbucket) + off, sizeof(int));
+	return inumber;
+}
+
+static uint32_t direntHash( const union fs_block *bucket, int off )
+{
+	uint32_t hash;
+	memcpy(&hash, bucket->data + sizeof(struct fs_dirbucket) + off + 4, sizeof(uint32_t));
+	return hash;
+}
+
+static int direntLength( const union fs_block *bucket, int off )
+{
+	return (unsigned char) bucket->data[sizeof(struct fs_dirbucket) + off + 8];
+}
+
+static const char *direntName( const union fs_block *bucket, int off )
+{
+	return bucket->data + sizeof(struct fs_dirbucket) + off + DIRENT_HEAD;
+}
+
+// append an entry to a bucket, the caller has made sure it fits
+static void direntPut( union fs_block *bucket, int inumber, uint32_t hash, const char *name, int len )
+{
+	char *e = bucket->data + sizeof(struct fs_dirbucket) + bucket->bucket.used;
+	memcpy(e, &inumber, sizeof(int));
+	memcpy(e + 4, &hash, sizeof(uint32_t));
+	e[8] = len;
+	memcpy(e + DIRENT_HEAD, name, len);
+	bucket->bucket.count++;
+	bucket->bucket.used += DIRENT_HEAD + len;
+}
+
+// byte offset in a bucket of the entry for name, or -1 if it has none
+static int direntFind( const union fs_block *bucket, uint32_t hash, const char *name, int len )
+{
+	int off;
+	for(off = 0; off < bucket->bucket.used; off += DIRENT_HEAD + direntLength(bucket, off)){
+		if(direntHash(bucket, off) == hash && direntLength(bucket, off) == len && !memcmp(direntName(bucket, off), name, len)){
+			return off;
+		}
+	}
+	return -1;
+}
+
+// the bucket of a directory that name hashes to, read into bucket, returns its block in the directory
+static int dirBucket( int inumber, struct fs_inode *inode, uint32_t hash, union fs_block *bucket )
+{
+	dirRead(inumber, inode, 0, bucket);
+	int slot = hash & ((1u << bucket->dirhead.depth) - 1);
+	dirRead(inumber, inode, DIR_TABLE + slot / DIR_SLOTS, bucket);
+	int b = bucket->pointers[slot % DIR_SLOTS];
+	dirRead(inumber, inode, b, bucket);
+	MOUNT_STATE.dir_reads += 3;
+	return b;
+}
+
+// find name in a directory, returns the inumber it names, or zero if there is no such entry
+//  "." and ".." name the directory itself and the one holding it
+static int dirFind( int inumber, struct fs_inode *inode, const char *name )
+{
+	int len = strlen(name);
+	union fs_block block;
+
+	if(len == 0 || !strcmp(name, ".")) return inumber;
+	if(!strcmp(name, "..")){
+		dirRead(inumber, inode, 0, &block);
+		return block.dirhead.parent;
+	}
+
+	uint32_t hash = dirHash(name, len);
+	dirBucket(inumber, inode, hash, &block);
+	MOUNT_STATE.dir_lookups++;
+
+	int off = direntFind(&block, hash, name, len);
+	return off < 0 ? 0 : direntInumber(&block, off);
+}
+
+// double the table of a directory whose header is in head, the new half is a copy of the old one, since
+//  slot i and slot i plus the old size agree in every bit the buckets have in use so far
+static int dirDouble( int inumber, struct fs_inode *inode, struct fs_dirtable *t, union fs_block *head )
+{
+	int n = 1 << head->dirhead.depth;
+	if(!dirTableFlush(inumber, inode, t)) return 0;
+	t->index = 0;
+
+	union fs_block block;
+	if(2 * n <= DIR_SLOTS){
+		dirRead(inumber, inode, DIR_TABLE, &block);
+		memcpy(&block.pointers[n], &block.pointers[0], sizeof(int) * n);
+		if(!dirWrite(inumber, inode, DIR_TABLE, &block)) return 0;
+	}
+	else{
+		int i;
+		for(i = 0; i < n / DIR_SLOTS; i++){
+			dirRead(inumber, inode, DIR_TABLE + i, &block);
+			if(!dirWrite(inumber, inode, DIR_TABLE + n / DIR_SLOTS + i, &block)) return 0;
+		}
+	}
+
+	head->dirhead.depth++;
+	MOUNT_STATE.dir_doublings++;
+	return 1;
+}
+
+// split bucket b of a directory, which is full, moving the entries with the next bit of the hash set to a new
+//  bucket and pointing the slots of the table with that bit set at it
+static int dirSplit( int inumber, struct fs_inode *inode, struct fs_dirtable *t, union fs_block *head, int b, union fs_block *bucket )
+{
+	int depth = bucket->bucket.depth;
+	if(depth == head->dirhead.depth && !dirDouble(inumber, inode, t, head)) return 0;
+
+	uint32_t bit = 1u << depth;
+	uint32_t low = 0;
+	union fs_block old = *bucket;
+	union fs_block fresh;
+	memset(fresh.data, 0, DISK_BLOCK_SIZE);
+	memset(bucket->data, 0, DISK_BLOCK_SIZE);
+	bucket->bucket.depth = depth + 1;
+	fresh.bucket.depth = depth + 1;
+
+	int off;
+	for(off = 0; off < old.bucket.used; off += DIRENT_HEAD + direntLength(&old, off)){
+		uint32_t hash = direntHash(&old, off);
+		low = hash & (bit - 1);
+		direntPut(hash & bit ? &fresh : bucket, direntInumber(&old, off), hash, direntName(&old, off), direntLength(&old, off));
+	}
+
+	int nb = DIR_BUCKETS + head->dirhead.nbuckets;
+	if(!dirWrite(inumber, inode, nb, &fresh) || !dirWrite(inumber, inode, b, bucket)) return 0;
+	head->dirhead.nbuckets++;
+
+	// the slots pointing at the bucket are those that agree with its entries in the low depth bits
+	int j;
+	for(j = 0; j < 1 << (head->dirhead.depth - depth - 1); j++){
+		int *slot = dirTableSlot(inumber, inode, t, low | bit | (j << (depth + 1)));
+		if(!slot) return 0;
+		*slot = nb;
+		t->dirty = 1;
+	}
+
+	MOUNT_STATE.dir_splits++;
+	return 1;
+}
+
+// add an entry naming inumber to a directory, splitting the bucket it falls in until there is room, returns
+//  one on success, zero if the disk is full or too many names share the same hash
+static int dirInsert( int dir, struct fs_inode *inode, const char *name, int inumber )
+{
+	int len = strlen(name);
+	uint32_t hash = dirHash(name, len);
+
+	union fs_block head;
+	dirRead(dir, inode, 0, &head);
+	struct fs_dirtable t;
+	t.index = 0;
+	t.dirty = 0;
+
+	union fs_block bucket;
+	while(1){
+		int *slot = dirTableSlot(dir, inode, &t, hash & ((1u << head.dirhead.depth) - 1));
+		if(!slot) return 0;
+		int b = *slot;
+		dirRead(dir, inode, b, &bucket);
+
+		if(sizeof(struct fs_dirbucket) + bucket.bucket.used + DIRENT_HEAD + len <= DISK_BLOCK_SIZE){
+			direntPut(&bucket, inumber, hash, name, len);
+			break;
+		}
+		if(bucket.bucket.depth == DIR_MAX_DEPTH){
+			printf("ERROR: directory bucket full\n");
+			return 0;
+		}
+		if(!dirSplit(dir, inode, &t, &head, b, &bucket)) return 0;
+	}
+
+	head.dirhead.nentries++;
+	return dirWrite(dir, inode, *dirTableSlot(dir, inode, &t, hash & ((1u << head.dirhead.depth) - 1)), &bucket) && dirTableFlush(dir, inode, &t) && dirWrite(dir, inode, 0, &head);
+}
+
+// take the entry for name out of a directory, returns the inumber it named, or zero if there was none
+//  buckets are not merged again as they empty, the directory keeps the size it grew to
+static int dirRemove( int dir, struct fs_inode *inode, const char *name )
+{
+	int len = strlen(name);
+	uint32_t hash = dirHash(name, len);
+
+	union fs_block bucket;
+	int b = dirBucket(dir, inode, hash, &bucket);
+	int off = direntFind(&bucket, hash, name, len);
+	if(off < 0) return 0;
+
+	int inumber = direntInumber(&bucket, off);
+	int size = DIRENT_HEAD + len;
+	char *e = bucket.data + sizeof(struct fs_dirbucket) + off;
+	memmove(e, e + size, bucket.bucket.used - off - size);
+	memset(bucket.data + sizeof(struct fs_dirbucket) + bucket.bucket.used - size, 0, size);
+	bucket.bucket.count--;
+	bucket.bucket.used -= size;
+	if(!dirWrite(dir, inode, b, &bucket)) return 0;
+
+	union fs_block head;
+	dirRead(dir, inode, 0, &head);
+	head.dirhead.nentries--;
+	if(!dirWrite(dir, inode, 0, &head)) return 0;
+	return inumber;
+}
+
+// make an empty directory held by parent, or the root directory when parent is zero, returns its inumber, or
+//  zero if the inode table or the disk is full
+static int dirCreate( int parent )
+{
+	int inumber = inodeAlloc();
+	if(inumber == 0){
+		printf("ERROR: inode table full\n");
+		return 0;
+	}
+
+	struct fs_inode *inode = &MOUNT_STATE.inodes[inumber-1];
+	memset(inode, 0, sizeof(struct fs_inode));
+	inode->isvalid = INODE_VALID | INODE_DIR;
+	inodeDirty(inumber);
+
+	// one bucket, which the single slot of the table points at, the bucket goes first so the blocks of the
+	//  table between them are left as a hole
+	union fs_block block;
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	int ok = dirWrite(inumber, inode, DIR_BUCKETS, &block);
+
+	block.pointers[0] = DIR_BUCKETS;
+	ok = ok && dirWrite(inumber, inode, DIR_TABLE, &block);
+
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	block.dirhead.magic = DIR_MAGIC;
+	block.dirhead.depth = 0;
+	block.dirhead.nbuckets = 1;
+	block.dirhead.nentries = 0;
+	block.dirhead.parent = parent ? parent : inumber;
+	ok = ok && dirWrite(inumber, inode, 0, &block);
+
+	if(!ok){
+		inodeDelete(inumber, inode);
+		return 0;
+	}
+	return inumber;
+}
+
+// returns one if inumber is a directory, reading the magic number of its header to be sure
+static int dirValid( int inumber, int parent )
+{
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(!inode || !(inode->isvalid & INODE_DIR)) return 0;
+
+	union fs_block head;
+	dirRead(inumber, inode, 0, &head);
+	return head.dirhead.magic == DIR_MAGIC && (!parent || head.dirhead.parent == parent);
+}
+
+// the root directory, made the first time a path is used, and checked to still be one the first time after a
+//  mount, since the superblock does not go through the journal with the inode
+static int dirRoot()
+{
+	int root = MOUNT_STATE.super.rootdir;
+	if(root > 0 && root <= MOUNT_STATE.super.ninodes){
+		if(MOUNT_STATE.rootdir == root || dirValid(root, root)){
+			MOUNT_STATE.rootdir = root;
+			return root;
+		}
+	}
+
+	root = dirCreate(0);
+	if(root == 0) return 0;
+	MOUNT_STATE.super.rootdir = root;
+	MOUNT_STATE.rootdir = root;
+	inodeFlush();
+	superSave();
+	return root;
+}
+
+// follow an absolute path from the root directory down to the directory holding its last component, which is
+//  copied into name, empty for the root directory itself, returns the inumber of that directory, or zero if the
+//  path runs through something that is not a directory or has a name that is too long
+static int pathParent( const char *path, char *name )
+{
+	if(MOUNT_STATE.super.inodesize == 0){
+		printf("ERROR: directories need a disk formatted with %d byte inodes\n", (int) sizeof(struct fs_inode));
+		return 0;
+	}
+	if(!path || path[0] != '/'){
+		printf("ERROR: %s is not an absolute path\n", path ? path : "(null)");
+		return 0;
+	}
+
+	int dir = dirRoot();
+	if(dir == 0) return 0;
+
+	const char *p = path;
+	while(*p == '/') p++;
+	while(1){
+		const char *end = strchr(p, '/');
+		if(!end) end = p + strlen(p);
+		if(end - p > FS_NAME_MAX){
+			printf("ERROR: name too long in %s\n", path);
+			return 0;
+		}
+		memcpy(name, p, end - p);
+		name[end - p] = 0;
+
+		p = end;
+		while(*p == '/') p++;
+		if(!*p) return dir;
+
+		int next = dirFind(dir, inodeLookup(dir), name);
+		if(next == 0){
+			printf("ERROR: %s not found in %s\n", name, path);
+			return 0;
+		}
+		struct fs_inode *inode = inodeLookup(next);
+		if(!inode || !(inode->isvalid & INODE_DIR)){
+			printf("ERROR: %s in %s is not a directory\n", name, path);
+			return 0;
+		}
+		dir = next;
+	}
+}
+
+// returns one if name may be given to a new entry
+static int nameValid( const char *name )
+{
+	if(name[0] == 0 || !strcmp(name, ".") || !strcmp(name, "..")){
+		printf("ERROR: invalid name '%s'\n", name);
+		return 0;
+	}
+	return 1;
+}
+
+// the inumber an absolute path names, or zero if there is nothing there
+int fs_lookup( const char *path )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	char name[FS_NAME_MAX + 1];
+	logMakeRoom(0);
+	int dir = pathParent(path, name);
+	if(dir == 0) return 0;
+	return dirFind(dir, inodeLookup(dir), name);
+}
+
+// make a directory at an absolute path, returns its inumber, or zero on failure
+int fs_mkdir( const char *path )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	// a split may double the table as well as writing two buckets and the header
+	char name[FS_NAME_MAX + 1];
+	if(!logMakeRoom(DIR_BUCKETS + 4)){
+		printf("ERROR: Disk full\n");
+		return 0;
+	}
+	int parent = pathParent(path, name);
+	if(parent == 0 || !nameValid(name)) return 0;
+
+	struct fs_inode *dir = inodeLookup(parent);
+	if(dirFind(parent, dir, name)){
+		printf("ERROR: %s already exists\n", path);
+		return 0;
+	}
+
+	int inumber = dirCreate(parent);
+	if(inumber == 0) return 0;
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(!dirInsert(parent, dir, name, inumber)){
+		inodeDelete(inumber, inode);
+		journalOp();
+		return 0;
+	}
+
+	inode->isvalid += INODE_LINK;
+	inodeDirty(inumber);
+	inodeFlush();
+	journalOp();
+	return inumber;
+}
+
+// give inode inumber another name, an absolute path in an existing directory, returns one on success
+int fs_link( const char *path, int inumber )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(!inode || !inode->isvalid){
+		printf("ERROR: Invalid inode\n");
+		return 0;
+	}
+
+	// a directory has the one name that fs_mkdir gave it, so the tree stays a tree
+	if(inode->isvalid & INODE_DIR){
+		printf("ERROR: inode %d is a directory\n", inumber);
+		return 0;
+	}
+	if((inode->isvalid & INODE_LINKS) == INODE_LINKS){
+		printf("ERROR: inode %d has too many names\n", inumber);
+		return 0;
+	}
+
+	char name[FS_NAME_MAX + 1];
+	if(!logMakeRoom(DIR_BUCKETS + 4)){
+		printf("ERROR: Disk full\n");
+		return 0;
+	}
+	int parent = pathParent(path, name);
+	if(parent == 0 || !nameValid(name)) return 0;
+
+	struct fs_inode *dir = inodeLookup(parent);
+	if(dirFind(parent, dir, name)){
+		printf("ERROR: %s already exists\n", path);
+		return 0;
+	}
+	if(!dirInsert(parent, dir, name, inumber)){
+		journalOp();
+		return 0;
+	}
+
+	inode->isvalid += INODE_LINK;
+	inodeDirty(inumber);
+	inodeFlush();
+	journalOp();
+	return 1;
+}
+
+// take away the name an absolute path gives an inode, which is deleted along with its last name, a directory
+//  has to be empty first, returns one on success
+int fs_unlink( const char *path )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	char name[FS_NAME_MAX + 1];
+	logMakeRoom(2);
+	int parent = pathParent(path, name);
+	if(parent == 0 || !nameValid(name)) return 0;
+
+	struct fs_inode *dir = inodeLookup(parent);
+	int inumber = dirFind(parent, dir, name);
+	if(inumber == 0){
+		printf("ERROR: %s not found\n", path);
+		return 0;
+	}
+
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(inode->isvalid & INODE_DIR){
+		union fs_block head;
+		dirRead(inumber, inode, 0, &head);
+		if(head.dirhead.nentries > 0){
+			printf("ERROR: directory %s is not empty\n", path);
+			return 0;
+		}
+	}
+
+	if(!dirRemove(parent, dir, name)){
+		journalOp();
+		return 0;
+	}
+
+	inode->isvalid -= INODE_LINK;
+	if(inode->isvalid & INODE_LINKS){
+		inodeDirty(inumber);
+		inodeFlush();
+	}
+	else{
+		inodeDelete(inumber, inode);
+	}
+	journalOp();
+	return 1;
+}
+
+// read the directory entries of inode inumber one at a time, cookie starts out zero and is moved on past each
+//  entry, whose name and inumber are stored, name having room for FS_NAME_MAX bytes and a terminating zero
+//  returns one for an entry, zero once there are no more or on failure
+int fs_readdir( int inumber, int *cookie, char *name, int *entry )
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return 0;
+	}
+
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(!inode || !(inode->isvalid & INODE_DIR)){
+		printf("ERROR: inode %d is not a directory\n", inumber);
+		return 0;
+	}
+
+	// the cookie is the bucket and the byte offset in it of the next entry
+	union fs_block block;
+	dirRead(inumber, inode, 0, &block);
+	int nbuckets = block.dirhead.nbuckets;
+
+	int b = *cookie / DISK_BLOCK_SIZE;
+	int off = *cookie % DISK_BLOCK_SIZE;
+	for(; b < nbuckets; b++, off = 0){
+		dirRead(inumber, inode, DIR_BUCKETS + b, &block);
+		if(off >= block.bucket.used) continue;
+
+		int len = direntLength(&block, off);
+		memcpy(name, direntName(&block, off), len);
+		name[len] = 0;
+		*entry = direntInumber(&block, off);
+		*cookie = b * DISK_BLOCK_SIZE + off + DIRENT_HEAD + len;
+		return 1;
+	}
+	*cookie = nbuckets * DISK_BLOCK_SIZE;
+	return 0;
+}
+
+// returns one if the geometry in a superblock fits the disk, so that nothing found through it lies outside
+static int superValid( const struct fs_superblock *super )
+{
+	if(super->magic != FS_MAGIC){
+		printf("ERROR: invalid magic number on super block: %x\n", super->magic);
+		return 0;
+	}
+
+	if(super->inodesize != 0 && super->inodesize != sizeof(struct fs_inode)){
+		printf("ERROR: unsupported inode size %d\n", super->inodesize);
+		return 0;
+	}
+
+	int regions = super->ninodeblocks >= 0 && super->bitmapstart >= 0 && super->nbitmapblocks >= 0 && super->journalstart >= 0
+		&& super->njournalblocks >= 0 && super->segstart >= 0 && super->segblocks >= 0 && super->nsegments >= 0
+		&& super->ckptstart >= 0 && super->nckptblocks >= 0 && super->refstart >= 0 && super->nrefblocks >= 0;
+	if(super->nblocks <= 0 || super->nblocks > disk_size() || !regions || super->ninodes != super->ninodeblocks * inodesPerBlock(super)
+		|| dataStart((struct fs_superblock *) super) > super->nblocks
+		|| (long long) super->segstart + (long long) super->nsegments * super->segblocks > super->nblocks){
+		printf("ERROR: super block does not fit a disk of %d blocks\n", disk_size());
+		return 0;
+	}
+	return 1;
+}
+
+static const char *fsckKinds[FSCK_KINDS] = {
+	"bad inodes",
+	"bad pointers",
+	"bad sizes",
+	"blocks claimed more often than they are shared",
+	"leaked blocks",
+	"blocks in use marked free",
+	"reference counts too high",
+	"damaged directory entries",
+	"wrong link counts",
+};
+
+// print a problem of the given kind if it is among the first of its kind, and count it
+static void fsckReport( struct fs_fsck *c, int kind, const char *format, ... )
+{
+	pthread_mutex_lock(&c->lock);
+	if(c->problems[kind]++ < FSCK_REPORT){
+		va_list args;
+		va_start(args, format);
+		printf("    ");
+		vprintf(format, args);
+		printf("\n");
+		va_end(args);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void fsckRepaired( struct fs_fsck *c, int kind )
+{
+	__atomic_fetch_add(&c->repaired[kind], 1, __ATOMIC_RELAXED);
+}
+
+// mark the inode block holding inumber as changed
+static void fsckDirty( struct fs_fsck *c, int inumber )
+{
+	c->dirty[(inumber-1) / c->per_block] = 1;
+}
+
+// room for one more item of the given size at the end of a list
+static void *fsckPush( struct fs_fsck_list *l, size_t size )
+{
+	if(l->n == l->capacity){
+		l->capacity = l->capacity ? l->capacity * 2 : 256;
+		l->items = realloc(l->items, l->capacity * size);
+	}
+	return l->items + (size_t) l->n++ * size;
+}
+
+// returns one if ptr may point at a block of the given height, flags only being allowed on the pointers to data
+static int fsckValid( struct fs_fsck *c, int ptr, int height )
+{
+	int blocknum = ptr & ~BLOCK_FLAGS;
+	if(ptr < 0 || (height > 0 && blocknum != ptr)) return 0;
+	return blocknum >= c->start && blocknum < c->end;
+}
+
+// claim a block for inode inumber, zero for metadata, in the ownership map, returns one for the first claim on it
+//  a later claim is counted and kept along with where it was found
+static int fsckClaim( struct fs_fsck_worker *w, int blocknum, int inumber, int height, int parent, int slot )
+{
+	struct fs_fsck *c = w->c;
+	uint64_t bit = (uint64_t) 1 << (blocknum % 64);
+	uint64_t old = __atomic_fetch_or(&c->used->words[blocknum / 64], bit, __ATOMIC_RELAXED);
+	if(!(old & bit)){
+		c->owner[blocknum] = inumber;
+		return 1;
+	}
+
+	__atomic_fetch_add(&c->extra[blocknum], 1, __ATOMIC_RELAXED);
+	struct fs_fsck_claim *claim = fsckPush(&w->claims, sizeof(struct fs_fsck_claim));
+	claim->blocknum = blocknum;
+	claim->inumber = inumber;
+	claim->height = height;
+	claim->parent = parent;
+	claim->slot = slot;
+	return 0;
+}
+
+// note that inode inumber maps logical block index to a data block
+static void fsckMapped( struct fs_fsck_worker *w, int inumber, long long index, int blocknum )
+{
+	struct fs_fsck *c = w->c;
+	int *last = &c->last[inumber-1];
+	int old = __atomic_load_n(last, __ATOMIC_RELAXED);
+	while(old < index + 1 && !__atomic_compare_exchange_n(last, &old, (int) index + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if(c->inodes[inumber-1].isvalid & INODE_DIR){
+		struct fs_fsck_dirblock *d = fsckPush(&w->dirblocks, sizeof(struct fs_fsck_dirblock));
+		d->inumber = inumber;
+		d->index = index;
+		d->blocknum = blocknum;
+	}
+}
+
+// check an inode just read in, claim its direct blocks and the roots of its trees, which are looked at later
+static void fsckInode( struct fs_fsck_worker *w, int inumber )
+{
+	struct fs_fsck *c = w->c;
+	struct fs_inode *inode = &c->inodes[inumber-1];
+	if(!inode->isvalid) return;
+
+	// an inode that is not valid but is not zero either is cleared, one with flags from nowhere loses them
+	int flags = inode->isvalid & ~INODE_LINKS;
+	if(!(flags & INODE_VALID) || (flags & ~INODE_FLAGS)){
+		fsckReport(c, FSCK_INODE, "inode %d: flags %x", inumber, flags);
+		if(c->repair){
+			if(flags & INODE_VALID){
+				inode->isvalid &= INODE_FLAGS | INODE_LINKS;
+			}
+			else{
+				memset(inode, 0, sizeof(struct fs_inode));
+			}
+			fsckDirty(c, inumber);
+			fsckRepaired(c, FSCK_INODE);
+		}
+		if(!(flags & INODE_VALID)) return;
+	}
+
+	if(inodeInline(inode)){
+		if(inode->size < 0 || inode->size > INLINE_BYTES){
+			fsckReport(c, FSCK_SIZE, "inode %d: size %d bytes kept in the inode", inumber, inode->size);
+			if(c->repair){
+				inode->size = inode->size < 0 ? 0 : INLINE_BYTES;
+				fsckDirty(c, inumber);
+				fsckRepaired(c, FSCK_SIZE);
+			}
+		}
+		return;
+	}
+
+	int k;
+	for(k = 0; k < POINTERS_PER_INODE; k++){
+		int ptr = inode->direct[k];
+		if(ptr == 0) continue;
+
+		if(!fsckValid(c, ptr, 0)){
+			fsckReport(c, FSCK_POINTER, "inode %d: direct pointer %d is %d", inumber, k, ptr);
+			if(c->repair){
+				inode->direct[k] = 0;
+				fsckDirty(c, inumber);
+				fsckRepaired(c, FSCK_POINTER);
+			}
+			continue;
+		}
+		fsckClaim(w, ptr & ~BLOCK_FLAGS, inumber, 0, 0, k);
+		fsckMapped(w, inumber, k, ptr & ~BLOCK_FLAGS);
+	}
+
+	long long base = POINTERS_PER_INODE;
+	long long span = POINTERS_PER_BLOCK;
+	int depth;
+	for(depth = 1; depth <= MAX_DEPTH; depth++, base += span, span *= POINTERS_PER_BLOCK){
+		int *root = blockRoot(inode, depth);
+		if(*root == 0) continue;
+
+		if(!fsckValid(c, *root, depth) || base >= FSCK_MAX_INDEX){
+			fsckReport(c, FSCK_POINTER, "inode %d: depth %d tree starts at %d", inumber, depth, *root);
+			if(c->repair){
+				*root = 0;
+				fsckDirty(c, inumber);
+				fsckRepaired(c, FSCK_POINTER);
+			}
+			continue;
+		}
+		if(fsckClaim(w, *root, inumber, depth, 0, POINTERS_PER_INODE + depth - 1)){
+			struct fs_fsck_block *b = fsckPush(&w->found[depth-1], sizeof(struct fs_fsck_block));
+			b->blocknum = *root;
+			b->inumber = inumber;
+			b->height = depth;
+			b->dirty = 0;
+			b->base = base;
+		}
+	}
+}
+
+// unpack and check the inode blocks of the batch, the blocks a log-structured disk never wrote are all zeros
+static void fsckInodes( struct fs_fsck_worker *w, int first, int last )
+{
+	struct fs_fsck *c = w->c;
+	int i;
+	for(i = first; i < last; i++){
+		int k = c->first + i;
+		inodeDecode(&c->super, (union fs_block *) (c->buffer + (size_t) i * DISK_BLOCK_SIZE), &c->inodes[k * c->per_block]);
+
+		int j;
+		for(j = 0; j < c->per_block; j++){
+			fsckInode(w, k * c->per_block + j + 1);
+		}
+	}
+}
+
+// check the pointer blocks of the batch and claim what they point at, pointer blocks claimed for the first time
+//  are looked at along with the rest of the next level down, so one shared with a clone is looked at once
+static void fsckPointers( struct fs_fsck_worker *w, int first, int last )
+{
+	struct fs_fsck *c = w->c;
+	int i;
+	for(i = first; i < last; i++){
+		struct fs_fsck_block *item = &c->items[c->first + i];
+		union fs_block *block = (union fs_block *) (c->buffer + (size_t) i * DISK_BLOCK_SIZE);
+		int height = item->height - 1;
+
+		long long span = 1;
+		int h;
+		for(h = 0; h < height; h++){
+			span *= POINTERS_PER_BLOCK;
+		}
+
+		int j;
+		for(j = 0; j < POINTERS_PER_BLOCK; j++){
+			int ptr = block->pointers[j];
+			if(ptr == 0) continue;
+
+			long long index = item->base + j * span;
+			if(!fsckValid(c, ptr, height) || index >= FSCK_MAX_INDEX){
+				fsckReport(c, FSCK_POINTER, "inode %d: pointer %d of block %d is %d", item->inumber, j, item->blocknum, ptr);
+				if(c->repair){
+					block->pointers[j] = 0;
+					item->dirty = 1;
+					fsckRepaired(c, FSCK_POINTER);
+				}
+				continue;
+			}
+
+			int blocknum = ptr & ~BLOCK_FLAGS;
+			int claimed = fsckClaim(w, blocknum, item->inumber, height, item->blocknum, j);
+			if(height == 0){
+				fsckMapped(w, item->inumber, index, blocknum);
+			}
+			else if(claimed){
+				struct fs_fsck_block *b = fsckPush(&w->found[height-1], sizeof(struct fs_fsck_block));
+				b->blocknum = blocknum;
+				b->inumber = item->inumber;
+				b->height = height;
+				b->dirty = 0;
+				b->base = index;
+			}
+		}
+	}
+}
+
+// check the entries of the directory buckets of the batch and count the names they give each inode, entries
+//  naming no inode, or filed under the wrong hash where no lookup would find them, are taken out
+static void fsckBuckets( struct fs_fsck_worker *w, int first, int last )
+{
+	struct fs_fsck *c = w->c;
+	int room = DISK_BLOCK_SIZE - sizeof(struct fs_dirbucket);
+	int i;
+	for(i = first; i < last; i++){
+		struct fs_fsck_block *item = &c->items[c->first + i];
+		union fs_block *block = (union fs_block *) (c->buffer + (size_t) i * DISK_BLOCK_SIZE);
+		char *entries = block->data + sizeof(struct fs_dirbucket);
+		int used = block->bucket.used < room ? block->bucket.used : room;
+		int damaged = block->bucket.used > room;
+
+		int off = 0;
+		int kept = 0;
+		int count = 0;
+		while(off < used){
+			int len = off + DIRENT_HEAD <= used ? direntLength(block, off) : 0;
+			if(len == 0 || off + DIRENT_HEAD + len > used){
+				damaged = 1;
+				break;
+			}
+
+			int inumber = direntInumber(block, off);
+			const char *name = direntName(block, off);
+			int size = DIRENT_HEAD + len;
+			if(inumber <= 0 || inumber > c->super.ninodes || !(c->inodes[inumber-1].isvalid & INODE_VALID) || direntHash(block, off) != dirHash(name, len)){
+				fsckReport(c, FSCK_DIR, "directory %d: entry '%.*s' for inode %d", item->inumber, len, name, inumber);
+				if(c->repair) fsckRepaired(c, FSCK_DIR);
+			}
+			else{
+				__atomic_fetch_add(&c->names[inumber-1], 1, __ATOMIC_RELAXED);
+				memmove(entries + kept, entries + off, size);
+				kept += size;
+				count++;
+			}
+			off += size;
+		}
+
+		if(damaged || count != block->bucket.count){
+			fsckReport(c, FSCK_DIR, "directory %d: bucket in block %d damaged at byte %d", item->inumber, item->blocknum, off);
+			if(c->repair) fsckRepaired(c, FSCK_DIR);
+		}
+		if(c->repair && (kept != block->bucket.used || count != block->bucket.count)){
+			memset(entries + kept, 0, room - kept);
+			block->bucket.used = kept;
+			block->bucket.count = count;
+			item->dirty = 1;
+		}
+		__atomic_fetch_add(&c->entries[item->inumber-1], count, __ATOMIC_RELAXED);
+	}
+}
+
+// check the size and the link count of every inode now that the blocks it maps and the names it has are known
+static void fsckFiles( struct fs_fsck_worker *w, int first, int last )
+{
+	struct fs_fsck *c = w->c;
+	int i;
+	for(i = first; i < last; i++){
+		struct fs_inode *inode = &c->inodes[i];
+		if(!(inode->isvalid & INODE_VALID)) continue;
+
+		if(!inodeInline(inode) && (inode->size < 0 || ((long long) inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE < c->last[i])){
+			fsckReport(c, FSCK_SIZE, "inode %d: size %d bytes, but it maps logical block %d", i + 1, inode->size, c->last[i] - 1);
+			if(c->repair){
+				long long size = (long long) c->last[i] * DISK_BLOCK_SIZE;
+				inode->size = size < INT_MAX ? size : INT_MAX;
+				fsckDirty(c, i + 1);
+				fsckRepaired(c, FSCK_SIZE);
+			}
+		}
+
+		int links = (inode->isvalid & INODE_LINKS) / INODE_LINK;
+		if(c->links && links != c->names[i]){
+			fsckReport(c, FSCK_LINKS, "inode %d: link count %d, but %d names", i + 1, links, c->names[i]);
+			if(c->repair){
+				inode->isvalid = (inode->isvalid & ~INODE_LINKS) | c->names[i] * INODE_LINK;
+				fsckDirty(c, i + 1);
+				fsckRepaired(c, FSCK_LINKS);
+			}
+		}
+	}
+}
+
+// the share of the current batch a worker takes
+static void fsckShare( struct fs_fsck_worker *w )
+{
+	struct fs_fsck *c = w->c;
+	int first = (long long) c->n * w->id / c->nworkers;
+	int last = (long long) c->n * (w->id + 1) / c->nworkers;
+	if(first < last) c->run(w, first, last);
+}
+
+// a worker of the pool waits for a batch, takes its share, and waits for the rest to finish theirs
+static void *fsckWorker( void *arg )
+{
+	struct fs_fsck_worker *w = arg;
+	while(1){
+		pthread_barrier_wait(&w->c->go);
+		if(w->c->quit) break;
+		fsckShare(w);
+		pthread_barrier_wait(&w->c->done);
+	}
+	return NULL;
+}
+
+// have the pool, this thread included, run over n items
+static void fsckRun( struct fs_fsck *c, void (*run)( struct fs_fsck_worker *w, int first, int last ), int n )
+{
+	c->run = run;
+	c->n = n;
+	if(c->nworkers > 1) pthread_barrier_wait(&c->go);
+	fsckShare(&c->workers[0]);
+	if(c->nworkers > 1) pthread_barrier_wait(&c->done);
+}
+
+// read the blocks of items [first,first+n) into the batch buffer
+static void fsckRead( struct fs_fsck *c, struct fs_fsck_block *items, int first, int n )
+{
+	struct disk_io io[FSCK_BATCH];
+	int i;
+	for(i = 0; i < n; i++){
+		io[i].blocknum = items[first + i].blocknum;
+		io[i].data = c->buffer + (size_t) i * DISK_BLOCK_SIZE;
+	}
+	disk_readv(io, n);
+	c->reads += n;
+}
+
+// write back the blocks of the batch that repairs changed
+static void fsckWrite( struct fs_fsck *c, struct fs_fsck_block *items, int first, int n )
+{
+	struct disk_io io[FSCK_BATCH];
+	int nio = 0;
+	int i;
+	for(i = 0; i < n; i++){
+		if(!items[first + i].dirty) continue;
+		io[nio].blocknum = items[first + i].blocknum;
+		io[nio].data = c->buffer + (size_t) i * DISK_BLOCK_SIZE;
+		nio++;
+	}
+	disk_writev(io, nio);
+}
+
+// gather the list at the given offset in every worker into one array, emptying the lists
+static char *fsckGather( struct fs_fsck *c, size_t list, size_t size, int *n )
+{
+	*n = 0;
+	int w;
+	for(w = 0; w < c->nworkers; w++){
+		*n += ((struct fs_fsck_list *) ((char *) &c->workers[w] + list))->n;
+	}
+
+	char *items = malloc((size_t) *n * size + 1);
+	char *p = items;
+	for(w = 0; w < c->nworkers; w++){
+		struct fs_fsck_list *l = (struct fs_fsck_list *) ((char *) &c->workers[w] + list);
+		if(l->n == 0) continue;
+		memcpy(p, l->items, (size_t) l->n * size);
+		p += (size_t) l->n * size;
+		l->n = 0;
+	}
+	return items;
+}
+
+// look at the blocks of items in batches, writing back those repairs changed
+static void fsckBlocks( struct fs_fsck *c, void (*run)( struct fs_fsck_worker *w, int first, int last ), struct fs_fsck_block *items, int n )
+{
+	c->items = items;
+	int i;
+	for(i = 0; i < n; i += FSCK_BATCH){
+		int count = n - i < FSCK_BATCH ? n - i : FSCK_BATCH;
+		fsckRead(c, items, i, count);
+		c->first = i;
+		fsckRun(c, run, count);
+		if(c->repair) fsckWrite(c, items, i, count);
+	}
+}
+
+static int dirblockCompare( const void *a, const void *b )
+{
+	const struct fs_fsck_dirblock *x = a;
+	const struct fs_fsck_dirblock *y = b;
+	if(x->inumber != y->inumber) return x->inumber < y->inumber ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// check every directory, its header and then the entries of its buckets, and the root directory the superblock names
+static void fsckDirectories( struct fs_fsck *c )
+{
+	int n;
+	struct fs_fsck_dirblock *d = (struct fs_fsck_dirblock *) fsckGather(c, offsetof(struct fs_fsck_worker, dirblocks), sizeof(struct fs_fsck_dirblock), &n);
+	qsort(d, n, sizeof(struct fs_fsck_dirblock), dirblockCompare);
+
+	int root = c->super.rootdir;
+	if(root != 0 && (root < 0 || root > c->super.ninodes || !(c->inodes[root-1].isvalid & INODE_DIR))){
+		fsckReport(c, FSCK_DIR, "root directory %d is not a directory", root);
+		if(c->repair){
+			c->super.rootdir = 0;
+			fsckRepaired(c, FSCK_DIR);
+		}
+		root = 0;
+	}
+
+	struct fs_fsck_block *buckets = malloc(sizeof(struct fs_fsck_block) * (n + 1));
+	int nbuckets = 0;
+	union fs_block head;
+	int i = 0;
+	while(i < n){
+		int dir = d[i].inumber;
+		int j = i;
+		while(j < n && d[j].inumber == dir) j++;
+
+		// a compressed directory is not read here, and without its names the link counts cannot be checked
+		struct fs_inode *inode = &c->inodes[dir-1];
+		if(inode->isvalid & INODE_PACKED){
+			c->links = 0;
+			i = j;
+			continue;
+		}
+
+		// the header is at logical block zero, the buckets follow the table
+		int headblock = d[i].index == 0 ? d[i].blocknum : 0;
+		memset(head.data, 0, DISK_BLOCK_SIZE);
+		if(headblock){
+			disk_read(headblock, head.data);
+			c->reads++;
+		}
+		int ok = head.dirhead.magic == DIR_MAGIC && head.dirhead.depth >= 0 && head.dirhead.depth <= DIR_MAX_DEPTH
+			&& head.dirhead.nbuckets > 0 && head.dirhead.nbuckets <= 1 << DIR_MAX_DEPTH;
+		if(!ok){
+			fsckReport(c, FSCK_DIR, "directory %d: header damaged", dir);
+		}
+
+		int k;
+		for(k = i; k < j; k++){
+			if(d[k].index < DIR_BUCKETS || (ok && d[k].index >= DIR_BUCKETS + head.dirhead.nbuckets)) continue;
+			struct fs_fsck_block *b = &buckets[nbuckets++];
+			b->blocknum = d[k].blocknum;
+			b->inumber = dir;
+			b->height = 0;
+			b->dirty = 0;
+			b->base = d[k].index;
+		}
+
+		int parent = head.dirhead.parent;
+		if(ok && (parent <= 0 || parent > c->super.ninodes || !(c->inodes[parent-1].isvalid & INODE_DIR))){
+			fsckReport(c, FSCK_DIR, "directory %d: parent %d is not a directory", dir, parent);
+			if(c->repair && headblock){
+				head.dirhead.parent = root ? root : dir;
+				disk_write(headblock, head.data);
+				fsckRepaired(c, FSCK_DIR);
+			}
+		}
+		i = j;
+	}
+
+	fsckBlocks(c, fsckBuckets, buckets, nbuckets);
+	free(buckets);
+
+	// the count of entries in each header, now that they are all counted
+	i = 0;
+	while(i < n){
+		int dir = d[i].inumber;
+		int j = i;
+		while(j < n && d[j].inumber == dir) j++;
+		if(d[i].index != 0 || (c->inodes[dir-1].isvalid & INODE_PACKED)){
+			i = j;
+			continue;
+		}
+
+		disk_read(d[i].blocknum, head.data);
+		c->reads++;
+		if(head.dirhead.magic == DIR_MAGIC && head.dirhead.nentries != c->entries[dir-1]){
+			fsckReport(c, FSCK_DIR, "directory %d: header counts %d entries, the buckets hold %d", dir, head.dirhead.nentries, c->entries[dir-1]);
+			if(c->repair){
+				head.dirhead.nentries = c->entries[dir-1];
+				disk_write(d[i].blocknum, head.data);
+				fsckRepaired(c, FSCK_DIR);
+			}
+		}
+		i = j;
+	}
+	free(d);
+}
+
+// give a claim on a block that another claim got to first a copy of its own, for disks without a reference table
+//  to share it through, a pointer block is not copied but cut off, as everything below it is claimed already
+static void fsckCopy( struct fs_fsck *c, struct fs_fsck_claim *claim, union fs_block *block )
+{
+	int ptr = 0;
+	if(claim->height == 0){
+		int copy = bitmap_find_clear(c->used, c->start, c->end);
+		if(copy < 0) return;
+		bitmap_set(c->used, copy);
+		disk_read(claim->blocknum, block->data);
+		disk_write(copy, block->data);
+		c->reads++;
+		ptr = copy;
+	}
+
+	if(claim->parent == 0){
+		struct fs_inode *inode = &c->inodes[claim->inumber-1];
+		int *entry = claim->slot < POINTERS_PER_INODE ? &inode->direct[claim->slot] : blockRoot(inode, claim->slot - POINTERS_PER_INODE + 1);
+		*entry = ptr | (*entry & BLOCK_FLAGS);
+		fsckDirty(c, claim->inumber);
+	}
+	else{
+		disk_read(claim->parent, block->data);
+		block->pointers[claim->slot] = ptr | (block->pointers[claim->slot] & BLOCK_FLAGS);
+		disk_write(claim->parent, block->data);
+		c->reads++;
+	}
+	c->extra[claim->blocknum]--;
+	fsckRepaired(c, FSCK_SHARED);
+}
+
+// go over the claims that found a block claimed already, a block may be claimed as often as its reference count
+//  allows, and a shared pointer block only by files marked as clones, so copy on write leaves it alone
+//  returns one if a reference count was changed
+static int fsckShared( struct fs_fsck *c, struct fs_blockref *refs )
+{
+	int changed = 0;
+	int n;
+	struct fs_fsck_claim *claims = (struct fs_fsck_claim *) fsckGather(c, offsetof(struct fs_fsck_worker, claims), sizeof(struct fs_fsck_claim), &n);
+	union fs_block block;
+	int i;
+	for(i = 0; i < n; i++){
+		struct fs_fsck_claim *claim = &claims[i];
+		int b = claim->blocknum;
+		int owner = c->owner[b];
+
+		if(!refs || c->extra[b] > refs[b].refs){
+			fsckReport(c, FSCK_SHARED, "block %d: claimed by inode %d and by inode %d, shared %d times", b, owner, claim->inumber, refs ? refs[b].refs : 0);
+			if(!c->repair) continue;
+
+			// where the table can take the extra references the block is shared from now on, otherwise copied
+			if(!refs || owner == 0){
+				fsckCopy(c, claim, &block);
+				continue;
+			}
+			refs[b].refs = c->extra[b];
+			changed = 1;
+			fsckRepaired(c, FSCK_SHARED);
+		}
+
+		if(claim->height > 0 && owner != 0){
+			int k;
+			int both[2] = { owner, claim->inumber };
+			for(k = 0; k < 2; k++){
+				struct fs_inode *inode = &c->inodes[both[k]-1];
+				if(inode->isvalid & INODE_CLONED) continue;
+				fsckReport(c, FSCK_SHARED, "inode %d: shares pointer block %d but is not marked cloned", both[k], b);
+				if(c->repair){
+					inode->isvalid |= INODE_CLONED;
+					fsckDirty(c, both[k]);
+					fsckRepaired(c, FSCK_SHARED);
+				}
+			}
+		}
+	}
+	free(claims);
+	return changed;
+}
+
+// check an unmounted disk, repairing what it finds if asked to, with the given number of workers or one for each
+//  processor, returns the number of problems found, or -1 if the disk cannot be checked
+int fs_fsck( int repair, int nworkers )
+{
+	if(MOUNTED_FLAG == 1){
+		printf("ERROR: unmount the filesystem before checking it\n");
+		return -1;
+	}
+
+	struct timespec began;
+	clock_gettime(CLOCK_MONOTONIC, &began);
+
+	union fs_block block;
+	disk_read(0, block.data);
+	if(!superValid(&block.super)) return -1;
+
+	struct fs_fsck *c = calloc(1, sizeof(struct fs_fsck));
+	struct fs_superblock *super = &c->super;
+	c->super = block.super;
+	c->repair = repair;
+	c->per_block = inodesPerBlock(super);
+	c->start = dataStart(super);
+	c->end = super->segblocks > 0 ? super->segstart + super->nsegments * super->segblocks : super->nblocks;
+	c->links = super->inodesize != 0;
+
+	// a journal is replayed first, as a mount would, or the disk would not look the way it was left
+	if(super->njournalblocks > 0 && super->state != FS_CLEAN){
+		struct journal *j = journal_open(super->journalstart, super->njournalblocks);
+		printf("    replayed %d journal transaction(s)\n", journal_replay(j));
+		journal_close(j);
+	}
+
+	// a log-structured disk has its inode map, the map of its reference table and its bitmap in the newest
+	//  checkpoint, and is only checked, a repair in place would be under the feet of the log
+	char *region = NULL;
+	int *imap = NULL;
+	int *refmap = NULL;
+	char *bits = NULL;
+	if(super->segblocks > 0){
+		region = disk_alloc(super->nckptblocks);
+		if(!checkpointRead(super, region)){
+			printf("ERROR: no intact checkpoint on the log\n");
+			disk_free(region);
+			free(c);
+			return -1;
+		}
+		imap = (int *) (region + DISK_BLOCK_SIZE);
+		bits = region + (size_t) (super->nckptblocks - checkpointBitmapBlocks(super)) * DISK_BLOCK_SIZE;
+		refmap = (int *) (bits - (size_t) checkpointRefmapBlocks(super) * DISK_BLOCK_SIZE);
+		if(repair) printf("    a log-structured disk is only checked, not repaired\n");
+		c->repair = 0;
+	}
+	else if(super->nbitmapblocks > 0 && (super->state == FS_CLEAN || (super->state == FS_DIRTY && super->njournalblocks > 0))){
+		bits = disk_alloc(super->nbitmapblocks);
+		struct disk_io *io = malloc(sizeof(struct disk_io) * super->nbitmapblocks);
+		int k;
+		for(k = 0; k < super->nbitmapblocks; k++){
+			io[k].blocknum = super->bitmapstart + k;
+			io[k].data = bits + (size_t) k * DISK_BLOCK_SIZE;
+		}
+		disk_readv(io, super->nbitmapblocks);
+		free(io);
+	}
+
+	c->inodes = malloc(sizeof(struct fs_inode) * (super->ninodes + 1));
+	c->dirty = calloc(super->ninodeblocks + 1, sizeof(char));
+	c->used = bitmap_create(super->nblocks);
+	c->owner = calloc(super->nblocks, sizeof(int));
+	c->extra = calloc(super->nblocks, sizeof(uint32_t));
+	c->last = calloc(super->ninodes + 1, sizeof(int));
+	c->names = calloc(super->ninodes + 1, sizeof(int));
+	c->entries = calloc(super->ninodes + 1, sizeof(int));
+	c->buffer = disk_alloc(FSCK_BATCH);
+	pthread_mutex_init(&c->lock, NULL);
+
+	// the pool, which the calling thread is the first worker of
+	if(nworkers <= 0) nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nworkers < 1) nworkers = 1;
+	if(nworkers > FSCK_MAX_WORKERS) nworkers = FSCK_MAX_WORKERS;
+	c->nworkers = nworkers;
+	int w;
+	for(w = 0; w < nworkers; w++){
+		c->workers[w].c = c;
+		c->workers[w].id = w;
+	}
+	if(nworkers > 1){
+		pthread_barrier_init(&c->go, NULL, nworkers);
+		pthread_barrier_init(&c->done, NULL, nworkers);
+		for(w = 1; w < nworkers; w++){
+			pthread_create(&c->threads[w], NULL, fsckWorker, &c->workers[w]);
+		}
+	}
+
+	// the superblock and the regions after it, and whatever is past the last whole segment, belong to no file
+	int b;
+	for(b = 0; b < super->nblocks; b++){
+		if(b < c->start || b >= c->end) fsckClaim(&c->workers[0], b, 0, 0, 0, 0);
+	}
+
+	// as do the blocks of the log holding the inode table and the reference table
+	int k;
+	for(k = 0; imap && k < super->ninodeblocks + super->nrefblocks; k++){
+		int where = k < super->ninodeblocks ? imap[k] : refmap[k - super->ninodeblocks];
+		if(where == 0) continue;
+		if(where < c->start || where >= c->end){
+			fsckReport(c, FSCK_POINTER, "checkpoint: metadata block %d is %d", k, where);
+			continue;
+		}
+		fsckClaim(&c->workers[0], where, 0, 0, 0, 0);
+	}
+
+	// the inode table, a batch of blocks at a time
+	for(k = 0; k < super->ninodeblocks; k += FSCK_BATCH){
+		int count = super->ninodeblocks - k < FSCK_BATCH ? super->ninodeblocks - k : FSCK_BATCH;
+		struct disk_io io[FSCK_BATCH];
+		int nio = 0;
+		int i;
+		memset(c->buffer, 0, (size_t) count * DISK_BLOCK_SIZE);
+		for(i = 0; i < count; i++){
+			int where = imap ? imap[k + i] : k + i + 1;
+			if(imap && (where < c->start || where >= c->end)) continue;
+			io[nio].blocknum = where;
+			io[nio].data = c->buffer + (size_t) i * DISK_BLOCK_SIZE;
+			nio++;
+		}
+		disk_readv(io, nio);
+		c->reads += nio;
+		c->first = k;
+		fsckRun(c, fsckInodes, count);
+	}
+
+	// then the trees a level at a time from the top, each level adding to the next one down
+	int height;
+	for(height = MAX_DEPTH; height >= 1; height--){
+		int n;
+		size_t list = offsetof(struct fs_fsck_worker, found) + (height-1) * sizeof(struct fs_fsck_list);
+		struct fs_fsck_block *items = (struct fs_fsck_block *) fsckGather(c, list, sizeof(struct fs_fsck_block), &n);
+		fsckBlocks(c, fsckPointers, items, n);
+		free(items);
+	}
+
+	// the reference table says how often each block may be claimed
+	struct fs_blockref *refs = NULL;
+	if(super->nrefblocks > 0){
+		refs = (struct fs_blockref *) disk_alloc(super->nrefblocks);
+		memset(refs, 0, (size_t) super->nrefblocks * DISK_BLOCK_SIZE);
+		struct disk_io *io = malloc(sizeof(struct disk_io) * super->nrefblocks);
+		int nio = 0;
+		for(k = 0; k < super->nrefblocks; k++){
+			int where = refmap ? refmap[k] : super->refstart + k;
+			if(where == 0) continue;
+			io[nio].blocknum = where;
+			io[nio].data = (char *) refs + (size_t) k * DISK_BLOCK_SIZE;
+			nio++;
+		}
+		disk_readv(io, nio);
+		c->reads += nio;
+		free(io);
+	}
+
+	fsckDirectories(c);
+	int refsdirty = fsckShared(c, refs);
+	fsckRun(c, fsckFiles, super->ninodes);
+
+	// the bitmap against the ownership map, a word at a time, the bits past the end are set in both
+	long long inuse = 0;
+	int nwords = c->used->nwords;
+	for(k = 0; k < nwords; k++){
+		uint64_t u = c->used->words[k];
+		inuse += __builtin_popcountll(u);
+		if(!bits) continue;
+
+		uint64_t s;
+		memcpy(&s, bits + (size_t) k * sizeof(uint64_t), sizeof(uint64_t));
+		if(k == nwords - 1 && super->nblocks % 64) s |= ~(uint64_t) 0 << (super->nblocks % 64);
+		uint64_t diff = u ^ s;
+		while(diff){
+			int bit = __builtin_ctzll(diff);
+			diff &= diff - 1;
+			b = k * 64 + bit;
+			if(u & ((uint64_t) 1 << bit)){
+				fsckReport(c, FSCK_FREE, "block %d: in use by inode %d, but free in the bitmap", b, c->owner[b]);
+				if(c->repair) fsckRepaired(c, FSCK_FREE);
+			}
+			else{
+				fsckReport(c, FSCK_LEAK, "block %d: in use in the bitmap, but nothing claims it", b);
+				if(c->repair) fsckRepaired(c, FSCK_LEAK);
+			}
+		}
+	}
+	inuse -= (long long) nwords * 64 - super->nblocks;
+
+	// and the reference counts against the claims, a table that counts too few was taken care of with the claims
+	for(b = 0; refs && b < super->nblocks; b++){
+		int claimed = bitmap_test(c->used, b);
+		uint32_t want = claimed ? c->extra[b] : 0;
+		if(refs[b].refs > want){
+			fsckReport(c, FSCK_REFS, "block %d: %u references, but claimed %u more times", b, refs[b].refs, want);
+			if(c->repair) fsckRepaired(c, FSCK_REFS);
+		}
+		if(c->repair && (refs[b].refs != want || (!claimed && refs[b].hash))){
+			refs[b].refs = want;
+			if(!claimed) refs[b].hash = 0;
+			refsdirty = 1;
+		}
+	}
+
+	// write back the repairs, the bitmap and the reference table are as the claims say, so the disk is clean
+	if(c->repair){
+		struct disk_io io[FSCK_BATCH];
+		int nio = 0;
+		for(k = 0; k < super->ninodeblocks; k++){
+			if(!c->dirty[k]) continue;
+			union fs_block *out = (union fs_block *) (c->buffer + (size_t) nio * DISK_BLOCK_SIZE);
+			memset(out->data, 0, DISK_BLOCK_SIZE);
+			inodeEncode(super, &c->inodes[k * c->per_block], out);
+			io[nio].blocknum = k + 1;
+			io[nio].data = out->data;
+			if(++nio == FSCK_BATCH){
+				disk_writev(io, nio);
+				nio = 0;
+			}
+		}
+		disk_writev(io, nio);
+
+		if(super->nbitmapblocks > 0){
+			char *image = disk_alloc(super->nbitmapblocks);
+			memset(image, 0, (size_t) super->nbitmapblocks * DISK_BLOCK_SIZE);
+			bitmap_store(c->used, image);
+			for(k = 0; k < super->nbitmapblocks; k++){
+				disk_write(super->bitmapstart + k, image + (size_t) k * DISK_BLOCK_SIZE);
+			}
+			disk_free(image);
+			super->state = FS_CLEAN;
+		}
+		for(k = 0; refsdirty && k < super->nrefblocks; k++){
+			disk_write(super->refstart + k, (char *) refs + (size_t) k * DISK_BLOCK_SIZE);
+		}
+
+		memset(block.data, 0, DISK_BLOCK_SIZE);
+		block.super = *super;
+		disk_write(0, block.data);
+		disk_flush();
+	}
+
+	if(nworkers > 1){
+		c->quit = 1;
+		pthread_barrier_wait(&c->go);
+		for(w = 1; w < nworkers; w++){
+			pthread_join(c->threads[w], NULL);
+		}
+		pthread_barrier_destroy(&c->go);
+		pthread_barrier_destroy(&c->done);
+	}
+
+	struct timespec ended;
+	clock_gettime(CLOCK_MONOTONIC, &ended);
+	double seconds = (ended.tv_sec - began.tv_sec) + (ended.tv_nsec - began.tv_nsec) / 1e9;
+
+	int problems = 0;
+	int repaired = 0;
+	for(k = 0; k < FSCK_KINDS; k++){
+		if(c->problems[k] == 0) continue;
+		printf("    %d %s, %d repaired\n", c->problems[k], fsckKinds[k], c->repaired[k]);
+		problems += c->problems[k];
+		repaired += c->repaired[k];
+	}
+	if(!c->links && super->inodesize != 0){
+		printf("    link counts not checked, a directory is compressed\n");
+	}
+	printf("fsck: %d problems found, %d repaired\n", problems, repaired);
+	printf("    %d blocks, %lld in use, %lld read, in %.3f s with %d workers, %.0f blocks/sec\n", super->nblocks, inuse, c->reads, seconds, nworkers, seconds > 0 ? super->nblocks / seconds : 0.0);
+
+	for(w = 0; w < nworkers; w++){
+		for(k = 0; k < MAX_DEPTH; k++){
+			free(c->workers[w].found[k].items);
+		}
+		free(c->workers[w].claims.items);
+		free(c->workers[w].dirblocks.items);
+	}
+	pthread_mutex_destroy(&c->lock);
+	disk_free(c->buffer);
+	disk_free((char *) refs);
+	if(region){
+		disk_free(region);
+	}
+	else if(bits){
+		disk_free(bits);
+	}
+	free(c->inodes);
+	free(c->dirty);
+	bitmap_delete(c->used);
+	free(c->owner);
+	free(c->extra);
+	free(c->last);
+	free(c->names);
+	free(c->entries);
+	free(c);
+	return problems;
+}
+
+// the number of runs of consecutive disk blocks a file has its data in, holes between them not breaking a run,
+//  and neither the pointer blocks that are put in front of the data they map, and in *present the number of
+//  blocks, with movable only those fs_defrag can move, so not the blocks shared by dedup or a clone
+static int fileExtents( struct fs_inode *inode, int movable, int *present )
+{
+	int nblocks = inodeInline(inode) ? 0 : (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+
+	struct fs_walk walk;
+	walkInit(&walk);
+
+	int extents = 0;
+	int prev = -1;
+	int i;
+	*present = 0;
+	for(i = 0; i < nblocks; i++){
+		int blocknum = blockNumber(blockLookup(&walk, inode, i));
+		if(blocknum == 0) continue;
+		if(movable && (refShared(blocknum) || pathShared(&walk, inode, i))) continue;
+
+		int slots[MAX_DEPTH];
+		int depth = blockPath(i, slots);
+		int level;
+		for(level = 0; level < depth; level++){
+			if(walk.blocknum[level] == prev + 1) prev++;
+		}
+		if(blocknum != prev + 1) extents++;
+		prev = blocknum;
+		(*present)++;
+	}
+	return extents;
+}
+
+// the extents of a file beyond one for every DEFRAG_EXTENT blocks, zero if it is not fragmented
+static int fileFragments( struct fs_inode *inode )
+{
+	int present;
+	int extents = fileExtents(inode, 1, &present);
+	int excess = extents - (present + DEFRAG_EXTENT - 1) / DEFRAG_EXTENT;
+	return excess > 0 ? excess : 0;
+}
+
+struct fs_fragmented {
+	int inumber;
+	int fragments;
+};
+
+static int fragmentedCompare( const void *a, const void *b )
+{
+	const struct fs_fragmented *x = a;
+	const struct fs_fragmented *y = b;
+	if(x->fragments != y->fragments) return x->fragments > y->fragments ? -1 : 1;
+	return x->inumber - y->inumber;
+}
+
+// line up every fragmented file for fs_defrag, the most fragmented first
+static void defragQueue()
+{
+	struct fs_fragmented *found = malloc(sizeof(struct fs_fragmented) * (MOUNT_STATE.super.ninodes + 1));
+	int n = 0;
+	int i;
+	for(i = 1; i <= MOUNT_STATE.super.ninodes; i++){
+		struct fs_inode *inode = inodeLookup(i);
+		if(!inode || !(inode->isvalid & INODE_VALID) || inodeInline(inode)) continue;
+
+		int fragments = fileFragments(inode);
+		if(fragments == 0) continue;
+		found[n].inumber = i;
+		found[n].fragments = fragments;
+		n++;
 	}
+	qsort(found, n, sizeof(struct fs_fragmented), fragmentedCompare);
 
-	MOUNTED_FLAG = 1;
-	return 1;
+	free(MOUNT_STATE.defrag_queue);
+	MOUNT_STATE.defrag_queue = malloc(sizeof(int) * (n + 1));
+	for(i = 0; i < n; i++){
+		MOUNT_STATE.defrag_queue[i] = found[i].inumber;
+	}
+	MOUNT_STATE.defrag_nqueue = n;
+	MOUNT_STATE.defrag_pos = 0;
+	free(found);
 }
 
-// create a new inode of zero length, on success: return the (positive) inumber, on failure: return zero
-int fs_create()
+// time a sequential read of a whole file from the disk rather than from the cache, in MB/s
+static double defragRate( int inumber, struct fs_inode *inode )
 {
+	int size = inode->size;
+	char *buffer = disk_alloc(DEFRAG_BATCH);
+	raDrop(inumber);
+	disk_cache_resize(disk_cache_blocks());
 
-	//if no fs mounted, fail
-	if(MOUNTED_FLAG != 1){
-		printf("ERROR: no filesystem mounted\n");
-		 return 0;
+	struct timespec began;
+	struct timespec ended;
+	clock_gettime(CLOCK_MONOTONIC, &began);
+	int offset;
+	for(offset = 0; offset < size; offset += DEFRAG_BATCH * DISK_BLOCK_SIZE){
+		fileRead(NULL, inumber, inode, buffer, DEFRAG_BATCH * DISK_BLOCK_SIZE, offset);
 	}
+	clock_gettime(CLOCK_MONOTONIC, &ended);
+	disk_free(buffer);
 
-	union fs_block block;
+	double seconds = (ended.tv_sec - began.tv_sec) + (ended.tv_nsec - began.tv_nsec) / 1e9;
+	return seconds > 0 ? size / (1024.0 * 1024.0) / seconds : 0.0;
+}
 
-	int inumber;
-	// iterate through inode blocks to find open space for inode
-	disk_read(0, block.data);
-	int i;
-	for(i = 1; i <= block.super.ninodeblocks; i++){
-		disk_read(i, block.data);
+// move the data blocks of a file from logical block from on into a run of free blocks starting at goal, a batch
+//  at a time, for as long as the budget of block reads and writes lasts
+//  blocks shared by dedup or a clone stay where they are, since the other pointers to them are not known here
+//  leaves the cursor of fs_defrag on the file if it stopped short, returns the number of blocks moved
+static int defragMove( int inumber, struct fs_inode *inode, int from, int goal, int *budget )
+{
+	int nblocks = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	int *map = malloc(sizeof(int) * (nblocks + 1));
+	blockMap(inode, 0, nblocks, map);
 
-		int j;
-		for(j = 0; j < INODES_PER_BLOCK; j++){
-			if(block.inode[j].isvalid == 0){
-				// calculate inumber
-				inumber = ((i-1) * 128) + (j+1);
-
-				// at the first open (invalid) inode, set isvalid to 1 and size to 0, and write back
-				block.inode[j].isvalid = 1;
-				block.inode[j].size = 0;
-				int k;
-				for(k = 0; k < POINTERS_PER_INODE; k++){
-					block.inode[j].direct[k] = 0;
-				}
-				block.inode[j].indirect = 0;
-				disk_write(i, block.data);
+	char *buffer = disk_alloc(DEFRAG_BATCH);
+	struct disk_io io[DEFRAG_BATCH];
+	int index[DEFRAG_BATCH];
+	int reserved[DEFRAG_BATCH];
 
-				// set the index of this new inode in the bit map to 1
-				FREE_BLOCK_BITMAP[i] = 1;
+	struct fs_walk walk;
+	walkInit(&walk);
 
-				return inumber;
+	int moved = 0;
+	int i = from;
+	while(i < nblocks && *budget > 0){
+		// the next blocks to move, each costs a read and a write unless it was only reserved
+		int want = *budget < 2 * DEFRAG_BATCH ? (*budget + 1) / 2 : DEFRAG_BATCH;
+		int n = 0;
+		int j;
+		for(j = i; j < nblocks && n < want; j++){
+			int blocknum = blockNumber(map[j]);
+			if(blocknum == 0) continue;
+			if(refShared(blocknum) || pathShared(&walk, inode, j)){
+				MOUNT_STATE.defrag_kept++;
+				continue;
 			}
+			index[n++] = j;
+		}
+		int next = j;
+		if(n == 0){
+			i = nblocks;
+			break;
 		}
-	}
-
-	// return the error if there are no more inodes
-	printf("ERROR: inode table full\n");
-	return 0;
 
-}
+		// the allocation cursor stays where it was, or what is written meanwhile would go to the rest of the run
+		int cursor = FREE_BLOCK_BITMAP->cursor;
+		int got = allocExtents(goal, n, reserved);
+		FREE_BLOCK_BITMAP->cursor = cursor;
+		if(got < n){
+			printf("ERROR: Disk full\n");
+			while(got > 0){
+				bitmap_clear(FREE_BLOCK_BITMAP, reserved[--got]);
+			}
+			*budget = 0;
+			break;
+		}
 
-//Delete the inode indicated by the inumber. Release all data and 
-//indirect blocks assigned to this inode and return them to the free 
-//block map. On success, return one. On failure, return 0.
-int fs_delete( int inumber )
-{
+		int nio = 0;
+		for(j = 0; j < n; j++){
+			if(map[index[j]] & BLOCK_UNWRITTEN) continue;
+			io[nio].blocknum = blockNumber(map[index[j]]);
+			io[nio].data = buffer + (size_t) nio * DISK_BLOCK_SIZE;
+			nio++;
+		}
+		disk_readv(io, nio);
+		nio = 0;
+		for(j = 0; j < n; j++){
+			if(!(map[index[j]] & BLOCK_UNWRITTEN)) io[nio++].blocknum = reserved[j];
+		}
+		disk_writev(io, nio);
+		MOUNT_STATE.data_block_reads += nio;
+		MOUNT_STATE.data_block_writes += nio;
+		*budget -= nio > 0 ? 2 * nio : 1;
 
-	//if no fs mounted, fail
-	if(MOUNTED_FLAG != 1){
-		printf("ERROR: no filesystem mounted\n");
-		 return 0;
+		// the copies are on their way before the pointers to them change, which the journal commits after
+		//  flushing the disk, and the old blocks are held until then
+		for(j = 0; j < n; j++){
+			int old = blockNumber(map[index[j]]);
+			blockSet(&walk, inumber, inode, index[j], reserved[j] | (map[index[j]] & BLOCK_FLAGS));
+			refMove(old, reserved[j]);
+			blockRelease(old);
+		}
+		moved += n;
+		goal = reserved[n-1] + 1;
+		i = next;
 	}
+	walkFlush(&walk);
 
-	union fs_block block;
-	union fs_block superblk;
+	inodeDirty(inumber);
+	inodeFlush();
+	raDrop(inumber);
+	fileChanged(inumber, NULL);
+	clusterDrop(inumber);
+	journalOp();
 
-	disk_read(0, superblk.data);
-	//check inode number is in valid range
-	if (inumber > superblk.super.ninodes){
-		printf("ERROR: Inode out of range\n");
-		return 0;
+	if(i < nblocks){
+		MOUNT_STATE.defrag_inumber = inumber;
+		MOUNT_STATE.defrag_index = i;
+		MOUNT_STATE.defrag_next = goal;
 	}
-	
-	int blocknum = 1; //block num
-	int inodenum = 1; //index num
-	
-	//generate index numbers
-	while(inumber > INODES_PER_BLOCK){
-		blocknum++;
-		inumber -= INODES_PER_BLOCK;
+	else{
+		MOUNT_STATE.defrag_inumber = 0;
 	}
-	inodenum = inumber - 1;
+	MOUNT_STATE.defrag_count += moved;
+	MOUNT_STATE.defrag_moved += moved;
 
-	disk_read(blocknum, block.data);
-	if(block.inode[inodenum].isvalid == 0){
-		printf("ERROR: Invalid inode\n");
-		return 0;
+	disk_free(buffer);
+	free(map);
+	return moved;
+}
+
+// the start of the first free run of want blocks, or of the longest there is, whose length is returned, the run
+//  is only looked for here and taken a batch at a time as blocks move into it
+static int defragRun( int want, int *start )
+{
+	int cursor = FREE_BLOCK_BITMAP->cursor;
+	int len = bitmap_alloc_run(FREE_BLOCK_BITMAP, -1, want, start);
+	int k;
+	for(k = 0; k < len; k++){
+		bitmap_clear(FREE_BLOCK_BITMAP, *start + k);
 	}
-	block.inode[inodenum].isvalid = 0;
-	block.inode[inodenum].size = 0;
-	disk_write(blocknum, block.data);
-	
-	int i = 1;
-	//check if inode block is now empty
-	FREE_BLOCK_BITMAP[blocknum] = 0;
-	for( i = 1; i <= INODES_PER_BLOCK; i++){	
-		if(block.inode[i].isvalid){
-			FREE_BLOCK_BITMAP[blocknum] = 1;
-		}
+	FREE_BLOCK_BITMAP->cursor = cursor;
+	return len;
+}
+
+// go on defragmenting a file, starting it if the cursor of fs_defrag is not on it already, and report on it
+//  once it is done, returns the number of blocks moved
+static int defragFile( int inumber, int *budget, int measure )
+{
+	struct fs_inode *inode = inodeLookup(inumber);
+	if(!inode || !(inode->isvalid & INODE_VALID) || inodeInline(inode)){
+		if(MOUNT_STATE.defrag_inumber == inumber) MOUNT_STATE.defrag_inumber = 0;
+		return 0;
 	}
 
-	//delete all direct pointers
-	int j;
-	for(j = 0; j < POINTERS_PER_INODE; j++){
-		if (block.inode[inodenum].direct[j] != 0){
-			FREE_BLOCK_BITMAP[block.inode[inodenum].direct[j]] = 0;  //Set bitmap to 0
-			block.inode[inodenum].direct[j] = 0; 	//Remove pointer
+	int from = 0;
+	int goal = -1;
+	if(MOUNT_STATE.defrag_inumber == inumber){
+		from = MOUNT_STATE.defrag_index;
+		goal = MOUNT_STATE.defrag_next;
+
+		// where a write since the last call took the block after those moved, the rest goes to a run of its own
+		if(goal >= MOUNT_STATE.super.nblocks || bitmap_test(FREE_BLOCK_BITMAP, goal)){
+			int rest = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE - from;
+			if(rest > 0) defragRun(rest, &goal);
 		}
 	}
-	disk_write(blocknum, block.data);
+	else{
+		int present;
+		int extents = fileExtents(inode, 1, &present);
+		if(extents <= 1){
+			printf("    inode %d: %d blocks in %d extent\n", inumber, present, extents);
+			return 0;
+		}
 
-	//delete inderect pointers
-	// if there is an indirect section, identify the corresponding data blocks
-	int indirect = block.inode[inodenum].indirect;
-	if(indirect != 0){
-		FREE_BLOCK_BITMAP[indirect] = 0; 			//remove form map[]
-		disk_read(indirect, block.data);
-		int l;
-		for(l = 0; l < POINTERS_PER_BLOCK; l++){
-			int block_ptr = block.pointers[l];
-			if(block_ptr != 0){
-				FREE_BLOCK_BITMAP[block_ptr] = 0; 	//remove all ptrs from map
-			}
-			block_ptr = 0;
+		// the file goes to the first free run it fits in, or the longest there is, which must beat the extents
+		//  it is in now
+		int start;
+		int len = defragRun(present, &start);
+		if(len <= present / extents){
+			printf("    inode %d: %d blocks in %d extents, no free run is longer than those\n", inumber, present, extents);
+			return 0;
 		}
-		disk_write(indirect, block.data);
 
-		disk_read(blocknum, block.data);
-		block.inode[inodenum].indirect = 0; 		//remove indirect pointer
-		disk_write(blocknum, block.data);
+		goal = start;
+		MOUNT_STATE.defrag_extents = extents;
+		MOUNT_STATE.defrag_count = 0;
+		MOUNT_STATE.defrag_rate = measure ? defragRate(inumber, inode) : 0.0;
 	}
 
-	return 1;
+	int moved = defragMove(inumber, inode, from, goal, budget);
+	if(MOUNT_STATE.defrag_inumber == inumber) return moved;
+
+	int present;
+	int extents = fileExtents(inode, 1, &present);
+	printf("    inode %d: %d blocks in %d extents, now %d, %d blocks moved", inumber, present, MOUNT_STATE.defrag_extents, extents, MOUNT_STATE.defrag_count);
+	if(measure){
+		printf(", sequential read %.1f MB/s, now %.1f MB/s", MOUNT_STATE.defrag_rate, defragRate(inumber, inode));
+	}
+	printf("\n");
+	MOUNT_STATE.defrag_files++;
+	return moved;
 }
 
-// return the logical size of the given inode, in bytes
-int fs_getsize( int inumber )
+// move the data of fragmented files into contiguous runs of free blocks, the given file, or with inumber zero
+//  every fragmented file, the worst first, reading and writing about budget blocks at most, or any number when
+//  it is zero, and going on where the last call stopped, so the work can be spread out between other operations
+//  measure also times a sequential read of each file before and after, which is not counted in the budget
+//  returns the number of blocks moved, or -1 on error
+int fs_defrag( int inumber, int budget, int measure )
 {
-	//if no fs mounted, fail
 	if(MOUNTED_FLAG != 1){
 		printf("ERROR: no filesystem mounted\n");
-		 return -1;
+		return -1;
 	}
 
-	union fs_block superblk;
+	// the cleaner already writes what it moves in order at the head of the log
+	if(logMode()){
+		printf("ERROR: a log-structured disk is laid out by its cleaner, see fs_clean()\n");
+		return -1;
+	}
 
-	disk_read(0, superblk.data);
-	//check inode number is in valid range
-	if (inumber > superblk.super.ninodes){
-		printf("ERROR: Inode out of range\n");
-		return 0;
+	if(inumber != 0){
+		struct fs_inode *inode = inodeLookup(inumber);
+		if(!inode || !inode->isvalid){
+			printf("ERROR: Invalid inode\n");
+			return -1;
+		}
 	}
 
-	union fs_block block;
-	
-	int blocknum = 1; // block num
-	
-	// generate index numbers
-	while(inumber > INODES_PER_BLOCK){
-		blocknum++;
-		inumber -= INODES_PER_BLOCK;
+	int left = budget > 0 ? budget : INT_MAX;
+	if(inumber != 0) return defragFile(inumber, &left, measure);
+
+	// the queue is made once it has run out, and at most once a call
+	int moved = 0;
+	int queued = 0;
+	while(left > 0){
+		if(MOUNT_STATE.defrag_inumber == 0){
+			if(MOUNT_STATE.defrag_pos == MOUNT_STATE.defrag_nqueue){
+				if(queued) break;
+				defragQueue();
+				queued = 1;
+				continue;
+			}
+			int next = MOUNT_STATE.defrag_queue[MOUNT_STATE.defrag_pos++];
+			struct fs_inode *inode = inodeLookup(next);
+			if(!inode || !(inode->isvalid & INODE_VALID) || inodeInline(inode) || fileFragments(inode) == 0) continue;
+			moved += defragFile(next, &left, measure);
+		}
+		else{
+			moved += defragFile(MOUNT_STATE.defrag_inumber, &left, measure);
+		}
 	}
+	return moved;
+}
 
-	disk_read(blocknum, block.data);
+// allocate a free data block and mark it used, return zero if the disk is full
+//  the bitmap search resumes where the last allocation left off (next-fit)
+int findBlock(){
 
-	return block.inode[inumber-1].size;
+	int n = bitmap_alloc(FREE_BLOCK_BITMAP);
 
-	// TODO Error checking
-	// return -1;
+	//ERROR
+	if(n < 0) return 0;
+
+	return n;
 }
 
-// read data from a valid inode, copy "length" bytes from the inode into the "data" pointer, starting at "offset" in the inode
-//  return the total number of bytes read, the number of bytes actually read could be smaller than the number of bytes requested, 
-//  perhaps if the end of the inode is reached, if the given inumber is invalid, or any other error is encountered, return 0
-int fs_read( int inumber, char *data, int length, int offset )
+// where logical block index sits in the block tree, returns the depth (zero for a direct pointer, one to
+//  three for the indirect, double and triple indirect trees) and the entry taken at each level in slots[],
+//  or -1 past the largest file the tree can map
+static int blockPath( int index, int *slots )
 {
-	//if no fs mounted, fail
-	if(MOUNTED_FLAG != 1){
-		printf("ERROR: no filesystem mounted\n");
-		 return 0;
-	}
+	if(index < 0) return -1;
 
-	union fs_block superblk;
-	disk_read(0, superblk.data);
-	//check inode number is in valid range
-	if (inumber > superblk.super.ninodes){
-		printf("ERROR: Inode out of range\n");
+	if(index < POINTERS_PER_INODE){
+		slots[0] = index;
 		return 0;
 	}
 
-	union fs_block block;
-	
-	int blocknum = 1; // block num
-	int inodenum = 1; //index num
-	
-	// generate index numbers
-	while(inumber > INODES_PER_BLOCK){
-		blocknum++;
-		inumber -= INODES_PER_BLOCK;
+	long long rest = index - POINTERS_PER_INODE;
+	long long span = POINTERS_PER_BLOCK;
+	int depth;
+	for(depth = 1; depth <= MAX_DEPTH; depth++){
+		if(rest < span){
+			int level;
+			for(level = depth - 1; level >= 0; level--){
+				slots[level] = rest % POINTERS_PER_BLOCK;
+				rest /= POINTERS_PER_BLOCK;
+			}
+			return depth;
+		}
+		rest -= span;
+		span *= POINTERS_PER_BLOCK;
 	}
 
-	inodenum = inumber - 1;
+	return -1;
+}
 
-	// read data from blcok number containing given inumber
-	disk_read(blocknum, block.data);
+// the inode field at the root of the tree of the given depth
+static int *blockRoot( struct fs_inode *inode, int depth )
+{
+	if(depth == 1) return &inode->indirect;
+	if(depth == 2) return &inode->dindirect;
+	return &inode->tindirect;
+}
 
-	// if inode is invalid, return 0
-	if(!block.inode[inodenum].isvalid){
-		printf("ERROR: invalid inode\n");
-		return 0;
+// legacy inodes only have room for the single indirect tree
+static int maxDepth()
+{
+	return MOUNT_STATE.super.inodesize == 0 ? 1 : MAX_DEPTH;
+}
+
+// number of logical blocks a file on the mounted filesystem can map
+static long long maxBlocks()
+{
+	long long total = POINTERS_PER_INODE;
+	long long span = POINTERS_PER_BLOCK;
+	int depth;
+	for(depth = 1; depth <= maxDepth(); depth++){
+		total += span;
+		span *= POINTERS_PER_BLOCK;
+	}
+	return total;
+}
+
+static void walkInit( struct fs_walk *walk )
+{
+	int level;
+	for(level = 0; level < MAX_DEPTH; level++){
+		walk->blocknum[level] = 0;
+		walk->dirty[level] = 0;
 	}
+}
 
-	// get data from given inode, if size is 0, return 0
-	int size = block.inode[inodenum].size;
-	if(size == 0) return 0;
+// write back the pointer block held at one level of a walk if it was changed
+static void walkWrite( struct fs_walk *walk, int level )
+{
+	if(!walk->dirty[level]) return;
 
-	int numblocks = ceil(size/DISK_BLOCK_SIZE) + 1;
+	metaWrite(walk->blocknum[level], walk->block[level].data);
+	MOUNT_STATE.data_block_writes++;
+	walk->dirty[level] = 0;
+}
 
-	// build an arrray containing the indices corresponding to the data associated with this inode
-	int blocknums[numblocks];
+// write back every changed pointer block of a walk
+static void walkFlush( struct fs_walk *walk )
+{
+	int level;
+	for(level = 0; level < MAX_DEPTH; level++){
+		walkWrite(walk, level);
+	}
+}
 
-	// add the direct block indices to this array
-	int i;
-	int directblocks = 0;
-	for(i = 0; i < POINTERS_PER_INODE; i++){
-		if(block.inode[inodenum].direct[i]){
-			blocknums[i] = block.inode[inodenum].direct[i];
-			directblocks++;
-		}
+// the pointer block at the given level of a walk, read from disk unless it is the one already there
+static union fs_block *walkBlock( struct fs_walk *walk, int level, int blocknum )
+{
+	if(walk->blocknum[level] != blocknum){
+		walkWrite(walk, level);
+		metaRead(blocknum, walk->block[level].data);
+		MOUNT_STATE.data_block_reads++;
+		walk->blocknum[level] = blocknum;
 	}
+	return &walk->block[level];
+}
 
-	// add the indirect block indices to this array
-	int indirect = block.inode[inodenum].indirect;
-	if (indirect != 0){
-		disk_read(indirect, block.data);
+// the disk block holding logical block index of a file, or zero if there is none
+static int blockLookup( struct fs_walk *walk, struct fs_inode *inode, int index )
+{
+	int slots[MAX_DEPTH];
+	int depth = blockPath(index, slots);
+	if(depth < 0 || depth > maxDepth()) return 0;
+	if(depth == 0) return inode->direct[slots[0]];
 
-		int j;
-		for(j = 0; j < POINTERS_PER_BLOCK; j++){
-			if(block.pointers[j]){
-				blocknums[j + directblocks] = block.pointers[j];
-			}
-		}
+	int blocknum = *blockRoot(inode, depth);
+	int level;
+	for(level = 0; level < depth; level++){
+		if(blocknum <= 0 || blocknum >= MOUNT_STATE.super.nblocks) return 0;
+		blocknum = walkBlock(walk, level, blocknum)->pointers[slots[level]];
 	}
+	return blocknum;
+}
 
-	int index_to_start = offset / DISK_BLOCK_SIZE;
-	int blocks_per_length = length / DISK_BLOCK_SIZE;
-	int blocks_to_read = index_to_start + blocks_per_length;
+// the entry for logical block index of a file, held by the inode or by a pointer block left in the walk and
+//  marked dirty there, for the caller to fill in
+//  pointer blocks missing on the way down are taken from the reservation, so they land in front of the data
+//  they map, or with no reservation, on a log-structured disk, straight from the head of the log, where the
+//  pointer blocks on the way down move as well, since nothing the last checkpoint refers to is changed
+//  a pointer block on the way down that a clone shares is copied first, see fs_clone()
+//  returns NULL if the reservation ran out or the file cannot grow that far
+static int *blockEntry( struct fs_walk *walk, int inumber, struct fs_inode *inode, int index, const int *reserved, int *next, int nreserved )
+{
+	int slots[MAX_DEPTH];
+	int depth = blockPath(index, slots);
+	if(depth < 0 || depth > maxDepth()) return NULL;
 
-	if(blocks_to_read > numblocks){
-		blocks_to_read = numblocks;
-	}
+	// entry is the pointer being filled in, held by the inode or by the pointer block one level up
+	int *entry = depth == 0 ? &inode->direct[slots[0]] : blockRoot(inode, depth);
+	int level;
+	for(level = 0; level < depth; level++){
+		if(*entry == 0){
+			int blocknum = 0;
+			if(reserved){
+				if(*next < nreserved) blocknum = reserved[(*next)++];
+			}
+			else{
+				blocknum = logAlloc(1);
+			}
+			if(blocknum == 0) return NULL;
+			*entry = blocknum;
 
-	int bytes_read = 0;
-	int bytes_left = size;
-	int blocksize = DISK_BLOCK_SIZE;
+			if(level == 0){
+				inodeDirty(inumber);
+			}
+			else{
+				walk->dirty[level-1] = 1;
+			}
 
-	int k;
-	int l;
-	for(k = index_to_start; k < blocks_to_read; k++){
-		// see how many bytes are left to be read, if less than the whole block,
-		//  set the block size to this number that's less than 4096
-		bytes_left = size - bytes_read - offset;
-		if(bytes_left < DISK_BLOCK_SIZE){
-			blocksize = bytes_left;
+			// a fresh pointer block starts out with no pointers, and reaches the disk when the walk moves on
+			walkWrite(walk, level);
+			walk->blocknum[level] = *entry;
+			walk->dirty[level] = 1;
+			memset(walk->block[level].data, 0, DISK_BLOCK_SIZE);
 		}
+		else if(refShared(*entry)){
+			// the copy takes one more reference to everything the shared block points at, and lets go of
+			//  the shared block, which stays where it is for the other files
+			int blocknum = 0;
+			if(reserved){
+				if(*next < nreserved) blocknum = reserved[(*next)++];
+			}
+			else{
+				blocknum = logMode() ? logAlloc(1) : findBlock();
+			}
+			if(blocknum == 0) return NULL;
 
-		// read each data block in the inode data block array
-		disk_read(blocknums[k], block.data);
-		for(l = 0; l < blocksize; l++){
-			data[bytes_read] = block.data[l];
-			bytes_read++;
+			union fs_block *block = walkBlock(walk, level, *entry);
+			int l;
+			for(l = 0; l < POINTERS_PER_BLOCK; l++){
+				if(blockNumber(block->pointers[l])) refTake(blockNumber(block->pointers[l]));
+			}
+			blockRelease(*entry);
+			*entry = blocknum;
+			walk->blocknum[level] = blocknum;
+			walk->dirty[level] = 1;
+			if(level == 0){
+				inodeDirty(inumber);
+			}
+			else{
+				walk->dirty[level-1] = 1;
+			}
+			MOUNT_STATE.cow_pointers++;
+		}
+		else if(logMode() && imageTest(MOUNT_STATE.bitmap_image, *entry)){
+			// a pointer block the last checkpoint refers to moves to the head of the log, after which it can
+			//  be changed where it is until the next checkpoint
+			int blocknum = logAlloc(1);
+			if(blocknum == 0) return NULL;
+
+			walkBlock(walk, level, *entry);
+			blockRelease(*entry);
+			*entry = blocknum;
+			walk->blocknum[level] = blocknum;
+			walk->dirty[level] = 1;
+			if(level == 0){
+				inodeDirty(inumber);
+			}
+			else{
+				walk->dirty[level-1] = 1;
+			}
 		}
-	}
 
-	return bytes_read;
+		entry = &walkBlock(walk, level, *entry)->pointers[slots[level]];
+	}
 
+	if(depth == 0){
+		inodeDirty(inumber);
+	}
+	else{
+		walk->dirty[depth-1] = 1;
+	}
+	return entry;
 }
 
-// write data to a valid inode, copy "length" bytes from the pointer "data" into the inode starting at "offset" bytes allocate
-//  any necessary direct and indirect blocks in the process, return the number of bytes actually written, the number of bytes
-//  actually written could be smaller than the number of bytes request, perhaps if the disk becomes full
-//  If the given inumber is invalid, or any other error is encountered, return 0
-int fs_write( int inumber, const char *data, int length, int offset )
+// give logical block index of a file the next reserved block, pointer blocks missing on the way down are
+//  taken from the reservation first so they land in front of the data they map
+//  with no reservation, on a log-structured disk, blocks come straight from the head of the log
+//  changed pointer blocks are left dirty in the walk, for walkFlush to write back once the caller is done
+//  returns the data block, or zero if the reservation ran out or the file cannot grow that far
+static int blockAssign( struct fs_walk *walk, int inumber, struct fs_inode *inode, int index, const int *reserved, int *next, int nreserved )
 {
-	//if no fs mounted, fail
-	if(MOUNTED_FLAG != 1){
-		printf("ERROR: no filesystem mounted\n");
-		 return 0;
-	}
+	int *entry = blockEntry(walk, inumber, inode, index, reserved, next, nreserved);
+	if(!entry) return 0;
 
-	union fs_block block;
-	union fs_block indirectblock;
-	union fs_block superblk;
-
-	disk_read(0, superblk.data);
-	//check inode number is in valid range
-	if (inumber > superblk.super.ninodes){
-		printf("ERROR: Inode our of range\n");
-		return 0;
+	int blocknum = 0;
+	if(reserved){
+		if(*next < nreserved) blocknum = reserved[(*next)++];
 	}
-
-	int blocknum = 1; //block num
-	int inodenum = 1; //index num
-	
-	//generate index numbers
-	while(inumber > INODES_PER_BLOCK){
-		blocknum++;
-		inumber -= INODES_PER_BLOCK;
+	else{
+		blocknum = logAlloc(0);
 	}
-	inodenum = inumber - 1;
+	if(blocknum == 0) return 0;
 
-	int first_ptr = getLocation(offset);
-	
-	disk_read( blocknum, block.data);
+	*entry = blocknum;
+	return blocknum;
+}
 
-	//make sure inumber is valid
-	if(!block.inode[inodenum].isvalid){
-		printf("ERROR: Invalid inode\n");
-		return 0;
+// an upper bound on the pointer blocks needed to map logical blocks first to last, one per pointer block
+//  the range touches at every level, whether or not it already exists
+static int blockOverhead( int first, int last )
+{
+	int total = 0;
+	long long start = POINTERS_PER_INODE;
+	long long span = POINTERS_PER_BLOCK;
+	int depth;
+	for(depth = 1; depth <= maxDepth(); depth++){
+		long long a = first > start ? first : start;
+		long long b = last < start + span - 1 ? last : start + span - 1;
+		if(a <= b){
+			long long cover = span;
+			int level;
+			for(level = 0; level < depth; level++){
+				total += (b - start) / cover - (a - start) / cover + 1;
+				cover /= POINTERS_PER_BLOCK;
+			}
+		}
+		start += span;
+		span *= POINTERS_PER_BLOCK;
 	}
+	return total;
+}
+
+// translate count logical blocks of a file, starting at index first, into block pointers
+//  each pointer block is read at most once, holes and pointers off the end of the disk come back as zero
+static void blockMap( struct fs_inode *inode, int first, int count, int *blocknums )
+{
+	struct fs_walk walk;
+	walkInit(&walk);
 
-	//calculate number of blocks needed + remainder size
-	int rem = length;
-	int numblocks = 1;
-	while( rem > DISK_BLOCK_SIZE ){
-		rem -= DISK_BLOCK_SIZE;
-		numblocks++;
+	int i;
+	for(i = 0; i < count; i++){
+		int ptr = blockLookup(&walk, inode, first + i);
+		blocknums[i] = blockNumber(ptr) ? ptr : 0;
 	}
-	printf("numblocks: %d\n", numblocks);
+}
 
-	int left_to_write = length;
-	int written = 0;
-	int curr_ptr = 0;
+// the disk block a block pointer refers to, without its flags, or zero if it refers to none
+static int blockNumber( int ptr )
+{
+	int blocknum = ptr & ~BLOCK_FLAGS;
+	return ptr > 0 && blocknum < MOUNT_STATE.super.nblocks ? blocknum : 0;
+}
 
+// point logical block index of a file, which already has a block, at ptr instead, which may carry flags or
+//  be zero to leave a hole, the path down to it exists so nothing is allocated but pointer blocks that move
+//  or are copied, returns zero if there was no room for those
+static int blockSet( struct fs_walk *walk, int inumber, struct fs_inode *inode, int index, int ptr )
+{
+	int *entry = blockEntry(walk, inumber, inode, index, NULL, NULL, 0);
+	if(!entry) return 0;
+	*entry = ptr;
+	return 1;
+}
 
-	//while file still has data to write
-	while(left_to_write > 0){
-		int size_to_write = 4096;
-		int dest_block;
+// returns one if a pointer block on the way down to logical block index of a file is shared with a clone,
+//  so nothing below it may be written over where it is, only files that have been cloned can have one
+static int pathShared( struct fs_walk *walk, struct fs_inode *inode, int index )
+{
+	if(!MOUNT_STATE.refs || !(inode->isvalid & INODE_CLONED)) return 0;
 
-		
+	int slots[MAX_DEPTH];
+	int depth = blockPath(index, slots);
+	if(depth <= 0 || depth > maxDepth()) return 0;
 
-		//get current pointer location in inode
-		curr_ptr = getLocation( offset + written );
+	int blocknum = *blockRoot(inode, depth);
+	int level;
+	for(level = 0; level < depth; level++){
+		if(blocknum <= 0 || blocknum >= MOUNT_STATE.super.nblocks) return 0;
+		if(refShared(blocknum)) return 1;
+		blocknum = walkBlock(walk, level, blocknum)->pointers[slots[level]];
+	}
+	return 0;
+}
 
-		//direct or inderect pointer?
-		if(curr_ptr < 5){ 											//direct
-			//find destination data block to write to
-			if((dest_block = findBlock())){
-				//mark block on bitmap as used
-				FREE_BLOCK_BITMAP[dest_block] = 1;
-			}
-			else {
-				printf("ERROR: File too large\n");
-				return 0;
-			}
-			block.inode[inodenum].direct[curr_ptr] = dest_block;
-			disk_write( blocknum, block.data);
-		}
-		else{  														//indirect
-			int indirect = block.inode[inodenum].indirect;
-			if( indirect == 0 ){
-				if((indirect = findBlock())){
-					//mark block on bitmap as used
-					FREE_BLOCK_BITMAP[indirect] = 1;
-				}
-				else {
-					printf("ERROR: File too large\n");
-					return 0;
-				}
-				block.inode[inodenum].indirect = indirect;
-				disk_write(blocknum, block.data);			
-			}
-			//find destination data block to write to
-			if((dest_block = findBlock())){
-				//mark block on bitmap as used
-				FREE_BLOCK_BITMAP[dest_block] = 1;
-			}
-			else {
-				printf("ERROR: File too large\n");
-				return 0;
-			}
+// return a pointer block and everything below it to the free block map, blocks of height one point at data
+static void blockFreeTree( int blocknum, int height )
+{
+	union fs_block block;
 
-			disk_read( block.inode[inodenum].indirect, indirectblock.data);
-			indirectblock.pointers[ curr_ptr - 6 ] = dest_block;
-			
-			int r;
-			for( r = (numblocks - 5) + first_ptr; r < 1024; r++){
-				indirectblock.pointers[r] = 0;
-			}
-			disk_write( block.inode[inodenum].indirect, indirectblock.data);
-			
-		}
+	if(blocknum <= 0 || blocknum >= MOUNT_STATE.super.nblocks) return;
 
+	// a tree shared with a clone is left to the files still using it
+	if(refDrop(blocknum)) return;
 
-		//if last block and has uneven write size, adjust write size
-		if(left_to_write < 4096){
-			size_to_write = left_to_write;
-		}
+	metaRead(blocknum, block.data);
+	MOUNT_STATE.data_block_reads++;
 
-		//write to data block
-		int i;
-		char chunk[4096];
-		for( i = 0; i < size_to_write; i++){
-			chunk[i] = data[ i + written ];
-		}
+	int l;
+	for(l = 0; l < POINTERS_PER_BLOCK; l++){
+		int block_ptr = block.pointers[l];
+		if(block_ptr == 0) continue;
 
-		if(size_to_write == 4096){
-			disk_write(dest_block, chunk);
+		if(height > 1){
+			blockFreeTree(block_ptr, height - 1);
 		}
-		else{
-			char remchunk[rem];
-			int j;
-			for( j = 0; j < rem; j++){
-				remchunk[j] = chunk[j];
-			}
-			disk_write(dest_block, remchunk);
+		else if(blockNumber(block_ptr)){
+			blockRelease(blockNumber(block_ptr));
 		}
-
-		//track how much data is left
-		left_to_write -= size_to_write;
-		written += size_to_write;
-		
 	}
-	block.inode[inodenum].size += written;
-	disk_write( blocknum, block.data);
-	return written;
+
+	blockRelease(blocknum);
 }
 
-int findBlock(){
+// reserve up to n data blocks into blocks[], preferring a single contiguous run that starts at goal
+//  when the free space is fragmented, the longest remaining runs are taken one after another
+//  return the number of blocks reserved, which is less than n only if the disk fills up
+static int allocExtents( int goal, int n, int *blocks )
+{
+	int got = 0;
+	while(got < n){
+		int start;
+		int len = bitmap_alloc_run(FREE_BLOCK_BITMAP, goal, n - got, &start);
 
-	//load super block
-	union fs_block block;
-	disk_read(0, block.data);
+		// blocks freed since the last commit are held back, commit to get them if the disk is otherwise full
+		if(len <= 0 && MOUNT_STATE.journal && (bitmap_nfree(MOUNT_STATE.freed) < MOUNT_STATE.freed->nbits
+			|| bitmap_nfree(MOUNT_STATE.logfreed) < MOUNT_STATE.logfreed->nbits)){
+			journalCommit(1);
+			len = bitmap_alloc_run(FREE_BLOCK_BITMAP, goal, n - got, &start);
+		}
+		if(len <= 0) break;
 
-	int n_inodes = block.super.ninodeblocks;
-	int n_blocks = block.super.nblocks;
-	int i;
-	
-	//Linearly probe data blocks for open block
-	for(i = n_inodes + 1; i < n_blocks; i++){
-		if(FREE_BLOCK_BITMAP[i] == 0) return i;
+		int i;
+		for(i = 0; i < len; i++){
+			blocks[got++] = start + i;
+		}
+		goal = start + len;
 	}
-
-	//ERROR
-	return 0;
+	return got;
 }
 
 int getLocation( int offset ){
@@ -680,3 +6394,81 @@ int getLocation( int offset ){
 	return location;
 
 }
+
+// report how much block traffic the filesystem has generated since it was mounted
+void fs_stats()
+{
+	if(MOUNTED_FLAG != 1){
+		printf("ERROR: no filesystem mounted\n");
+		return;
+	}
+
+	printf("inode table:\n");
+	printf("    %d inode lookups served from memory\n", MOUNT_STATE.inode_lookups);
+	printf("    %d inode block reads\n", MOUNT_STATE.inode_block_reads);
+	printf("    %d inode block writes\n", MOUNT_STATE.inode_block_writes);
+	printf("free blocks:\n");
+	printf("    %d of %d blocks free\n", bitmap_nfree(FREE_BLOCK_BITMAP), MOUNT_STATE.super.nblocks);
+	printf("data:\n");
+	printf("    %d data/indirect block reads\n", MOUNT_STATE.data_block_reads);
+	printf("    %d data/indirect block writes\n", MOUNT_STATE.data_block_writes);
+	printf("readahead:\n");
+	printf("    %d blocks prefetched\n", MOUNT_STATE.ra_blocks);
+	printf("    %d hits\n", MOUNT_STATE.ra_hits);
+	printf("    %d wasted\n", MOUNT_STATE.ra_waste);
+	printf("holes:\n");
+	printf("    %d hole blocks read as zeros\n", MOUNT_STATE.hole_reads);
+	printf("    %d zero blocks left unallocated\n", MOUNT_STATE.zero_writes);
+	printf("inline data:\n");
+	printf("    %d reads served from the inode\n", MOUNT_STATE.inline_reads);
+	printf("compression:\n");
+	printf("    %d clusters written compressed, saving %d blocks\n", MOUNT_STATE.compress_clusters, MOUNT_STATE.compress_saved);
+	printf("    %d clusters written as they are\n", MOUNT_STATE.compress_raw);
+	printf("    %d clusters decompressed, %d reads served from the last one\n", MOUNT_STATE.compress_reads, MOUNT_STATE.compress_hits);
+	if(MOUNT_STATE.refs){
+		// the ratio is of the blocks fingerprinted to those of them that had to be stored
+		int shared = 0;
+		long long extra = 0;
+		int b;
+		for(b = 0; b < MOUNT_STATE.super.nblocks; b++){
+			if(MOUNT_STATE.refs[b].refs == 0) continue;
+			shared++;
+			extra += MOUNT_STATE.refs[b].refs;
+		}
+		int stored = MOUNT_STATE.dedup_hashed - MOUNT_STATE.dedup_hits;
+		double mb = (double) MOUNT_STATE.dedup_hashed * DISK_BLOCK_SIZE / (1 << 20);
+		printf("dedup:\n");
+		printf("    %d blocks fingerprinted, %d found on disk already, ratio %.2f\n", MOUNT_STATE.dedup_hashed, MOUNT_STATE.dedup_hits, stored > 0 ? (double) MOUNT_STATE.dedup_hashed / stored : 1.0);
+		printf("    %d candidates read back, %d of them held other data\n", MOUNT_STATE.dedup_verify, MOUNT_STATE.dedup_mismatch);
+		printf("    %.3f ms of CPU time, %.3f ms per MB fingerprinted\n", MOUNT_STATE.dedup_cpu * 1000, mb > 0 ? MOUNT_STATE.dedup_cpu * 1000 / mb : 0.0);
+		printf("    %d blocks in the index, %d shared by %lld more pointers\n", MOUNT_STATE.dedup_entries, shared, extra);
+		printf("clones:\n");
+		printf("    %d files cloned\n", MOUNT_STATE.clones);
+		printf("    %d data blocks and %d pointer blocks copied on write\n", MOUNT_STATE.cow_data, MOUNT_STATE.cow_pointers);
+	}
+	if(MOUNT_STATE.super.inodesize > 0){
+		printf("directories:\n");
+		printf("    %d names looked up, %d blocks read, %.2f per lookup\n", MOUNT_STATE.dir_lookups, MOUNT_STATE.dir_reads, MOUNT_STATE.dir_lookups ? (double) MOUNT_STATE.dir_reads / MOUNT_STATE.dir_lookups : 0.0);
+		printf("    %d buckets split, %d tables doubled\n", MOUNT_STATE.dir_splits, MOUNT_STATE.dir_doublings);
+	}
+	if(!logMode()){
+		printf("defrag:\n");
+		printf("    %d files defragmented, %d blocks moved\n", MOUNT_STATE.defrag_files, MOUNT_STATE.defrag_moved);
+		printf("    %d shared blocks left where they were\n", MOUNT_STATE.defrag_kept);
+	}
+	if(MOUNT_STATE.journal){
+		struct journal *j = MOUNT_STATE.journal;
+		printf("journal:\n");
+		printf("    %d transactions committed, %d blocks logged\n", j->commits, j->logged);
+		printf("    %d checkpoints, %d blocks written home\n", j->checkpoints, j->inplace);
+		printf("    %d transactions replayed at mount\n", j->replayed);
+	}
+	if(logMode()){
+		printf("log:\n");
+		printf("    %d segments of %d blocks, %d clean\n", MOUNT_STATE.super.nsegments, MOUNT_STATE.super.segblocks, MOUNT_STATE.nclean);
+		printf("    %d blocks appended, %d checkpoints\n", MOUNT_STATE.log_blocks, MOUNT_STATE.log_checkpoints);
+		printf("cleaner (%s):\n", CLEANER_POLICY == FS_CLEANER_GREEDY ? "greedy" : "cost-benefit");
+		printf("    %d passes reclaimed %d segments\n", MOUNT_STATE.clean_passes, MOUNT_STATE.clean_segments);
+		printf("    %d live blocks copied\n", MOUNT_STATE.clean_copied);
+	}
+}
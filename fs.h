@@ -1,16 +1,49 @@
 #ifndef FS_H
 #define FS_H
 
+// policies for choosing the segments the cleaner of a log-structured disk reclaims
+#define FS_CLEANER_GREEDY       0	// the emptiest segments first
+#define FS_CLEANER_COST_BENEFIT 1	// weigh free space against how long the live data has stayed put
+
+// longest name a directory entry can hold, not counting the terminating zero
+#define FS_NAME_MAX 255
+
 void fs_debug();
+void fs_stats();
 int  fs_format();
+int  fs_format_log();
 int  fs_mount();
+int  fs_unmount();
+int  fs_mounted();
+int  fs_sync();
+int  fs_clean();
+int  fs_cleaner_policy( int policy );
+int  fs_fsck( int repair, int nworkers );
+int  fs_defrag( int inumber, int budget, int measure );
 
 int  fs_create();
 int  fs_delete( int inumber );
+int  fs_clone( int inumber );
 int  fs_getsize();
 
+int  fs_mkdir( const char *path );
+int  fs_lookup( const char *path );
+int  fs_link( const char *path, int inumber );
+int  fs_unlink( const char *path );
+int  fs_readdir( int inumber, int *cookie, char *name, int *entry );
+
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_fallocate( int inumber, int offset, int length );
+int  fs_compress( int inumber, int on );
+int  fs_dedup( int inumber, int on );
+
+struct fs_file;
+
+struct fs_file * fs_open( int inumber );
+int  fs_read_h( struct fs_file *f, char *data, int length, int offset );
+int  fs_write_h( struct fs_file *f, const char *data, int length, int offset );
+int  fs_close( struct fs_file *f );
 
 
 int findBlock();
@@ -0,0 +1,435 @@
+
+#include "journal.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define JOURNAL_MAGIC   0x6a726e6c
+#define JOURNAL_DESC    0x6a726e64
+#define JOURNAL_COMMIT  0x6a726e63
+
+#define JOURNAL_BUCKETS 1024
+
+// block numbers one descriptor block can list
+#define DESC_BLOCKS     ((int) (DISK_BLOCK_SIZE/sizeof(int)) - 3)
+
+// the first block of the region, naming the transaction replay should find at the start of the log
+struct journal_header {
+	int magic;
+	int sequence;
+};
+
+// lists the home locations of the n blocks that follow it in the log
+struct journal_desc {
+	int magic;
+	int sequence;
+	int n;
+	int blocknums[DESC_BLOCKS];
+};
+
+// closes a transaction of n blocks, which only counts if the checksum matches them
+struct journal_commit {
+	int magic;
+	int sequence;
+	int n;
+	uint32_t checksum;
+};
+
+union journal_block {
+	struct journal_header header;
+	struct journal_desc desc;
+	struct journal_commit commit;
+	char data[DISK_BLOCK_SIZE];
+};
+
+// a metadata block held in memory until it has been checkpointed
+struct journal_entry {
+	int blocknum;
+	int dirty;			// changed since the last commit
+	int logpos;			// where in the log its last committed copy is, zero if there is none
+	char *data;
+	struct journal_entry *next;
+};
+
+// FNV-1a, folded over the blocks of a transaction and their home locations
+static uint32_t checksum( uint32_t h, const void *data, int n )
+{
+	const unsigned char *p = data;
+	int i;
+	for(i=0;i<n;i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+static struct journal_entry **bucket( struct journal *j, int blocknum )
+{
+	return &j->buckets[(unsigned) blocknum % JOURNAL_BUCKETS];
+}
+
+static struct journal_entry *find( struct journal *j, int blocknum )
+{
+	struct journal_entry *e;
+	for(e = *bucket(j, blocknum); e; e = e->next) {
+		if(e->blocknum == blocknum) return e;
+	}
+	return 0;
+}
+
+static void drop( struct journal *j, struct journal_entry *e )
+{
+	struct journal_entry **p = bucket(j, e->blocknum);
+	while(*p != e) p = &(*p)->next;
+	*p = e->next;
+
+	if(e->dirty) j->ndirty--;
+	disk_free(e->data);
+	free(e);
+}
+
+static int compare_entries( const void *a, const void *b )
+{
+	const struct journal_entry *x = *(struct journal_entry * const *)a;
+	const struct journal_entry *y = *(struct journal_entry * const *)b;
+	return x->blocknum - y->blocknum;
+}
+
+// collect the entries that are dirty (or, failing that, have a copy in the log) in block order
+static struct journal_entry **collect( struct journal *j, int dirty, int *n )
+{
+	struct journal_entry **list = 0;
+	int count = 0, capacity = 0;
+	int i;
+	for(i=0;i<JOURNAL_BUCKETS;i++) {
+		struct journal_entry *e;
+		for(e = j->buckets[i]; e; e = e->next) {
+			if(dirty ? !e->dirty : !e->logpos) continue;
+			if(count == capacity) {
+				capacity = capacity ? capacity*2 : 64;
+				list = realloc(list, sizeof(*list)*capacity);
+			}
+			list[count++] = e;
+		}
+	}
+	if(count > 1) qsort(list, count, sizeof(*list), compare_entries);
+	*n = count;
+	return list;
+}
+
+// log blocks a transaction of n blocks takes, its descriptors and commit block included
+static int log_space( int n )
+{
+	return n + (n + DESC_BLOCKS - 1)/DESC_BLOCKS + 1;
+}
+
+static void write_header( int start, int sequence )
+{
+	union journal_block *block = (union journal_block *) disk_alloc(1);
+	memset(block, 0, DISK_BLOCK_SIZE);
+	block->header.magic = JOURNAL_MAGIC;
+	block->header.sequence = sequence;
+	disk_write(start, block->data);
+	disk_free(block->data);
+}
+
+// set up an empty log in the given region
+void journal_format( int start, int nblocks )
+{
+	write_header(start, 1);
+}
+
+// take over the log in the given region, it is not replayed until journal_replay is called
+struct journal * journal_open( int start, int nblocks )
+{
+	struct journal *j = calloc(1, sizeof(*j));
+	if(!j) return 0;
+
+	j->buckets = calloc(JOURNAL_BUCKETS, sizeof(struct journal_entry *));
+	j->start = start;
+	j->nblocks = nblocks;
+	j->head = 1;
+	j->sequence = 1;
+
+	union journal_block *block = (union journal_block *) disk_alloc(1);
+	disk_read(start, block->data);
+	if(block->header.magic == JOURNAL_MAGIC) {
+		j->sequence = block->header.sequence;
+	}
+	disk_free(block->data);
+
+	return j;
+}
+
+// forget everything held in memory, without writing any of it
+void journal_close( struct journal *j )
+{
+	if(!j) return;
+
+	int i;
+	for(i=0;i<JOURNAL_BUCKETS;i++) {
+		while(j->buckets[i]) drop(j, j->buckets[i]);
+	}
+	free(j->buckets);
+	free(j);
+}
+
+// copy every complete transaction in the log to its home location, then start the log afresh
+//  the log is read with one request, and a transaction that is torn or out of sequence ends the replay
+//  return the number of transactions replayed
+int journal_replay( struct journal *j )
+{
+	int n = j->nblocks - 1;
+	char *log = disk_alloc(n);
+	struct disk_io *io = malloc(sizeof(struct disk_io)*n);
+	int i;
+	for(i=0;i<n;i++) {
+		io[i].blocknum = j->start + 1 + i;
+		io[i].data = log + (size_t) i*DISK_BLOCK_SIZE;
+	}
+	disk_readv(io, n);
+
+	int pos = 0;
+	int count = 0;
+	while(pos < n) {
+		int p = pos;
+		int nio = 0;
+		uint32_t h = checksum(2166136261u, &j->sequence, sizeof(int));
+		int complete = 0;
+
+		while(p < n) {
+			union journal_block *block = (union journal_block *) (log + (size_t) p*DISK_BLOCK_SIZE);
+			if(block->desc.magic == JOURNAL_DESC && block->desc.sequence == j->sequence) {
+				int m = block->desc.n;
+				if(m <= 0 || m > DESC_BLOCKS || p + 1 + m > n) break;
+				for(i=0;i<m;i++) {
+					int blocknum = block->desc.blocknums[i];
+					if(blocknum < 0 || blocknum >= disk_size()) break;
+					io[nio].blocknum = blocknum;
+					io[nio].data = log + (size_t) (p+1+i)*DISK_BLOCK_SIZE;
+					h = checksum(h, &blocknum, sizeof(int));
+					h = checksum(h, io[nio].data, DISK_BLOCK_SIZE);
+					nio++;
+				}
+				if(i < m) break;
+				p += 1 + m;
+			} else {
+				complete = block->commit.magic == JOURNAL_COMMIT && block->commit.sequence == j->sequence
+					&& block->commit.n == nio && block->commit.checksum == h;
+				p++;
+				break;
+			}
+		}
+		if(!complete) break;
+
+		// a block may appear in several transactions, so each one is written home before the next
+		disk_writev(io, nio);
+		j->sequence++;
+		pos = p;
+		count++;
+	}
+	disk_flush();
+
+	free(io);
+	disk_free(log);
+
+	j->head = 1;
+	write_header(j->start, j->sequence);
+	disk_flush();
+
+	j->replayed += count;
+	return count;
+}
+
+// hold a new copy of a metadata block for the next commit
+void journal_write( struct journal *j, int blocknum, const char *data )
+{
+	struct journal_entry *e = find(j, blocknum);
+	if(!e) {
+		e = calloc(1, sizeof(*e));
+		e->blocknum = blocknum;
+		e->data = disk_alloc(1);
+		e->next = *bucket(j, blocknum);
+		*bucket(j, blocknum) = e;
+	}
+	memcpy(e->data, data, DISK_BLOCK_SIZE);
+	if(!e->dirty) {
+		e->dirty = 1;
+		j->ndirty++;
+	}
+}
+
+// copy out the current version of a block if the journal holds it, return one if it did
+int journal_read( struct journal *j, int blocknum, char *data )
+{
+	struct journal_entry *e = find(j, blocknum);
+	if(!e) return 0;
+	memcpy(data, e->data, DISK_BLOCK_SIZE);
+	return 1;
+}
+
+// stop tracking a block that has been freed, return one if an older copy of it is still in the log,
+//  in which case replay may write that copy home and the block must not be reused until a checkpoint
+int journal_forget( struct journal *j, int blocknum )
+{
+	struct journal_entry *e = find(j, blocknum);
+	if(!e) return 0;
+
+	int logged = e->logpos != 0;
+	drop(j, e);
+	return logged;
+}
+
+// number of blocks changed since the last commit
+int journal_pending( struct journal *j )
+{
+	return j->ndirty;
+}
+
+// write every block changed since the last commit to the log as one transaction, checkpointing first if
+//  the log is too full to take it, return one on success and zero if it would not fit even in an empty log
+int journal_commit( struct journal *j )
+{
+	if(j->ndirty == 0) return 1;
+
+	int need = log_space(j->ndirty);
+	if(need > j->nblocks - 1) return 0;
+	if(j->head + need > j->nblocks) journal_checkpoint(j);
+
+	int n;
+	struct journal_entry **list = collect(j, 1, &n);
+
+	// data blocks reach the disk before any metadata that points at them
+	disk_flush();
+
+	// descriptors and the commit block are staged together, the blocks themselves go from the entries
+	int nmeta = need - n;
+	union journal_block *meta = (union journal_block *) disk_alloc(nmeta);
+	memset(meta, 0, (size_t) nmeta*DISK_BLOCK_SIZE);
+	struct disk_io *io = malloc(sizeof(struct disk_io)*need);
+
+	uint32_t h = checksum(2166136261u, &j->sequence, sizeof(int));
+	int pos = j->head;
+	int nio = 0;
+	int nmade = 0;
+	int i = 0;
+	while(i < n) {
+		union journal_block *desc = &meta[nmade++];
+		int m = n - i < DESC_BLOCKS ? n - i : DESC_BLOCKS;
+		desc->desc.magic = JOURNAL_DESC;
+		desc->desc.sequence = j->sequence;
+		desc->desc.n = m;
+		io[nio].blocknum = j->start + pos++;
+		io[nio].data = desc->data;
+		nio++;
+
+		int k;
+		for(k=0;k<m;k++,i++) {
+			desc->desc.blocknums[k] = list[i]->blocknum;
+			h = checksum(h, &list[i]->blocknum, sizeof(int));
+			h = checksum(h, list[i]->data, DISK_BLOCK_SIZE);
+			list[i]->logpos = pos;
+			io[nio].blocknum = j->start + pos++;
+			io[nio].data = list[i]->data;
+			nio++;
+		}
+	}
+
+	union journal_block *commit = &meta[nmade];
+	commit->commit.magic = JOURNAL_COMMIT;
+	commit->commit.sequence = j->sequence;
+	commit->commit.n = n;
+	commit->commit.checksum = h;
+	io[nio].blocknum = j->start + pos++;
+	io[nio].data = commit->data;
+	nio++;
+
+	disk_writev(io, nio);
+	disk_flush();
+
+	for(i=0;i<n;i++) {
+		list[i]->dirty = 0;
+	}
+	j->ndirty = 0;
+	j->head = pos;
+	j->sequence++;
+	j->commits++;
+	j->logged += nio;
+
+	free(io);
+	disk_free(meta->data);
+	free(list);
+	return 1;
+}
+
+// write the committed copy of every logged block to its home location and empty the log
+//  blocks changed since their last commit are written as they were committed, and kept for the next one
+void journal_checkpoint( struct journal *j )
+{
+	int n;
+	struct journal_entry **list = collect(j, 0, &n);
+
+	char *old = 0;
+	int nold = 0;
+	int i;
+	for(i=0;i<n;i++) {
+		if(list[i]->dirty) nold++;
+	}
+	if(nold) old = disk_alloc(nold);
+
+	struct disk_io *io = malloc(sizeof(struct disk_io)*(n+1));
+	nold = 0;
+	for(i=0;i<n;i++) {
+		io[i].blocknum = list[i]->blocknum;
+		if(list[i]->dirty) {
+			io[i].data = old + (size_t) nold++*DISK_BLOCK_SIZE;
+			disk_read(j->start + list[i]->logpos, io[i].data);
+		} else {
+			io[i].data = list[i]->data;
+		}
+	}
+	disk_writev(io, n);
+	disk_flush();
+
+	j->head = 1;
+	write_header(j->start, j->sequence);
+	disk_flush();
+
+	for(i=0;i<n;i++) {
+		list[i]->logpos = 0;
+		if(!list[i]->dirty) drop(j, list[i]);
+	}
+	j->checkpoints++;
+	j->inplace += n;
+
+	free(io);
+	if(old) disk_free(old);
+	free(list);
+}
+
+// write the blocks changed since the last commit straight home without logging them, for a change too
+//  large for the log, the caller must checkpoint first and decide how a crash part way through is recovered
+void journal_bypass( struct journal *j )
+{
+	int n;
+	struct journal_entry **list = collect(j, 1, &n);
+
+	struct disk_io *io = malloc(sizeof(struct disk_io)*(n+1));
+	int i;
+	for(i=0;i<n;i++) {
+		io[i].blocknum = list[i]->blocknum;
+		io[i].data = list[i]->data;
+	}
+	disk_writev(io, n);
+	disk_flush();
+
+	for(i=0;i<n;i++) {
+		drop(j, list[i]);
+	}
+	j->inplace += n;
+
+	free(io);
+	free(list);
+}
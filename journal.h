@@ -0,0 +1,50 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+A write-ahead log of whole metadata blocks, kept in a fixed region of the
+disk whose first block is a header.  Blocks handed to journal_write are
+held in memory, and journal_commit writes every one changed since the last
+commit as a single transaction with one sequential request at the head of
+the log, after flushing the disk so that data reaches it before the
+metadata that points at it.  Committed blocks are written to their home
+locations only when the log fills up or journal_checkpoint is called, so a
+block that keeps changing goes in place once per checkpoint.  Until then
+journal_read holds the current copy, and must be asked before the disk.
+After a crash journal_replay copies every complete transaction home; the
+log is bounded, so that is all the recovery a disk of any size needs.
+*/
+
+struct journal_entry;
+
+struct journal {
+	int start;		// first block of the region, holding the header
+	int nblocks;		// blocks in the region, header included
+	int head;		// next free block of the log, counted from start
+	int sequence;		// number of the next transaction
+	int ndirty;		// blocks changed since the last commit
+	struct journal_entry **buckets;
+
+	int commits;
+	int logged;		// blocks written to the log, descriptors and commit blocks included
+	int checkpoints;
+	int inplace;		// blocks written to their home location by checkpoints
+	int replayed;		// transactions recovered by journal_replay
+};
+
+void journal_format( int start, int nblocks );
+
+struct journal * journal_open( int start, int nblocks );
+void journal_close( struct journal *j );
+int  journal_replay( struct journal *j );
+
+void journal_write( struct journal *j, int blocknum, const char *data );
+int  journal_read( struct journal *j, int blocknum, char *data );
+int  journal_forget( struct journal *j, int blocknum );
+int  journal_pending( struct journal *j );
+
+int  journal_commit( struct journal *j );
+void journal_checkpoint( struct journal *j );
+void journal_bypass( struct journal *j );
+
+#endif
@@ -0,0 +1,183 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH   4
+#define MAX_OFFSET  65535
+#define HASH_BITS   12
+
+// give up on finding matches a little faster after every 32 misses in a row
+#define SKIP_SHIFT  5
+
+static uint32_t read32( const unsigned char *p )
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int hash32( uint32_t v )
+{
+	return (v*2654435761u) >> (32-HASH_BITS);
+}
+
+// append a count of the given size in the bytes of 255 that follow a full token field
+static unsigned char * put_count( unsigned char *out, int count )
+{
+	while(count >= 255) {
+		*out++ = 255;
+		count -= 255;
+	}
+	*out++ = count;
+	return out;
+}
+
+// append one sequence, a match length of zero marking the last one, return NULL if it does not fit before end
+static unsigned char * put_sequence( unsigned char *out, unsigned char *end, const unsigned char *literals, int nlit, int offset, int length )
+{
+	// the token, both count extensions, the literals and the offset at most
+	if(end-out < 1 + (nlit/255+1) + nlit + 2 + (length/255+1)) return 0;
+
+	int mlen = length ? length-MIN_MATCH : 0;
+	unsigned char *token = out++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if(nlit >= 15) out = put_count(out, nlit-15);
+
+	memcpy(out, literals, nlit);
+	out += nlit;
+	if(!length) return out;
+
+	*out++ = offset & 0xff;
+	*out++ = offset >> 8;
+	*token |= mlen < 15 ? mlen : 15;
+	if(mlen >= 15) out = put_count(out, mlen-15);
+	return out;
+}
+
+// compress n bytes from src into at most cap bytes at dst
+//  returns the compressed length, or zero if it would not fit or the data does not look compressible
+int lz_compress( const char *src, int n, char *dst, int cap )
+{
+	const unsigned char *in = (const unsigned char *) src;
+	unsigned char *out = (unsigned char *) dst;
+	unsigned char *end = out + cap;
+
+	// positions plus one of the last four bytes seen with each hash, zero for none
+	int table[1<<HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	int anchor = 0;
+	int misses = 0;
+	int probed = 0;
+	int i = 0;
+
+	while(i + MIN_MATCH <= n) {
+		// a cheap look at how the first stretch went, counting the literals still pending
+		if(!probed && i >= LZ_PROBE) {
+			probed = 1;
+			long used = (long)(out-(unsigned char *)dst) + (i-anchor);
+			if(used > i - i/16) return 0;
+		}
+
+		uint32_t v = read32(in+i);
+		int h = hash32(v);
+		int candidate = table[h]-1;
+		table[h] = i+1;
+
+		if(candidate < 0 || i-candidate > MAX_OFFSET || read32(in+candidate) != v) {
+			i += 1 + (misses++ >> SKIP_SHIFT);
+			continue;
+		}
+		misses = 0;
+
+		// extend the match forward, then backward over literals that also match
+		int length = MIN_MATCH;
+		while(i+length < n && in[candidate+length] == in[i+length]) length++;
+		while(i > anchor && candidate > 0 && in[i-1] == in[candidate-1]) {
+			i--;
+			candidate--;
+			length++;
+		}
+
+		out = put_sequence(out, end, in+anchor, i-anchor, i-candidate, length);
+		if(!out) return 0;
+
+		i += length;
+		anchor = i;
+	}
+
+	if(anchor < n) {
+		out = put_sequence(out, end, in+anchor, n-anchor, 0, 0);
+		if(!out) return 0;
+	}
+
+	return out - (unsigned char *) dst;
+}
+
+// read a count extension starting at in[*ip], return -1 if it runs off the end of the input
+static int get_count( const unsigned char *in, int n, int *ip )
+{
+	int count = 0;
+	int b;
+	do {
+		if(*ip >= n) return -1;
+		b = in[(*ip)++];
+		count += b;
+	} while(b == 255);
+	return count;
+}
+
+// decompress n bytes from src into at most cap bytes at dst
+//  returns the decompressed length, or -1 if the input is damaged or would not fit
+int lz_decompress( const char *src, int n, char *dst, int cap )
+{
+	const unsigned char *in = (const unsigned char *) src;
+	unsigned char *out = (unsigned char *) dst;
+	int ip = 0;
+	int op = 0;
+
+	while(ip < n) {
+		int token = in[ip++];
+
+		int nlit = token >> 4;
+		if(nlit == 15) {
+			int more = get_count(in, n, &ip);
+			if(more < 0) return -1;
+			nlit += more;
+		}
+		if(nlit > n-ip || nlit > cap-op) return -1;
+		memcpy(out+op, in+ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		if(ip == n) break;
+
+		if(n-ip < 2) return -1;
+		int offset = in[ip] | (in[ip+1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op) return -1;
+
+		int length = token & 15;
+		if(length == 15) {
+			int more = get_count(in, n, &ip);
+			if(more < 0) return -1;
+			length += more;
+		}
+		length += MIN_MATCH;
+		if(length > cap-op) return -1;
+
+		// a match may overlap the bytes it produces, which repeats them
+		if(offset >= length) {
+			memcpy(out+op, out+op-offset, length);
+			op += length;
+		} else {
+			int k;
+			for(k = 0; k < length; k++, op++) {
+				out[op] = out[op-offset];
+			}
+		}
+	}
+
+	return op;
+}
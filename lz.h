@@ -0,0 +1,19 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+A small LZ77 codec in the style of LZ4, used to store file data compressed a cluster of blocks at a time.
+The output is a series of sequences, each a token byte holding a literal count and a match length in four
+bits apiece (extended by bytes of 255 when they overflow), the literals, and a two byte offset back into the
+data already produced.  The last sequence has literals only.  Matches are found through a hash of the next
+four bytes, and the search skips ahead faster the longer it goes without finding one, so data that does not
+compress is passed over quickly.
+*/
+
+// the compressor gives up once this many bytes have gone by without saving a sixteenth of them
+#define LZ_PROBE 4096
+
+int lz_compress( const char *src, int n, char *dst, int cap );
+int lz_decompress( const char *src, int n, char *dst, int cap );
+
+#endif
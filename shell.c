@@ -6,9 +6,13 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
+static int do_inumber( const char *arg );
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int do_ls( int inumber );
+static int do_dirbench( int entries );
 
 int main( int argc, char *argv[] )
 {
@@ -16,14 +20,46 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
+	char arg3[1024];
 	int inumber, result, args;
+	int backend = DISK_BACKEND_FILE;
+	const char *progname = argv[0];
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	while(argc>=3 && argv[1][0]=='-') {
+		if(!strcmp(argv[1],"-b")) {
+			if(!strcmp(argv[2],"file")) {
+				backend = DISK_BACKEND_FILE;
+			} else if(!strcmp(argv[2],"mmap")) {
+				backend = DISK_BACKEND_MMAP;
+			} else if(!strcmp(argv[2],"async")) {
+				backend = DISK_BACKEND_ASYNC;
+			} else if(!strcmp(argv[2],"direct")) {
+				backend = DISK_BACKEND_ASYNC|DISK_ASYNC_DIRECT;
+			} else if(!strcmp(argv[2],"threads")) {
+				backend = DISK_BACKEND_ASYNC|DISK_ASYNC_THREADS;
+			} else {
+				printf("unknown backend: %s\n",argv[2]);
+				return 1;
+			}
+		} else if(!strcmp(argv[1],"-q")) {
+			disk_queue_depth(atoi(argv[2]));
+		} else {
+			break;
+		}
+		argv += 2;
+		argc -= 2;
+	}
+
+	if(argc!=3 && argc!=4) {
+		printf("use: %s [-b file|mmap|async|direct|threads] [-q depth] <diskfile> <nblocks> [cacheblocks]\n",progname);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	if(argc==4) {
+		disk_cache_resize(atoi(argv[3]));
+	}
+
+	if(!disk_init_backend(argv[1],atoi(argv[2]),backend)) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
@@ -39,7 +75,7 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+		args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
@@ -49,8 +85,14 @@ int main( int argc, char *argv[] )
 				} else {
 					printf("format failed!\n");
 				}
+			} else if(args==2 && !strcmp(arg1,"log")) {
+				if(fs_format_log()) {
+					printf("disk formatted as a log.\n");
+				} else {
+					printf("format failed!\n");
+				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [log]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
@@ -62,15 +104,79 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: mount\n");
 			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount()) {
+					printf("disk unmounted.\n");
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
 				fs_debug();
 			} else {
 				printf("use: debug\n");
 			}
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1) {
+				fs_stats();
+				disk_stats();
+			} else {
+				printf("use: stats\n");
+			}
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_mounted() && !fs_sync()) {
+					printf("sync failed!\n");
+				} else {
+					if(!fs_mounted()) disk_flush();
+					printf("disk cache flushed.\n");
+				}
+			} else {
+				printf("use: sync\n");
+			}
+		} else if(!strcmp(cmd,"clean")) {
+			if(args==1) {
+				result = fs_clean();
+				printf("%d segments reclaimed.\n",result);
+			} else {
+				printf("use: clean\n");
+			}
+		} else if(!strcmp(cmd,"cleaner")) {
+			if(args==2 && !strcmp(arg1,"greedy")) {
+				fs_cleaner_policy(FS_CLEANER_GREEDY);
+			} else if(args==2 && !strcmp(arg1,"cost-benefit")) {
+				fs_cleaner_policy(FS_CLEANER_COST_BENEFIT);
+			} else {
+				printf("use: cleaner greedy|cost-benefit\n");
+			}
+		} else if(!strcmp(cmd,"fsck")) {
+			if(args>=1 && args<=3 && (args==1 || !strcmp(arg1,"check") || !strcmp(arg1,"repair"))) {
+				result = fs_fsck(args>=2 && !strcmp(arg1,"repair"),args==3 ? atoi(arg2) : 0);
+				if(result<0) {
+					printf("fsck failed!\n");
+				}
+			} else {
+				printf("use: fsck [check|repair] [workers]\n");
+			}
+		} else if(!strcmp(cmd,"defrag")) {
+			if(args==2 || args==3) {
+				inumber = strcmp(arg1,"all") ? do_inumber(arg1) : 0;
+				result = inumber>0 || !strcmp(arg1,"all") ? fs_defrag(inumber,args==3 ? atoi(arg2) : 0,1) : -1;
+				if(result>=0) {
+					printf("%d blocks moved.\n",result);
+				} else {
+					printf("defrag failed!\n");
+				}
+			} else {
+				printf("use: defrag all|<inode> [budget]\n");
+			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
-				inumber = atoi(arg1);
+				inumber = do_inumber(arg1);
 				result = fs_getsize(inumber);
 				if(result>=0) {
 					printf("inode %d has size %d\n",inumber,result);
@@ -78,75 +184,218 @@ int main( int argc, char *argv[] )
 					printf("getsize failed!\n");
 				}
 			} else {
-				printf("use: getsize <inumber>\n");
+				printf("use: getsize <inumber>|<path>\n");
 			}
 			
 		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
+			if(args==1 || args==2) {
 				inumber = fs_create();
+				if(inumber>0 && args==2 && !fs_link(arg1,inumber)) {
+					fs_delete(inumber);
+					inumber = 0;
+				}
 				if(inumber>0) {
 					printf("created inode %d\n",inumber);
 				} else {
 					printf("create failed!\n");
 				}
 			} else {
-				printf("use: create\n");
+				printf("use: create [path]\n");
 			}
 		} else if(!strcmp(cmd,"delete")) {
 			if(args==2) {
-				inumber = atoi(arg1);
+				inumber = do_inumber(arg1);
 				if(fs_delete(inumber)) {
 					printf("inode %d deleted.\n",inumber);
 				} else {
 					printf("delete failed!\n");	
 				}
 			} else {
-				printf("use: delete <inumber>\n");
+				printf("use: delete <inumber>|<path>\n");
+			}
+		} else if(!strcmp(cmd,"clone")) {
+			if(args==2) {
+				inumber = do_inumber(arg1);
+				result = fs_clone(inumber);
+				if(result>0) {
+					printf("cloned inode %d to inode %d\n",inumber,result);
+				} else {
+					printf("clone failed!\n");
+				}
+			} else {
+				printf("use: clone <inumber>|<path>\n");
 			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
-				inumber = atoi(arg1);
+				inumber = do_inumber(arg1);
 				if(!do_copyout(inumber,"/dev/stdout")) {
 					printf("cat failed!\n");
 				}
 			} else {
-				printf("use: cat <inumber>\n");
+				printf("use: cat <inumber>|<path>\n");
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
-				inumber = atoi(arg2);
+				inumber = do_inumber(arg2);
+				if(inumber==0 && arg2[0]=='/' && fs_mounted()) {
+					inumber = fs_create();
+					if(inumber>0 && !fs_link(arg2,inumber)) {
+						fs_delete(inumber);
+						inumber = 0;
+					}
+				}
 				if(do_copyin(arg1,inumber)) {
 					printf("copied file %s to inode %d\n",arg1,inumber);
 				} else {
 					printf("copy failed!\n");
 				}
 			} else {
-				printf("use: copyin <filename> <inumber>\n");
+				printf("use: copyin <filename> <inumber>|<path>\n");
 			}
 
 		} else if(!strcmp(cmd,"copyout")) {
 			if(args==3) {
-				inumber = atoi(arg1);
+				inumber = do_inumber(arg1);
 				if(do_copyout(inumber,arg2)) {
 					printf("copied inode %d to file %s\n",inumber,arg2);
 				} else {
 					printf("copy failed!\n");
 				}
 			} else {
-				printf("use: copyout <inumber> <filename>\n");
+				printf("use: copyout <inumber>|<path> <filename>\n");
+			}
+
+		} else if(!strcmp(cmd,"fallocate")) {
+			if(args==4) {
+				inumber = do_inumber(arg1);
+				if(fs_fallocate(inumber,atoi(arg2),atoi(arg3))) {
+					printf("reserved %d bytes of inode %d at offset %d\n",atoi(arg3),inumber,atoi(arg2));
+				} else {
+					printf("fallocate failed!\n");
+				}
+			} else {
+				printf("use: fallocate <inumber>|<path> <offset> <length>\n");
+			}
+
+		} else if(!strcmp(cmd,"compress")) {
+			if(args==3 && (!strcmp(arg2,"on") || !strcmp(arg2,"off"))) {
+				inumber = do_inumber(arg1);
+				if(fs_compress(inumber,!strcmp(arg2,"on"))) {
+					printf("compression of inode %d is %s\n",inumber,arg2);
+				} else {
+					printf("compress failed!\n");
+				}
+			} else {
+				printf("use: compress <inumber>|<path> on|off\n");
+			}
+
+		} else if(!strcmp(cmd,"dedup")) {
+			if(args==3 && (!strcmp(arg2,"on") || !strcmp(arg2,"off"))) {
+				inumber = do_inumber(arg1);
+				if(fs_dedup(inumber,!strcmp(arg2,"on"))) {
+					printf("dedup of inode %d is %s\n",inumber,arg2);
+				} else {
+					printf("dedup failed!\n");
+				}
+			} else {
+				printf("use: dedup <inumber>|<path> on|off\n");
+			}
+
+		} else if(!strcmp(cmd,"mkdir")) {
+			if(args==2) {
+				inumber = fs_mkdir(arg1);
+				if(inumber>0) {
+					printf("created directory %s as inode %d\n",arg1,inumber);
+				} else {
+					printf("mkdir failed!\n");
+				}
+			} else {
+				printf("use: mkdir <path>\n");
+			}
+
+		} else if(!strcmp(cmd,"link")) {
+			if(args==3) {
+				inumber = do_inumber(arg2);
+				if(fs_link(arg1,inumber)) {
+					printf("linked %s to inode %d\n",arg1,inumber);
+				} else {
+					printf("link failed!\n");
+				}
+			} else {
+				printf("use: link <path> <inumber>|<path>\n");
+			}
+
+		} else if(!strcmp(cmd,"unlink")) {
+			if(args==2) {
+				if(fs_unlink(arg1)) {
+					printf("unlinked %s\n",arg1);
+				} else {
+					printf("unlink failed!\n");
+				}
+			} else {
+				printf("use: unlink <path>\n");
+			}
+
+		} else if(!strcmp(cmd,"lookup")) {
+			if(args==2) {
+				inumber = fs_lookup(arg1);
+				if(inumber>0) {
+					printf("%s is inode %d\n",arg1,inumber);
+				} else {
+					printf("%s not found\n",arg1);
+				}
+			} else {
+				printf("use: lookup <path>\n");
+			}
+
+		} else if(!strcmp(cmd,"ls")) {
+			if(args==1 || args==2) {
+				inumber = do_inumber(args==2 ? arg1 : "/");
+				if(!do_ls(inumber)) {
+					printf("ls failed!\n");
+				}
+			} else {
+				printf("use: ls [<inumber>|<path>]\n");
+			}
+
+		} else if(!strcmp(cmd,"dirbench")) {
+			if(args==2 && atoi(arg1)>0) {
+				if(!do_dirbench(atoi(arg1))) {
+					printf("dirbench failed!\n");
+				}
+			} else {
+				printf("use: dirbench <entries>\n");
 			}
 
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [log]\n");
 			printf("    mount\n");
+			printf("    unmount\n");
 			printf("    debug\n");
-			printf("    create\n");
+			printf("    stats\n");
+			printf("    sync\n");
+			printf("    clean\n");
+			printf("    cleaner greedy|cost-benefit\n");
+			printf("    fsck    [check|repair] [workers]\n");
+			printf("    defrag  all|<inode> [budget]\n");
+			printf("    create  [path]\n");
 			printf("    delete  <inode>\n");
+			printf("    clone   <inode>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    fallocate <inode> <offset> <length>\n");
+			printf("    compress <inode> on|off\n");
+			printf("    dedup   <inode> on|off\n");
+			printf("    mkdir   <path>\n");
+			printf("    link    <path> <inode>\n");
+			printf("    unlink  <path>\n");
+			printf("    lookup  <path>\n");
+			printf("    ls      [inode]\n");
+			printf("    dirbench <entries>\n");
+			printf("an inode may be given by its number or by an absolute path\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -161,17 +410,29 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	if(fs_mounted()) {
+		fs_unmount();
+	}
+
 	printf("closing emulated disk.\n");
 	disk_close();
 
 	return 0;
 }
 
+// an inode given by number, or by an absolute path looked up in the directories
+static int do_inumber( const char *arg )
+{
+	if(arg[0]=='/') return fs_lookup(arg);
+	return atoi(arg);
+}
+
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
+	struct fs_file *f;
 	int offset=0, result, actual;
-	char buffer[16384];
+	char buffer[65536];
 
 	file = fopen(filename,"r");
 	if(!file) {
@@ -179,11 +440,17 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
+	f = fs_open(inumber);
+	if(!f) {
+		fclose(file);
+		return 0;
+	}
+
 	while(1) {
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = fs_write_h(f,buffer,result,offset);
 			if(actual<0) {
 				printf("ERROR: fs_write return invalid result %d\n",actual);
 				break;
@@ -198,6 +465,7 @@ static int do_copyin( const char *filename, int inumber )
 
 	printf("%d bytes copied\n",offset);
 
+	fs_close(f);
 	fclose(file);
 	return 1;
 }
@@ -205,17 +473,22 @@ static int do_copyin( const char *filename, int inumber )
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
+	struct fs_file *f;
 	int offset=0, result;
-	char buffer[16384];
+	char buffer[65536];
+
+	f = fs_open(inumber);
+	if(!f) return 0;
 
 	file = fopen(filename,"w");
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(f);
 		return 0;
 	}
 
 	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
+		result = fs_read_h(f,buffer,sizeof(buffer),offset);
 		if(result<=0) break;
 		fwrite(buffer,1,result,file);
 		offset += result;
@@ -223,7 +496,65 @@ static int do_copyout( int inumber, const char *filename )
 
 	printf("%d bytes copied\n",offset);
 
+	fs_close(f);
 	fclose(file);
 	return 1;
 }
 
+static int do_ls( int inumber )
+{
+	char name[FS_NAME_MAX+1];
+	int cookie=0, entry, count=0;
+
+	if(inumber<=0) return 0;
+
+	while(fs_readdir(inumber,&cookie,name,&entry)) {
+		printf("%8d %8d %s\n",entry,fs_getsize(entry),name);
+		count++;
+	}
+
+	printf("%d entries\n",count);
+	return 1;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// fill a new directory with names for one inode, then time lookups of names picked at random
+static int do_dirbench( int entries )
+{
+	char dir[64];
+	char path[128];
+	int i, inumber, lookups;
+	double start, linked, looked;
+
+	sprintf(dir,"/dirbench.%d",entries);
+	if(!fs_mkdir(dir)) return 0;
+	inumber = fs_create();
+	if(!inumber) return 0;
+
+	start = now();
+	for(i=0;i<entries;i++) {
+		sprintf(path,"%s/entry%d",dir,i);
+		if(!fs_link(path,inumber)) return 0;
+	}
+	linked = now()-start;
+
+	lookups = entries<100000 ? 100000 : entries;
+	start = now();
+	for(i=0;i<lookups;i++) {
+		sprintf(path,"%s/entry%d",dir,rand()%entries);
+		if(fs_lookup(path)!=inumber) {
+			printf("lookup of %s failed\n",path);
+			return 0;
+		}
+	}
+	looked = now()-start;
+
+	printf("%d entries in %s: %.2f us per link, %.2f us per lookup\n",entries,dir,linked*1e6/entries,looked*1e6/lookups);
+	return 1;
+}